@@ -0,0 +1,312 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <syslog.h>
+
+#include "logger.h"
+
+#define LOG_RING_MASK (LOG_RING_SIZE - 1)
+
+/* prefixes are copied, those of plugins vanish when the plugin is closed */
+#define LOG_PREFIX_SIZE 16
+
+/*
+ * one slot of the ring, "seq" tells who owns the slot:
+ * seq == pos      the slot is free for the producer that claimed position pos
+ * seq == pos + 1  the slot holds the message of position pos for the writer
+ */
+typedef struct {
+    unsigned long seq;
+    int level;
+    char prefix[LOG_PREFIX_SIZE];
+    char text[LOG_LINE_SIZE];
+} log_slot;
+
+static log_slot ring[LOG_RING_SIZE];
+static unsigned long head;          /* next position to claim, shared by all producers */
+static unsigned long tail;          /* next position to write, owned by the writer thread */
+static unsigned long dropped;       /* messages lost because the ring was full */
+static int level = LOG_INFO;
+static int running;
+static int stopping;
+static int sleeping;
+static sem_t wakeup;
+static pthread_t writer;
+
+/* the last message written, to collapse repetitions */
+static char last_text[LOG_LINE_SIZE];
+static char last_prefix[LOG_PREFIX_SIZE];
+static int last_valid;
+static int last_level;
+static unsigned long repeated;
+
+/******************************************************************************
+Description.: write a message to stderr and syslog right now
+Input Value.: * level.: syslog priority
+              * prefix: printed in front of the message to stderr only
+              * text..: the formatted message
+Return Value: -
+******************************************************************************/
+static void write_message(int level, const char *prefix, const char *text)
+{
+    fprintf(stderr, "%s%s", prefix, text);
+    syslog(level, "%s", text);
+}
+
+/******************************************************************************
+Description.: report how often the last message was suppressed
+Input Value.: -
+Return Value: -
+******************************************************************************/
+static void flush_repeated(void)
+{
+    char buffer[64];
+
+    if(repeated == 0)
+        return;
+
+    snprintf(buffer, sizeof(buffer), "last message repeated %lu times\n", repeated);
+    write_message(last_level, last_prefix, buffer);
+    repeated = 0;
+}
+
+/******************************************************************************
+Description.: write a message taken from the ring, identical messages that
+              follow each other are counted instead of being written
+Input Value.: slot holding the message
+Return Value: -
+******************************************************************************/
+static void consume(log_slot *slot)
+{
+    if(last_valid && slot->level == last_level &&
+       strcmp(slot->prefix, last_prefix) == 0 && strcmp(slot->text, last_text) == 0) {
+        repeated++;
+        return;
+    }
+
+    flush_repeated();
+    write_message(slot->level, slot->prefix, slot->text);
+
+    strcpy(last_text, slot->text);
+    strcpy(last_prefix, slot->prefix);
+    last_valid = 1;
+    last_level = slot->level;
+}
+
+/******************************************************************************
+Description.: write all messages that are currently in the ring
+Input Value.: -
+Return Value: number of messages taken from the ring
+******************************************************************************/
+static int drain(void)
+{
+    unsigned long lost;
+    char buffer[64];
+    int count = 0;
+
+    while(1) {
+        log_slot *slot = &ring[tail & LOG_RING_MASK];
+
+        if(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != tail + 1)
+            break;
+
+        consume(slot);
+        __atomic_store_n(&slot->seq, tail + LOG_RING_SIZE, __ATOMIC_RELEASE);
+        tail++;
+        count++;
+    }
+
+    if((lost = __atomic_exchange_n(&dropped, 0, __ATOMIC_RELAXED)) != 0) {
+        flush_repeated();
+        snprintf(buffer, sizeof(buffer), "%lu log messages dropped\n", lost);
+        write_message(LOG_WARNING, "", buffer);
+        last_valid = 0;
+    }
+
+    return count;
+}
+
+/******************************************************************************
+Description.: the writer thread, sleeps until producers signal new messages.
+              Pending repetitions are reported after one second of silence.
+Input Value.: unused
+Return Value: unused, always NULL
+******************************************************************************/
+static void *writer_thread(void *arg)
+{
+    struct timespec timeout;
+
+    while(1) {
+        if(drain() > 0)
+            continue;
+
+        if(__atomic_load_n(&stopping, __ATOMIC_ACQUIRE))
+            break;
+
+        /* announce the sleep, then check again to not miss a message */
+        __atomic_store_n(&sleeping, 1, __ATOMIC_SEQ_CST);
+        if(__atomic_load_n(&ring[tail & LOG_RING_MASK].seq, __ATOMIC_SEQ_CST) == tail + 1) {
+            __atomic_store_n(&sleeping, 0, __ATOMIC_SEQ_CST);
+            continue;
+        }
+
+        clock_gettime(CLOCK_REALTIME, &timeout);
+        timeout.tv_sec += 1;
+        if(sem_timedwait(&wakeup, &timeout) != 0 && errno == ETIMEDOUT)
+            flush_repeated();
+
+        __atomic_store_n(&sleeping, 0, __ATOMIC_SEQ_CST);
+    }
+
+    flush_repeated();
+    return NULL;
+}
+
+/******************************************************************************
+Description.: start the writer thread, from now on messages are written
+              asynchronously. Must be called after forking to the background.
+Input Value.: -
+Return Value: -
+******************************************************************************/
+void log_init(void)
+{
+    unsigned long i;
+
+    if(running)
+        return;
+
+    for(i = 0; i < LOG_RING_SIZE; i++)
+        ring[i].seq = i;
+    head = tail = 0;
+    stopping = 0;
+
+    if(sem_init(&wakeup, 0, 0) != 0)
+        return;
+
+    if(pthread_create(&writer, NULL, writer_thread, NULL) != 0) {
+        sem_destroy(&wakeup);
+        return;
+    }
+
+    __atomic_store_n(&running, 1, __ATOMIC_RELEASE);
+    atexit(log_shutdown);
+}
+
+/******************************************************************************
+Description.: write all pending messages and stop the writer thread
+Input Value.: -
+Return Value: -
+******************************************************************************/
+void log_shutdown(void)
+{
+    if(!__atomic_exchange_n(&running, 0, __ATOMIC_ACQ_REL))
+        return;
+
+    __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+    sem_post(&wakeup);
+    pthread_join(writer, NULL);
+    sem_destroy(&wakeup);
+}
+
+/******************************************************************************
+Description.: set the most verbose syslog priority that still gets logged
+Input Value.: level, e.g. LOG_ERR or LOG_DEBUG
+Return Value: -
+******************************************************************************/
+void log_set_level(int new_level)
+{
+    __atomic_store_n(&level, (new_level < LOG_EMERG) ? LOG_EMERG : ((new_level > LOG_DEBUG) ? LOG_DEBUG : new_level), __ATOMIC_RELAXED);
+}
+
+/******************************************************************************
+Description.: get the current log level
+Input Value.: -
+Return Value: syslog priority
+******************************************************************************/
+int log_get_level(void)
+{
+    return __atomic_load_n(&level, __ATOMIC_RELAXED);
+}
+
+/******************************************************************************
+Description.: format a message and queue it for the writer thread. This never
+              blocks, if the ring is full the message gets dropped and counted.
+Input Value.: * level.: syslog priority, messages above the log level are ignored
+              * prefix: short string printed in front of the message to stderr
+              * format: printf like format string and its arguments
+Return Value: -
+******************************************************************************/
+void log_message(int msg_level, const char *prefix, const char *format, ...)
+{
+    unsigned long pos, seq;
+    log_slot *slot;
+    va_list ap;
+
+    if(msg_level > __atomic_load_n(&level, __ATOMIC_RELAXED))
+        return;
+
+    /* no writer thread, so write the message right away */
+    if(!__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+        char buffer[LOG_LINE_SIZE];
+        va_start(ap, format);
+        vsnprintf(buffer, sizeof(buffer), format, ap);
+        va_end(ap);
+        write_message(msg_level, prefix, buffer);
+        return;
+    }
+
+    /* claim a slot */
+    pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+    while(1) {
+        slot = &ring[pos & LOG_RING_MASK];
+        seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+        if(seq == pos) {
+            if(__atomic_compare_exchange_n(&head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if((long)(seq - pos) < 0) {
+            __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+            return;
+        } else {
+            pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+        }
+    }
+
+    slot->level = msg_level;
+    snprintf(slot->prefix, sizeof(slot->prefix), "%s", prefix);
+    va_start(ap, format);
+    vsnprintf(slot->text, sizeof(slot->text), format, ap);
+    va_end(ap);
+
+    /* publish it and wake up the writer only if it sleeps */
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_SEQ_CST);
+    if(__atomic_exchange_n(&sleeping, 0, __ATOMIC_SEQ_CST))
+        sem_post(&wakeup);
+}
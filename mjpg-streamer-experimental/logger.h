@@ -0,0 +1,47 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <syslog.h>
+
+/*
+ * Messages are formatted by the caller into a slot of a lock-free ring and
+ * written to stderr and syslog by a dedicated thread. The ring must be a
+ * power of two, longer messages get truncated to LOG_LINE_SIZE.
+ */
+#define LOG_RING_SIZE 256
+#define LOG_LINE_SIZE 512
+
+/*
+ * The logger functions are part of the mjpg_streamer binary, plugins resolve
+ * them at dlopen() time. Until log_init() was called and after log_shutdown()
+ * messages are written synchronously.
+ */
+void log_init(void);
+void log_shutdown(void);
+void log_set_level(int level);
+int log_get_level(void);
+void log_message(int level, const char *prefix, const char *format, ...) __attribute__((format(printf, 3, 4)));
+
+#endif
@@ -36,6 +36,7 @@
 #include <dlfcn.h>
 #include <fcntl.h>
 #include <syslog.h>
+#include <time.h>
 #include <linux/types.h>          /* for videodev2.h */
 #include <linux/videodev2.h>
 
@@ -45,6 +46,25 @@
 /* globals */
 static globals global;
 
+/* startup of the inputs, see input_start() */
+typedef struct _input_startup input_startup;
+struct _input_startup {
+    pthread_t threadID;
+    int parsed;                 /* input_options_parsed() was called */
+    struct timespec loaded, started, options, initialized, running;
+};
+static input_startup startup[MAX_INPUT_PLUGINS];
+static struct timespec launch;
+static int inputs_ready;
+static pthread_mutex_t startup_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t startup_cond = PTHREAD_COND_INITIALIZER;
+
+/* milliseconds between two CLOCK_MONOTONIC times */
+static long elapsed_ms(const struct timespec *from, const struct timespec *to)
+{
+    return (to->tv_sec - from->tv_sec) * 1000 + (to->tv_nsec - from->tv_nsec) / 1000000;
+}
+
 /******************************************************************************
 Description.: Display a help message
 Input Value.: argv[0] is the program name and the parameter progname
@@ -58,7 +78,9 @@ void help(char *progname)
             "  -o | --output \"<output-plugin.so> [parameters]\"\n" \
             " [-h | --help ]........: display this help\n" \
             " [-v | --version ].....: display version information\n" \
-            " [-b | --background]...: fork to the background, daemon mode\n", progname);
+            " [-b | --background]...: fork to the background, daemon mode\n" \
+            " [-l | --loglevel ]....: syslog priority of the most verbose messages to log,\n" \
+            "                         0 (emergencies only) ... 7 (debug), default 6\n", progname);
     fprintf(stderr, "-----------------------------------------------------------------------\n");
     fprintf(stderr, "Example #1:\n" \
             " To open an UVC webcam \"/dev/video1\" and stream it via HTTP:\n" \
@@ -102,6 +124,9 @@ void signal_handler(int sig)
     /* clean up threads */
     LOG("force cancellation of threads and cleanup resources\n");
     for(i = 0; i < global.incnt; i++) {
+        /* inputs still starting have nothing to clean up yet */
+        if(!input_ready(&global.in[i]))
+            continue;
         global.in[i].stop(i);
         /*for (j = 0; j<MAX_PLUGIN_ARGUMENTS; j++) {
             if (global.in[i].param.argv[j] != NULL) {
@@ -113,6 +138,7 @@ void signal_handler(int sig)
     for(i = 0; i < global.outcnt; i++) {
         global.out[i].stop(global.out[i].param.id);
         pthread_cond_destroy(&global.in[i].db_update);
+        pthread_cond_destroy(&global.in[i].demand);
         pthread_mutex_destroy(&global.in[i].db);
         /*for (j = 0; j<MAX_PLUGIN_ARGUMENTS; j++) {
             if (global.out[i].param.argv[j] != NULL)
@@ -121,6 +147,9 @@ void signal_handler(int sig)
     }
     usleep(1000 * 1000);
 
+    /* write what the plugins queued while they are still loaded, later messages are written right away */
+    log_shutdown();
+
     /* close handles of input plugins */
     for(i = 0; i < global.incnt; i++) {
         dlclose(global.in[i].handle);
@@ -154,6 +183,67 @@ void signal_handler(int sig)
     return;
 }
 
+/******************************************************************************
+Description.: Lets main() start the initialization of the next input. Plugins
+              call it from input_init() once they are done with getopt, which
+              is not thread safe.
+Input Value.: id of the input
+Return Value: -
+******************************************************************************/
+void input_options_parsed(int id)
+{
+    pthread_mutex_lock(&startup_mutex);
+    if(!startup[id].parsed) {
+        clock_gettime(CLOCK_MONOTONIC, &startup[id].options);
+        startup[id].parsed = 1;
+        pthread_cond_broadcast(&startup_cond);
+    }
+    pthread_mutex_unlock(&startup_mutex);
+}
+
+/******************************************************************************
+Description.: Thread that initializes and runs one input, the inputs start in
+              parallel and each goes online as soon as it is ready. Reports
+              how long the phases of the startup took.
+Input Value.: the input number
+Return Value: unused, always NULL
+******************************************************************************/
+static void *input_start(void *arg)
+{
+    int i = (int)(long)arg;
+
+    clock_gettime(CLOCK_MONOTONIC, &startup[i].started);
+    if(global.in[i].init(&global.in[i].param, i)) {
+        LOG("input_init() return value signals to exit\n");
+        closelog();
+        exit(0);
+    }
+    input_options_parsed(i);
+    clock_gettime(CLOCK_MONOTONIC, &startup[i].initialized);
+
+    syslog(LOG_INFO, "starting input plugin %s", global.in[i].plugin);
+    if(global.in[i].run(i)) {
+        LOG("can not run input plugin %d: %s\n", i, global.in[i].plugin);
+        closelog();
+        exit(EXIT_FAILURE);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &startup[i].running);
+    __atomic_store_n(&global.in[i].ready, 1, __ATOMIC_RELEASE);
+
+    LOG("input %d (%s) ready after %ld ms: loaded at %ld ms, options %ld ms, init %ld ms, run %ld ms\n",
+        i, global.in[i].plugin, elapsed_ms(&launch, &startup[i].running),
+        elapsed_ms(&launch, &startup[i].loaded), elapsed_ms(&startup[i].started, &startup[i].options),
+        elapsed_ms(&startup[i].options, &startup[i].initialized),
+        elapsed_ms(&startup[i].initialized, &startup[i].running));
+
+    pthread_mutex_lock(&startup_mutex);
+    if(++inputs_ready == global.incnt)
+        LOG("all %d inputs ready after %ld ms\n", global.incnt, elapsed_ms(&launch, &startup[i].running));
+    pthread_mutex_unlock(&startup_mutex);
+
+    return NULL;
+}
+
 int split_parameters(char *parameter_string, int *argc, char **argv)
 {
     int count = 1;
@@ -196,6 +286,9 @@ int main(int argc, char *argv[])
     char *output[MAX_OUTPUT_PLUGINS];
     int daemon = 0, i, j;
     size_t tmp = 0;
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &launch);
 
     output[0] = "output_http.so --port 8080";
     global.outcnt = 0;
@@ -216,6 +309,8 @@ int main(int argc, char *argv[])
             {"version", no_argument, 0, 0},
             {"b", no_argument, 0, 0},
             {"background", no_argument, 0, 0},
+            {"l", required_argument, 0, 0},
+            {"loglevel", required_argument, 0, 0},
             {0, 0, 0, 0}
         };
 
@@ -271,6 +366,12 @@ int main(int argc, char *argv[])
             daemon = 1;
             break;
 
+            /* l, loglevel */
+        case 10:
+        case 11:
+            log_set_level(atoi(optarg));
+            break;
+
         default:
             help(argv[0]);
             exit(EXIT_FAILURE);
@@ -287,6 +388,9 @@ int main(int argc, char *argv[])
         daemon_mode();
     }
 
+    /* start the log writer thread, it must not be created before forking */
+    log_init();
+
     /* ignore SIGPIPE (send by OS if transmitting to closed TCP sockets) */
     signal(SIGPIPE, SIG_IGN);
 
@@ -321,7 +425,8 @@ int main(int argc, char *argv[])
             closelog();
             exit(EXIT_FAILURE);
         }
-        if(pthread_cond_init(&global.in[i].db_update, NULL) != 0) {
+        if(pthread_cond_init(&global.in[i].db_update, NULL) != 0 ||
+           pthread_cond_init(&global.in[i].demand, NULL) != 0) {
             LOG("could not initialize condition variable\n");
             closelog();
             exit(EXIT_FAILURE);
@@ -331,6 +436,8 @@ int main(int argc, char *argv[])
         global.in[i].stop      = 0;
         global.in[i].buf       = NULL;
         global.in[i].size      = 0;
+        global.in[i].consumers = 0;
+        global.in[i].ready     = 0;
         global.in[i].plugin = (tmp > 0) ? strndup(input[i], tmp) : strdup(input[i]);
         global.in[i].handle = dlopen(global.in[i].plugin, RTLD_LAZY);
         if(!global.in[i].handle) {
@@ -359,6 +466,7 @@ int main(int argc, char *argv[])
         /* try to find optional command */
         global.in[i].cmd = dlsym(global.in[i].handle, "input_cmd");
         global.in[i].cmd_old = dlsym(global.in[i].handle, "input_cmd_old");
+        global.in[i].enumerate = dlsym(global.in[i].handle, "input_enumerate");
 
         global.in[i].param.parameters = strchr(input[i], ' ');
 
@@ -369,12 +477,25 @@ int main(int argc, char *argv[])
         split_parameters(global.in[i].param.parameters, &global.in[i].param.argc, global.in[i].param.argv);
         global.in[i].param.global = &global;
         global.in[i].param.id = i;
+        clock_gettime(CLOCK_MONOTONIC, &startup[i].loaded);
+    }
 
-        if(global.in[i].init(&global.in[i].param, i)) {
-            LOG("input_init() return value signals to exit\n");
+    /*
+     * initialize the inputs in parallel, opening a camera and querying its
+     * formats takes a while. Only the option parsing is done one at a time.
+     */
+    for(i = 0; i < global.incnt; i++) {
+        if(pthread_create(&startup[i].threadID, NULL, input_start, (void *)(long)i) != 0) {
+            LOG("could not start input plugin %s\n", global.in[i].plugin);
             closelog();
-            exit(0);
+            exit(EXIT_FAILURE);
         }
+        pthread_detach(startup[i].threadID);
+
+        pthread_mutex_lock(&startup_mutex);
+        while(!startup[i].parsed)
+            pthread_cond_wait(&startup_cond, &startup_mutex);
+        pthread_mutex_unlock(&startup_mutex);
     }
 
     /* open output plugin */
@@ -425,22 +546,14 @@ int main(int argc, char *argv[])
         }
     }
 
-    /* start to read the input, push pictures into global buffer */
-    DBG("starting %d input plugin\n", global.incnt);
-    for(i = 0; i < global.incnt; i++) {
-        syslog(LOG_INFO, "starting input plugin %s", global.in[i].plugin);
-        if(global.in[i].run(i)) {
-            LOG("can not run input plugin %d: %s\n", i, global.in[i].plugin);
-            closelog();
-            return 1;
-        }
-    }
-
+    /* the inputs are started by their input_start() threads meanwhile */
     DBG("starting %d output plugin(s)\n", global.outcnt);
     for(i = 0; i < global.outcnt; i++) {
         syslog(LOG_INFO, "starting output plugin: %s (ID: %02d)", global.out[i].plugin, global.out[i].param.id);
         global.out[i].run(global.out[i].param.id);
     }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    LOG("outputs running after %ld ms\n", elapsed_ms(&launch, &now));
 
     /* wait for signals */
     pause();
@@ -38,7 +38,8 @@
 #define DBG(...)
 #endif
 
-#define LOG(...) { char _bf[1024] = {0}; snprintf(_bf, sizeof(_bf)-1, __VA_ARGS__); fprintf(stderr, "%s", _bf); syslog(LOG_INFO, "%s", _bf); }
+#include "logger.h"
+#define LOG(...) log_message(LOG_INFO, "", __VA_ARGS__)
 
 #include "plugins/input.h"
 #include "plugins/output.h"
@@ -53,6 +54,11 @@ typedef enum {
     Dest_Program = 2,
 } command_dest;
 
+/* commands handled by the program itself (Dest_Program) */
+enum _program_cmd {
+    PROG_CMD_LOGLEVEL = 1,    /* set the log level to the value, report the current one */
+};
+
 /* commands which can be send to the input plugin */
 typedef enum _cmd_group cmd_group;
 enum _cmd_group {
@@ -61,6 +67,8 @@ enum _cmd_group {
     IN_CMD_RESOLUTION =     2,
     IN_CMD_JPEG_QUALITY =   3,
     IN_CMD_PWC =            4,
+    IN_CMD_FRAMERATE =      5, // value is the frame rate limit in 1/1000 fps, 0 for none
+    IN_CMD_PANTILT =        6, // pan/tilt motors, moves are queued and the command returns at once
 };
 
 typedef struct _control control;
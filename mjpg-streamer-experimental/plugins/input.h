@@ -21,9 +21,14 @@
 *******************************************************************************/
 
 #include <syslog.h>
+#include <string.h>
 #include "../mjpg_streamer.h"
 #define INPUT_PLUGIN_PREFIX " i: "
-#define IPRINT(...) { char _bf[1024] = {0}; snprintf(_bf, sizeof(_bf)-1, __VA_ARGS__); fprintf(stderr, "%s", INPUT_PLUGIN_PREFIX); fprintf(stderr, "%s", _bf); syslog(LOG_INFO, "%s", _bf); }
+#define IPRINT(...) log_message(LOG_INFO, INPUT_PLUGIN_PREFIX, __VA_ARGS__)
+
+#ifndef V4L2_PIX_FMT_H264
+#define V4L2_PIX_FMT_H264 v4l2_fourcc('H', '2', '6', '4')
+#endif
 
 /* parameters for input plugin */
 typedef struct _input_parameter input_parameter;
@@ -86,6 +91,26 @@ struct _input_format {
     char currentResolution;
 };
 
+/* capture statistics, inputs that can not tell leave them zero */
+typedef struct _input_stats input_stats;
+struct _input_stats {
+    unsigned long frames;           /* frames received from the device */
+    unsigned long drops;            /* frames the driver lost, from sequence gaps */
+    int buffers;                    /* capture buffers in use */
+    int queue_depth;                /* buffers queued to the driver after the last dequeue */
+    unsigned long long wait_total;  /* microseconds spent waiting for frames */
+    unsigned long wait_max;         /* longest wait for a frame in microseconds */
+    unsigned long reconnects;       /* times the device came back after it was lost */
+    unsigned long recovery_time;    /* milliseconds the device was lost the last time */
+    unsigned long switch_time;      /* milliseconds the last resolution change paused the capture */
+    unsigned long corrupt;          /* MJPEG frames dropped because they failed validation */
+    unsigned long published;        /* frames handed to the consumers */
+    unsigned long long latency_total; /* microseconds from capture to publishing, summed up */
+    unsigned long latency_max;      /* longest time from capture to publishing in microseconds */
+    unsigned long long cpu_time;    /* microseconds of CPU time the threads of the input used */
+    unsigned long keyframes;        /* H.264 keyframes published */
+};
+
 /* structure to store variables/functions for input plugin */
 typedef struct _input input;
 struct _input {
@@ -110,16 +135,132 @@ struct _input {
     unsigned char *buf;
     int size;
 
+    /*
+     * a frame may be published without copying it, then a segment that is
+     * missing in "buf" is given separately: "insert_size" bytes of "insert"
+     * belong in front of byte "insert_at" of "buf". "size" is the size of the
+     * complete frame. Use input_copy_frame() to get the frame.
+     */
+    const unsigned char *insert;
+    int insert_size;
+    int insert_at;
+
     /* v4l2_buffer timestamp */
     struct timeval timestamp;
 
+    /* set while the device is lost, "buf" keeps the last frame meanwhile */
+    int stale;
+
+    /* size of the frame in "buf", "format_seq" counts the changes of it */
+    int width, height;
+    unsigned int format_seq;
+
+    /*
+     * what "buf" holds, 0 or V4L2_PIX_FMT_MJPEG for JPEG pictures and
+     * V4L2_PIX_FMT_H264 for H.264 access units in byte stream format. H.264
+     * frames refer to the previous ones: a consumer has to start with a frame
+     * that has "keyframe" set and must not miss any frame after it.
+     */
+    unsigned int fourcc;
+    int keyframe;
+
+    /* updated together with the frame, read while holding "db" */
+    input_stats stats;
+
+    /*
+     * consumers that currently want frames, changed atomically with
+     * input_attach() and input_detach(). Inputs may stop capturing while
+     * there are none and wait for "demand" to be signalled.
+     */
+    int consumers;
+    pthread_cond_t demand;
+
     input_format *in_formats;
     int formatCount;
     int currentFormat; // holds the current format number
 
+    /*
+     * inputs are started in parallel, "ready" is set once init and run of
+     * this one succeeded. Until then only the frame fields above may be used.
+     */
+    int ready;
+
     int (*init)(input_parameter *, int id);
     int (*stop)(int);
     int (*run)(int);
     int (*cmd)(int plugin, unsigned int control_id, unsigned int group, int value, char *value_str);
     int (*cmd_old)(in_cmd_type, int id, int value);
+    int (*enumerate)(int id);   /* optional, fills in_parameters on first use */
 };
+
+/*
+ * Called by input_init() once it is done with getopt and its option
+ * variables, the next input is initialized in parallel from then on. Inputs
+ * that do not call it are initialized one after the other. Part of the
+ * mjpg_streamer binary like the logger.
+ */
+void input_options_parsed(int id);
+
+/* tells if the input finished its startup, see "ready" */
+static inline int input_ready(input *in)
+{
+    return __atomic_load_n(&in->ready, __ATOMIC_ACQUIRE);
+}
+
+/* tells if the frames of an input are H.264 instead of JPEG, see "fourcc" */
+static inline int input_is_h264(input *in)
+{
+    return in->fourcc == V4L2_PIX_FMT_H264;
+}
+
+/*
+ * copy the current frame of an input, the caller must hold "db" and
+ * "out" must be able to hold "size" bytes. Returns the size of the frame.
+ */
+static inline int input_copy_frame(input *in, unsigned char *out)
+{
+    if(in->insert == NULL) {
+        memcpy(out, in->buf, in->size);
+    } else {
+        memcpy(out, in->buf, in->insert_at);
+        memcpy(out + in->insert_at, in->insert, in->insert_size);
+        memcpy(out + in->insert_at + in->insert_size, in->buf + in->insert_at,
+               in->size - in->insert_at - in->insert_size);
+    }
+    return in->size;
+}
+
+/*
+ * record the size of the frame about to be published, the caller must hold
+ * "db". A size different from the one of the previous frame counts as a
+ * format change, consumers compare "format_seq" to notice it.
+ */
+static inline void input_set_format(input *in, int width, int height)
+{
+    if(in->width != width || in->height != height) {
+        in->width = width;
+        in->height = height;
+        in->format_seq++;
+    }
+}
+
+/*
+ * register interest in the frames of an input for as long as frames are
+ * read from it, an input that captures on demand resumes then
+ */
+static inline void input_attach(input *in)
+{
+    __atomic_add_fetch(&in->consumers, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_lock(&in->db);
+    pthread_cond_broadcast(&in->demand);
+    pthread_mutex_unlock(&in->db);
+}
+
+/*
+ * withdraw the interest registered with input_attach(), does not lock "db"
+ * so it is safe in cleanup handlers of threads cancelled while holding it
+ */
+static inline void input_detach(input *in)
+{
+    __atomic_sub_fetch(&in->consumers, 1, __ATOMIC_SEQ_CST);
+}
@@ -0,0 +1,309 @@
+/*******************************************************************************
+# Linux-UVC streaming input-plugin for MJPG-streamer                           #
+#                                                                              #
+# This package work with the Logitech UVC based webcams with the mjpeg feature #
+#                                                                              #
+#   Copyright (C) 2007  Tom Stöveken                                           #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; either version 2 of the License, or            #
+# (at your option) any later version.                                          #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "v4l2uvc.h"
+#include "controls.h"
+
+/******************************************************************************
+Description.: sets a single control, for drivers without VIDIOC_S_EXT_CTRLS
+Input Value.: * fd.....: the device
+              * request: the control and its value
+Return Value: 0 if ok, -1 in case of error
+******************************************************************************/
+static int apply_control(int fd, control_request *request)
+{
+    struct v4l2_ext_controls ext_ctrls;
+    struct v4l2_ext_control ext_ctrl;
+    struct v4l2_control control_s;
+
+    if(V4L2_CTRL_ID2CLASS(request->id) == V4L2_CTRL_CLASS_USER && request->type != V4L2_CTRL_TYPE_INTEGER64) {
+        control_s.id = request->id;
+        control_s.value = request->value;
+        return (xioctl(fd, VIDIOC_S_CTRL, &control_s) < 0) ? -1 : 0;
+    }
+
+    memset(&ext_ctrls, 0, sizeof(ext_ctrls));
+    memset(&ext_ctrl, 0, sizeof(ext_ctrl));
+    ext_ctrl.id = request->id;
+    if(request->type == V4L2_CTRL_TYPE_INTEGER64)
+        ext_ctrl.value64 = request->value;
+    else
+        ext_ctrl.value = request->value;
+    ext_ctrls.ctrl_class = V4L2_CTRL_ID2CLASS(request->id);
+    ext_ctrls.count = 1;
+    ext_ctrls.controls = &ext_ctrl;
+    return (xioctl(fd, VIDIOC_S_EXT_CTRLS, &ext_ctrls) < 0) ? -1 : 0;
+}
+
+/******************************************************************************
+Description.: Sets controls with one VIDIOC_S_EXT_CTRLS per control class,
+              older drivers require the controls of a call to share their
+              class. If a batch fails each of its controls is set on its own,
+              so one bad value does not keep the others from being applied.
+Input Value.: * fd.............: the device
+              * requests, count: the controls and their values
+Return Value: number of controls that could not be set, they are marked
+              as "failed"
+******************************************************************************/
+int apply_controls(int fd, control_request *requests, int count)
+{
+    struct v4l2_ext_control ext_ctrl[MAX_PENDING_CONTROLS];
+    struct v4l2_ext_controls ext_ctrls;
+    int done[MAX_PENDING_CONTROLS] = {0};
+    int batch[MAX_PENDING_CONTROLS];
+    int i, j, n, failed = 0;
+    unsigned int class;
+
+    for(i = 0; i < count && i < MAX_PENDING_CONTROLS; i++) {
+        if(done[i])
+            continue;
+
+        /* collect the controls of this class */
+        class = V4L2_CTRL_ID2CLASS(requests[i].id);
+        memset(ext_ctrl, 0, sizeof(ext_ctrl));
+        for(j = i, n = 0; j < count && j < MAX_PENDING_CONTROLS; j++) {
+            if(done[j] || V4L2_CTRL_ID2CLASS(requests[j].id) != class)
+                continue;
+            ext_ctrl[n].id = requests[j].id;
+            if(requests[j].type == V4L2_CTRL_TYPE_INTEGER64)
+                ext_ctrl[n].value64 = requests[j].value;
+            else
+                ext_ctrl[n].value = requests[j].value;
+            batch[n++] = j;
+            done[j] = 1;
+        }
+
+        memset(&ext_ctrls, 0, sizeof(ext_ctrls));
+        ext_ctrls.ctrl_class = class;
+        ext_ctrls.count = n;
+        ext_ctrls.controls = ext_ctrl;
+        if(xioctl(fd, VIDIOC_S_EXT_CTRLS, &ext_ctrls) == 0) {
+            for(j = 0; j < n; j++)
+                requests[batch[j]].failed = 0;
+            continue;
+        }
+
+        DBG("setting %d controls of class 0x%08x at once failed, setting them one by one\n", n, class);
+        for(j = 0; j < n; j++) {
+            requests[batch[j]].failed = (apply_control(fd, &requests[batch[j]]) < 0);
+            if(requests[batch[j]].failed) {
+                DBG("control id: 0x%08x failed to set value %d\n", requests[batch[j]].id, requests[batch[j]].value);
+                failed++;
+            }
+        }
+    }
+
+    return failed;
+}
+
+/******************************************************************************
+Description.: reads the value a control really has on the device
+Input Value.: * fd.....: the device
+              * request: the control, its value gets updated
+Return Value: 0 if ok, -1 in case of error
+******************************************************************************/
+static int read_control(int fd, control_request *request)
+{
+    struct v4l2_ext_controls ext_ctrls;
+    struct v4l2_ext_control ext_ctrl;
+
+    memset(&ext_ctrls, 0, sizeof(ext_ctrls));
+    memset(&ext_ctrl, 0, sizeof(ext_ctrl));
+    ext_ctrl.id = request->id;
+    ext_ctrls.ctrl_class = V4L2_CTRL_ID2CLASS(request->id);
+    ext_ctrls.count = 1;
+    ext_ctrls.controls = &ext_ctrl;
+    if(xioctl(fd, VIDIOC_G_EXT_CTRLS, &ext_ctrls) < 0)
+        return -1;
+
+    request->value = (request->type == V4L2_CTRL_TYPE_INTEGER64) ? ext_ctrl.value64 : ext_ctrl.value;
+    return 0;
+}
+
+/******************************************************************************
+Description.: Worker thread, applies all queued values in one go. The capture
+              thread closes and reopens the device, so the ioctls run while
+              it is held in wait_capture(). While the device is lost nothing
+              is sent, reconnect_device() restores the cached values.
+Input Value.: the worker
+Return Value: unused, always NULL
+******************************************************************************/
+static void *control_thread(void *arg)
+{
+    control_worker *worker = arg;
+    control_request batch[MAX_PENDING_CONTROLS];
+    int refreshed[MAX_PENDING_CONTROLS];
+    int count, refresh, i, j;
+
+    pthread_mutex_lock(&worker->mutex);
+    while(1) {
+        while(!worker->stop && worker->count == 0)
+            pthread_cond_wait(&worker->work, &worker->mutex);
+        if(worker->stop)
+            break;
+
+        count = worker->count;
+        memcpy(batch, worker->pending, count * sizeof(control_request));
+        worker->count = 0;
+        worker->batches++;
+        pthread_cond_broadcast(&worker->room);
+        pthread_mutex_unlock(&worker->mutex);
+
+        refresh = 0;
+        lock_capture(worker->vd);
+        if(!worker->vd->lost && worker->vd->fd >= 0 &&
+           apply_controls(worker->vd->fd, batch, count) > 0) {
+            for(i = 0; i < count; i++) {
+                refreshed[i] = (batch[i].failed && read_control(worker->vd->fd, &batch[i]) == 0);
+                refresh += refreshed[i];
+            }
+        }
+        unlock_capture(worker->vd);
+
+        pthread_mutex_lock(&worker->mutex);
+
+        /* the cache was updated when the values were queued, correct it for failures */
+        for(i = 0; refresh > 0 && i < count; i++) {
+            if(!refreshed[i])
+                continue;
+
+            /* a newer value is queued already, it is reported until it failed as well */
+            for(j = 0; j < worker->count; j++) {
+                if(worker->pending[j].id == batch[i].id)
+                    break;
+            }
+            if(j < worker->count)
+                continue;
+
+            for(j = 0; j < worker->in->parametercount; j++) {
+                if(worker->in->in_parameters[j].group == IN_CMD_V4L2 &&
+                   worker->in->in_parameters[j].ctrl.id == batch[i].id)
+                    worker->in->in_parameters[j].value = batch[i].value;
+            }
+        }
+    }
+    pthread_mutex_unlock(&worker->mutex);
+
+    return NULL;
+}
+
+/******************************************************************************
+Description.: starts the control worker of a device
+Input Value.: * vd: the device
+              * in: the input whose in_parameters cache the control values
+Return Value: the worker or NULL in case of error
+******************************************************************************/
+control_worker *control_worker_start(struct vdIn *vd, input *in)
+{
+    control_worker *worker;
+
+    if((worker = calloc(1, sizeof(control_worker))) == NULL)
+        return NULL;
+
+    worker->vd = vd;
+    worker->in = in;
+    pthread_mutex_init(&worker->mutex, NULL);
+    pthread_cond_init(&worker->work, NULL);
+    pthread_cond_init(&worker->room, NULL);
+    if(pthread_create(&worker->threadID, NULL, control_thread, worker) != 0) {
+        pthread_cond_destroy(&worker->room);
+        pthread_cond_destroy(&worker->work);
+        pthread_mutex_destroy(&worker->mutex);
+        free(worker);
+        return NULL;
+    }
+
+    return worker;
+}
+
+/******************************************************************************
+Description.: Queues a new value for a control and returns at once. The cached
+              value is updated right away, so it is reported before the device
+              got it. If MAX_PENDING_CONTROLS other controls are pending, the
+              caller waits until the worker took them, e.g. while all controls
+              of a camera are reset.
+Input Value.: * worker: the worker
+              * ctrl..: the cached control
+              * value.: its new value
+Return Value: 0 if ok, -1 if the worker stops
+******************************************************************************/
+int control_submit(control_worker *worker, control *ctrl, int value)
+{
+    control_request *request = NULL;
+    int i;
+
+    pthread_mutex_lock(&worker->mutex);
+    while(request == NULL) {
+        if(worker->stop) {
+            pthread_mutex_unlock(&worker->mutex);
+            return -1;
+        }
+        for(i = 0; i < worker->count && request == NULL; i++) {
+            if(worker->pending[i].id == ctrl->ctrl.id) {
+                request = &worker->pending[i];
+                worker->coalesced++;
+            }
+        }
+        if(request == NULL && worker->count < MAX_PENDING_CONTROLS)
+            request = &worker->pending[worker->count++];
+        else if(request == NULL)
+            pthread_cond_wait(&worker->room, &worker->mutex);
+    }
+
+    request->id = ctrl->ctrl.id;
+    request->type = ctrl->ctrl.type;
+    request->value = value;
+    request->failed = 0;
+    ctrl->value = value;
+    worker->queued++;
+    pthread_cond_signal(&worker->work);
+    pthread_mutex_unlock(&worker->mutex);
+
+    return 0;
+}
+
+/******************************************************************************
+Description.: stops the worker, values still pending get lost
+Input Value.: the worker
+Return Value: -
+******************************************************************************/
+void control_worker_stop(control_worker *worker)
+{
+    pthread_mutex_lock(&worker->mutex);
+    worker->stop = 1;
+    pthread_cond_signal(&worker->work);
+    pthread_cond_broadcast(&worker->room);
+    pthread_mutex_unlock(&worker->mutex);
+
+    pthread_join(worker->threadID, NULL);
+    DBG("controls: %lu queued, %lu coalesced, %lu batches\n", worker->queued, worker->coalesced, worker->batches);
+    pthread_cond_destroy(&worker->room);
+    pthread_cond_destroy(&worker->work);
+    pthread_mutex_destroy(&worker->mutex);
+    free(worker);
+}
@@ -0,0 +1,67 @@
+/*******************************************************************************
+# Linux-UVC streaming input-plugin for MJPG-streamer                           #
+#                                                                              #
+# This package work with the Logitech UVC based webcams with the mjpeg feature #
+#                                                                              #
+#   Copyright (C) 2007  Tom Stöveken                                           #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; either version 2 of the License, or            #
+# (at your option) any later version.                                          #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#ifndef CONTROLS_H
+#define CONTROLS_H
+
+#include <pthread.h>
+
+#include "v4l2uvc.h"
+
+#define MAX_PENDING_CONTROLS 32
+
+/* a value to set on the device */
+typedef struct _control_request control_request;
+struct _control_request {
+    unsigned int id;
+    int type;                   /* V4L2_CTRL_TYPE_* */
+    int value;
+    int failed;                 /* set by apply_controls() */
+};
+
+/*
+ * Control ioctls may take tens of milliseconds on the USB control endpoint.
+ * HTTP threads only queue the new values, the worker thread of the device
+ * applies them. A value queued for a control that is still pending replaces
+ * the older one, so the worker only sets the latest position of a slider.
+ */
+typedef struct _control_worker control_worker;
+struct _control_worker {
+    struct vdIn *vd;
+    input *in;                  /* its in_parameters cache the values */
+    pthread_t threadID;
+    pthread_mutex_t mutex;
+    pthread_cond_t work;        /* a request was queued or the worker stops */
+    pthread_cond_t room;        /* the worker took the pending requests */
+    control_request pending[MAX_PENDING_CONTROLS];
+    int count;
+    int stop;
+    unsigned long queued, coalesced, batches;
+};
+
+int apply_controls(int fd, control_request *requests, int count);
+control_worker *control_worker_start(struct vdIn *vd, input *in);
+int control_submit(control_worker *worker, control *ctrl, int value);
+void control_worker_stop(control_worker *worker);
+
+#endif
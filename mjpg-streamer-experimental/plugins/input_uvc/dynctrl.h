@@ -24,7 +24,7 @@
 #include <linux/uvcvideo.h>
 #include "dynctrl-logitech.h"
 
-#define ONE_DEGREE (64);
+#define ONE_DEGREE (64)
 #define MAX_PAN  (70*64)
 #define MIN_PAN  (-70*64)
 #define MAX_TILT (30*64)
@@ -0,0 +1,268 @@
+/*******************************************************************************
+# Linux-UVC streaming input-plugin for MJPG-streamer                           #
+#                                                                              #
+# This package work with the Logitech UVC based webcams with the mjpeg feature #
+#                                                                              #
+#   Copyright (C) 2007  Tom Stöveken                                           #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; either version 2 of the License, or            #
+# (at your option) any later version.                                          #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+#ifndef NO_LIBJPEG
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "v4l2uvc.h"
+#include "jpeg_utils.h"
+#include "encoder.h"
+
+/******************************************************************************
+Description.: finds the slot in the given state that was submitted first
+Input Value.: * pool.: the pool, its mutex must be held
+              * state: the state to look for
+Return Value: the slot or NULL if no slot is in this state
+******************************************************************************/
+static encoder_slot *oldest_slot(encoder_pool *pool, slot_state state)
+{
+    encoder_slot *oldest = NULL;
+    int i;
+
+    for(i = 0; i < pool->slot_count; i++) {
+        if(pool->slots[i].state == state &&
+           (oldest == NULL || pool->slots[i].order < oldest->order))
+            oldest = &pool->slots[i];
+    }
+    return oldest;
+}
+
+/******************************************************************************
+Description.: publishes the encoded frames in the order they were taken, a
+              frame waits until all frames taken before it are published
+Input Value.: the pool, its mutex must be held
+Return Value: -
+******************************************************************************/
+static void publish_ready(encoder_pool *pool)
+{
+    encoder_slot *slot;
+    int i;
+
+    while(1) {
+        for(i = 0, slot = NULL; i < pool->slot_count && slot == NULL; i++) {
+            if(pool->slots[i].state == SLOT_DONE && pool->slots[i].seq == pool->published)
+                slot = &pool->slots[i];
+        }
+        if(slot == NULL)
+            return;
+
+        /* a frame that could not be compressed is skipped */
+        if(slot->size < 0) {
+            slot->state = SLOT_FREE;
+            pool->published++;
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->in->db);
+        memcpy(pool->in->buf, slot->jpeg, slot->size);
+        pool->in->size = slot->size;
+        pool->in->timestamp = slot->timestamp;
+        account_publish(&pool->timing, slot->captured);
+        pool->in->stats = slot->stats;
+        pool->in->stats.published = pool->timing.published;
+        pool->in->stats.latency_total = pool->timing.latency_total;
+        pool->in->stats.latency_max = pool->timing.latency_max;
+        pool->in->stats.cpu_time += pool->timing.cpu_time;
+        pool->in->stale = 0;
+        input_set_format(pool->in, slot->width, slot->height);
+        pthread_cond_broadcast(&pool->in->db_update);
+        pthread_mutex_unlock(&pool->in->db);
+
+        slot->state = SLOT_FREE;
+        pool->published++;
+    }
+}
+
+/******************************************************************************
+Description.: encoder thread, keeps its compressor for all frames it encodes
+Input Value.: the pool
+Return Value: unused, always NULL
+******************************************************************************/
+static void *encoder_thread(void *arg)
+{
+    encoder_pool *pool = arg;
+    jpeg_encoder encoder;
+    encoder_slot *slot;
+    unsigned long long cpu;
+    int size;
+
+    if(jpeg_encoder_init(&encoder, pool->codec) < 0) {
+        fprintf(stderr, "could not create a %s compressor, using libjpeg\n", jpeg_codec_name(pool->codec));
+        jpeg_encoder_init(&encoder, CODEC_LIBJPEG);
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    while(1) {
+        while(!pool->stop && (slot = oldest_slot(pool, SLOT_PENDING)) == NULL)
+            pthread_cond_wait(&pool->work, &pool->mutex);
+        if(pool->stop)
+            break;
+
+        slot->state = SLOT_ENCODING;
+        slot->seq = pool->taken++;
+        pthread_mutex_unlock(&pool->mutex);
+
+        cpu = thread_cpu_time();
+        size = compress_frame_to_jpeg(&encoder, slot->raw, slot->width, slot->height, slot->format,
+                                      slot->jpeg, slot->jpeg_size, slot->quality);
+        cpu = thread_cpu_time() - cpu;
+
+        pthread_mutex_lock(&pool->mutex);
+        pool->timing.cpu_time += cpu;
+        slot->size = size;
+        slot->state = SLOT_DONE;
+        publish_ready(pool);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    jpeg_encoder_destroy(&encoder);
+    return NULL;
+}
+
+/******************************************************************************
+Description.: starts the encoder threads
+Input Value.: * in.....: the input that publishes the encoded frames
+              * threads: number of encoder threads
+              * codec..: library the threads compress with
+Return Value: the pool or NULL in case of error
+******************************************************************************/
+encoder_pool *encoder_start(input *in, int threads, jpeg_codec codec)
+{
+    encoder_pool *pool;
+
+    if((pool = calloc(1, sizeof(encoder_pool))) == NULL)
+        return NULL;
+
+    pool->in = in;
+    pool->codec = codec;
+    pool->slot_count = threads * 2;
+    if((pool->slots = calloc(pool->slot_count, sizeof(encoder_slot))) == NULL) {
+        free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->work, NULL);
+
+    for(pool->threads = 0; pool->threads < threads; pool->threads++) {
+        if(pthread_create(&pool->threadID[pool->threads], NULL, encoder_thread, pool) != 0) {
+            encoder_stop(pool);
+            return NULL;
+        }
+    }
+
+    return pool;
+}
+
+/******************************************************************************
+Description.: hands the current raw frame of the device to the encoders. If all
+              slots are busy the oldest frame not yet taken gets replaced, if
+              there is none the new frame gets dropped. Both count as drops.
+Input Value.: * pool...: the pool
+              * vd.....: the device, vd->framebuffer holds the frame
+              * quality: JPEG quality
+Return Value: -
+******************************************************************************/
+void encoder_submit(encoder_pool *pool, struct vdIn *vd, int quality)
+{
+    encoder_slot *slot;
+    unsigned char *buffer;
+
+    pthread_mutex_lock(&pool->mutex);
+    if((slot = oldest_slot(pool, SLOT_FREE)) == NULL) {
+        vd->stats.drops++;
+        if((slot = oldest_slot(pool, SLOT_PENDING)) == NULL) {
+            pthread_mutex_unlock(&pool->mutex);
+            return;
+        }
+    }
+    slot->state = SLOT_FILLING;
+    slot->order = pool->submitted++;
+    pthread_mutex_unlock(&pool->mutex);
+
+    /* the buffers grow with the resolution */
+    if(slot->raw_size < vd->framesizeIn) {
+        if((buffer = realloc(slot->raw, vd->framesizeIn)) == NULL)
+            goto error;
+        slot->raw = buffer;
+        slot->raw_size = vd->framesizeIn;
+    }
+    if(slot->jpeg_size < vd->framesizeIn) {
+        if((buffer = realloc(slot->jpeg, vd->framesizeIn)) == NULL)
+            goto error;
+        slot->jpeg = buffer;
+        slot->jpeg_size = vd->framesizeIn;
+    }
+
+    memcpy(slot->raw, vd->framebuffer, vd->framesizeIn);
+    slot->width = vd->width;
+    slot->height = vd->height;
+    slot->format = vd->formatIn;
+    slot->quality = quality;
+    slot->timestamp = vd->buf.timestamp;
+    slot->captured = vd->captured;
+    vd->stats.cpu_time = thread_cpu_time();
+    slot->stats = vd->stats;
+
+    pthread_mutex_lock(&pool->mutex);
+    slot->state = SLOT_PENDING;
+    pthread_cond_signal(&pool->work);
+    pthread_mutex_unlock(&pool->mutex);
+    return;
+
+error:
+    fprintf(stderr, "could not allocate memory for the encoder\n");
+    pthread_mutex_lock(&pool->mutex);
+    slot->state = SLOT_FREE;
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+/******************************************************************************
+Description.: stops the encoder threads and frees the pool, frames that were
+              not encoded yet get lost
+Input Value.: the pool
+Return Value: -
+******************************************************************************/
+void encoder_stop(encoder_pool *pool)
+{
+    int i;
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for(i = 0; i < pool->threads; i++)
+        pthread_join(pool->threadID[i], NULL);
+
+    for(i = 0; i < pool->slot_count; i++) {
+        free(pool->slots[i].raw);
+        free(pool->slots[i].jpeg);
+    }
+    free(pool->slots);
+    pthread_cond_destroy(&pool->work);
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool);
+}
+#endif
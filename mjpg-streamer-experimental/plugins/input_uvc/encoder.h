@@ -0,0 +1,89 @@
+/*******************************************************************************
+# Linux-UVC streaming input-plugin for MJPG-streamer                           #
+#                                                                              #
+# This package work with the Logitech UVC based webcams with the mjpeg feature #
+#                                                                              #
+#   Copyright (C) 2007  Tom Stöveken                                           #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; either version 2 of the License, or            #
+# (at your option) any later version.                                          #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+#ifndef ENCODER_H
+#define ENCODER_H
+#ifndef NO_LIBJPEG
+
+#include <pthread.h>
+
+#include "v4l2uvc.h"
+#include "jpeg_utils.h"
+
+#define MAX_ENCODERS 16
+
+/*
+ * Raw frames wait in slots until an encoder thread takes the oldest one.
+ * The encoded frames are published in the order they were taken, so a fast
+ * encoder can not overtake a slow one.
+ */
+typedef enum _slot_state slot_state;
+enum _slot_state {
+    SLOT_FREE,
+    SLOT_FILLING,       /* the capture thread copies a frame into the slot */
+    SLOT_PENDING,       /* waits for an encoder */
+    SLOT_ENCODING,
+    SLOT_DONE,          /* waits for the frames taken before to be published */
+};
+
+typedef struct _encoder_slot encoder_slot;
+struct _encoder_slot {
+    slot_state state;
+    unsigned long order;        /* capture order, to take the oldest frame first */
+    unsigned long seq;          /* publishing order, assigned when taken */
+
+    unsigned char *raw;
+    int raw_size;
+    int width, height, format, quality;
+    struct timeval timestamp;
+    long long captured;         /* CLOCK_MONOTONIC nanoseconds */
+    input_stats stats;
+
+    unsigned char *jpeg;
+    int jpeg_size;              /* allocated */
+    int size;                   /* used */
+};
+
+typedef struct _encoder_pool encoder_pool;
+struct _encoder_pool {
+    input *in;                  /* publishes the encoded frames */
+    int threads;
+    jpeg_codec codec;
+    pthread_t threadID[MAX_ENCODERS];
+    int slot_count;             /* twice the threads, bounds the frames in flight */
+    encoder_slot *slots;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t work;        /* a slot became pending or the pool stops */
+    unsigned long submitted;
+    unsigned long taken;
+    unsigned long published;
+    input_stats timing;         /* published frames, their latency and the CPU time of the encoders */
+    int stop;
+};
+
+encoder_pool *encoder_start(input *in, int threads, jpeg_codec codec);
+void encoder_submit(encoder_pool *pool, struct vdIn *vd, int quality);
+void encoder_stop(encoder_pool *pool);
+
+#endif
+#endif
@@ -0,0 +1,149 @@
+/*******************************************************************************
+# Linux-UVC streaming input-plugin for MJPG-streamer                           #
+#                                                                              #
+# This package work with the Logitech UVC based webcams with the mjpeg feature #
+#                                                                              #
+#   Copyright (C) 2007  Tom Stöveken                                           #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; either version 2 of the License, or            #
+# (at your option) any later version.                                          #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "h264.h"
+
+/******************************************************************************
+Description.: Finds the next start code 00 00 01
+Input Value.: * frame, size: the frame
+              * pos........: where to start searching
+Return Value: offset of the first zero byte of the start code, "size" if
+              there is none
+******************************************************************************/
+static int next_start_code(const unsigned char *frame, int size, int pos)
+{
+    const unsigned char *one;
+
+    while(pos + 3 <= size) {
+        if((one = memchr(frame + pos + 2, 1, size - pos - 2)) == NULL)
+            return size;
+        pos = one - frame - 2;
+        if(frame[pos] == 0 && frame[pos + 1] == 0)
+            return pos;
+        pos++;
+    }
+
+    return size;
+}
+
+/******************************************************************************
+Description.: Walks the NAL units of an access unit up to its first slice.
+              The slice data itself is not searched, the remaining NAL units
+              are further slices of the same picture, so this costs a few
+              steps even for large keyframes.
+Input Value.: * frame, size: the access unit in byte stream format
+              * layout.....: receives what the access unit contains
+Return Value: H264_OK or the reason the frame is broken
+******************************************************************************/
+int h264_parse(const unsigned char *frame, int size, h264_layout *layout)
+{
+    int start, header, end, type;
+
+    layout->keyframe = 0;
+    layout->first = -1;
+    layout->sps = layout->pps = -1;
+    layout->sps_size = layout->pps_size = 0;
+
+    if((start = next_start_code(frame, size, 0)) >= size)
+        return H264_NO_START_CODE;
+
+    while(start < size) {
+        header = start + 3;
+        if(header >= size)
+            break;
+        type = frame[header] & 0x1f;
+
+        /* a four byte start code has one more zero in front */
+        if(type != H264_NAL_AUD && layout->first < 0)
+            layout->first = (start > 0 && frame[start - 1] == 0) ? start - 1 : start;
+
+        if(type >= H264_NAL_SLICE && type <= H264_NAL_IDR) {
+            layout->keyframe = (type == H264_NAL_IDR);
+            return H264_OK;
+        }
+
+        end = next_start_code(frame, size, header);
+
+        /* the payload never ends with a zero byte, these belong to the next start code */
+        if(type == H264_NAL_SPS || type == H264_NAL_PPS) {
+            int length = end - header;
+            while(length > 0 && frame[header + length - 1] == 0)
+                length--;
+            if(type == H264_NAL_SPS) {
+                layout->sps = header;
+                layout->sps_size = length;
+            } else {
+                layout->pps = header;
+                layout->pps_size = length;
+            }
+        }
+
+        start = end;
+    }
+
+    return H264_NO_SLICE;
+}
+
+/******************************************************************************
+Description.: Remembers SPS and PPS of a frame that carries both
+Input Value.: * frame.: the access unit
+              * layout: filled by h264_parse()
+              * params: receives copies of them
+Return Value: -
+******************************************************************************/
+void h264_keep_params(const unsigned char *frame, const h264_layout *layout, h264_params *params)
+{
+    static const unsigned char start_code[4] = { 0, 0, 0, 1 };
+
+    if(layout->sps < 0 || layout->pps < 0 ||
+       2 * sizeof(start_code) + layout->sps_size + layout->pps_size > H264_MAX_PARAMS)
+        return;
+
+    memcpy(params->data, start_code, sizeof(start_code));
+    memcpy(params->data + sizeof(start_code), frame + layout->sps, layout->sps_size);
+    params->size = sizeof(start_code) + layout->sps_size;
+    memcpy(params->data + params->size, start_code, sizeof(start_code));
+    memcpy(params->data + params->size + sizeof(start_code), frame + layout->pps, layout->pps_size);
+    params->size += sizeof(start_code) + layout->pps_size;
+}
+
+/******************************************************************************
+Description.: describes the result of h264_parse()
+Input Value.: the result
+Return Value: a constant string
+******************************************************************************/
+const char *h264_error_string(int error)
+{
+    switch(error) {
+    case H264_OK:
+        return "ok";
+    case H264_NO_START_CODE:
+        return "no start code";
+    case H264_NO_SLICE:
+        return "no slice";
+    }
+    return "unknown error";
+}
@@ -0,0 +1,71 @@
+/*******************************************************************************
+# Linux-UVC streaming input-plugin for MJPG-streamer                           #
+#                                                                              #
+# This package work with the Logitech UVC based webcams with the mjpeg feature #
+#                                                                              #
+#   Copyright (C) 2007  Tom Stöveken                                           #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; either version 2 of the License, or            #
+# (at your option) any later version.                                          #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+#ifndef H264_H
+#define H264_H
+
+/* NAL unit types that matter for passing the stream through */
+enum _h264_nal_type {
+    H264_NAL_SLICE = 1,
+    H264_NAL_IDR = 5,           /* slice of an IDR picture, a keyframe */
+    H264_NAL_SPS = 7,
+    H264_NAL_PPS = 8,
+    H264_NAL_AUD = 9            /* access unit delimiter */
+};
+
+/*
+ * What an H.264 access unit in byte stream format (Annex B) contains, the
+ * offsets are from the start of the frame. Filled by h264_parse().
+ */
+typedef struct _h264_layout h264_layout;
+struct _h264_layout {
+    int keyframe;               /* the picture is an IDR picture */
+    int first;                  /* start code of the first NAL unit that is not an AUD */
+    int sps, sps_size;          /* SPS without start code, -1 if there is none */
+    int pps, pps_size;          /* PPS without start code, -1 if there is none */
+};
+
+/* why a frame is broken */
+enum _h264_error {
+    H264_OK = 0,
+    H264_NO_START_CODE = -1,
+    H264_NO_SLICE = -2          /* there is no picture in the frame */
+};
+
+/*
+ * Most cameras repeat SPS and PPS in front of every IDR picture, some send
+ * them only once after the stream started. The last ones seen are kept here
+ * with start codes, ready to be put in front of keyframes lacking them.
+ */
+#define H264_MAX_PARAMS 256
+
+typedef struct _h264_params h264_params;
+struct _h264_params {
+    unsigned char data[H264_MAX_PARAMS];
+    int size;                   /* 0 until a frame carried both */
+};
+
+int h264_parse(const unsigned char *frame, int size, h264_layout *layout);
+void h264_keep_params(const unsigned char *frame, const h264_layout *layout, h264_params *params);
+const char *h264_error_string(int error);
+
+#endif
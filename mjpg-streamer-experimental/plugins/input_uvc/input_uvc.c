@@ -47,9 +47,12 @@
 #ifndef NO_LIBJPEG
     #include "jpeg_utils.h"
     #include "huffman.h"
+    #include "encoder.h"
 #endif
 
 #include "dynctrl.h"
+#include "controls.h"
+#include "motion.h"
 
 
 #define INPUT_PLUGIN_NAME "UVC webcam grabber"
@@ -88,12 +91,22 @@ static globals *pglobal;
 static int gquality = 80;
 static unsigned int minimum_size = 0;
 static int dynctrls = 1;
+static int zerocopy = 0;
+static int buffers = NB_BUFFER;
+static int latest = 0;
+static int stall_timeout = DEFAULT_STALL_TIMEOUT;
+static int encoders = -1;
+static int mjpeg_check = MJPEG_CHECK_MARKERS;
+static int idle_timeout = 0;
+static unsigned int idle_limit = 0;
+#ifndef NO_LIBJPEG
+static jpeg_codec codec = DEFAULT_CODEC;
+#endif
 
 void *cam_thread(void *);
 void cam_cleanup(void *);
 void help(void);
 int input_cmd(int plugin, unsigned int control, unsigned int group, int value, char *value_string);
-int uvcPanTilt(int dev, int pan, int tilt, int reset);
 
 const char *get_name_by_tvnorm(v4l2_std_id vstd) {
 	int i;
@@ -105,6 +118,26 @@ const char *get_name_by_tvnorm(v4l2_std_id vstd) {
 	return norms[0].string;
 }
 
+/******************************************************************************
+Description.: parses a frame rate, fractions like "7.5" or "1/5" are allowed
+Input Value.: the string to parse
+Return Value: the rate in 1/1000 fps, 0 if it is not valid
+******************************************************************************/
+static unsigned int parse_rate(const char *string)
+{
+    double rate;
+    char *s;
+
+    rate = strtod(string, &s);
+    if(*s == '/')
+        rate /= strtod(s + 1, NULL);
+    if(!(rate > 0) || rate * 1000 > MAX_FRAME_LIMIT) {
+        fprintf(stderr, "invalid frame rate \"%s\"\n", string);
+        return 0;
+    }
+    return (rate * 1000 < 1) ? 1 : rate * 1000 + 0.5;
+}
+
 /*** plugin interface functions ***/
 /******************************************************************************
 Description.: This function ializes the plugin. It parses the commandline-
@@ -119,6 +152,7 @@ int input_init(input_parameter *param, int id)
 {
     char *dev = "/dev/video0", *s;
     int width = 640, height = 480, fps = -1, format = V4L2_PIX_FMT_MJPEG, i;
+    unsigned int fps_requested = 0;
     v4l2_std_id tvnorm = V4L2_STD_UNKNOWN;
 
     /* initialize the mutes variable */
@@ -163,6 +197,24 @@ int input_init(input_parameter *param, int id)
             {"fourcc", required_argument, 0, 0},
             {"t", required_argument, 0, 0 },
 	        {"tvnorm", required_argument, 0, 0 },
+            {"z", no_argument, 0, 0},
+            {"zerocopy", no_argument, 0, 0},
+            {"b", required_argument, 0, 0},
+            {"buffers", required_argument, 0, 0},
+            {"L", no_argument, 0, 0},
+            {"latest", no_argument, 0, 0},
+            {"s", required_argument, 0, 0},
+            {"stall", required_argument, 0, 0},
+            {"e", required_argument, 0, 0},
+            {"encoders", required_argument, 0, 0},
+            {"c", required_argument, 0, 0},
+            {"codec", required_argument, 0, 0},
+            {"k", required_argument, 0, 0},
+            {"check", required_argument, 0, 0},
+            {"i", required_argument, 0, 0},
+            {"idle", required_argument, 0, 0},
+            {"I", required_argument, 0, 0},
+            {"idle_fps", required_argument, 0, 0},
             {0, 0, 0, 0}
         };
 
@@ -221,7 +273,9 @@ int input_init(input_parameter *param, int id)
         case 6:
         case 7:
             DBG("case 6,7\n");
-            fps = atoi(optarg);
+            if((fps_requested = parse_rate(optarg)) == 0)
+                return 1;
+            fps = (fps_requested + 999) / 1000;
             break;
 
         /* y, yuv */
@@ -269,18 +323,24 @@ int input_init(input_parameter *param, int id)
         }*/
             break;
         /* fourcc */
-        #ifndef NO_LIBJPEG
         case 18:
             DBG("case 18,19\n");
-            if (strcmp(optarg, "RGBP") == 0) {
+            if (strcmp(optarg, "H264") == 0) {
+                format = V4L2_PIX_FMT_H264;
+        #ifndef NO_LIBJPEG
+            } else if (strcmp(optarg, "RGBP") == 0) {
                 format = V4L2_PIX_FMT_RGB565;
             } else if (strcmp(optarg, "RGB3") == 0) {
                 format = V4L2_PIX_FMT_RGB24;
+            } else if (strcmp(optarg, "NV12") == 0) {
+                format = V4L2_PIX_FMT_NV12;
+            } else if (strcmp(optarg, "YU12") == 0) {
+                format = V4L2_PIX_FMT_YUV420;
+        #endif
             } else {
                 DBG("FOURCC %s not supported\n", optarg);
             }
             break;
-        #endif
         /* t, tvnorm */
         case 19:
         case 20:
@@ -293,6 +353,82 @@ int input_init(input_parameter *param, int id)
 	             tvnorm = V4L2_STD_SECAM;
             }
             break;
+        /* z, zerocopy */
+        case 21:
+        case 22:
+            DBG("case 21,22\n");
+            zerocopy = 1;
+            break;
+        /* b, buffers */
+        case 23:
+        case 24:
+            DBG("case 23,24\n");
+            buffers = atoi(optarg);
+            if(buffers < 2 || buffers > MAX_BUFFERS) {
+                IPRINT("the number of buffers must be between 2 and %d\n", MAX_BUFFERS);
+                return 1;
+            }
+            break;
+        /* L, latest */
+        case 25:
+        case 26:
+            DBG("case 25,26\n");
+            latest = 1;
+            break;
+        /* s, stall */
+        case 27:
+        case 28:
+            DBG("case 27,28\n");
+            stall_timeout = MAX(atoi(optarg), 0);
+            break;
+        /* e, encoders */
+        case 29:
+        case 30:
+            DBG("case 29,30\n");
+            #ifndef NO_LIBJPEG
+            encoders = MIN(MAX(atoi(optarg), 0), MAX_ENCODERS);
+            #endif
+            break;
+        /* c, codec */
+        case 31:
+        case 32:
+            DBG("case 31,32\n");
+            #ifndef NO_LIBJPEG
+            if((i = jpeg_codec_by_name(optarg)) < 0) {
+                IPRINT("codec %s is not available\n", optarg);
+                return 1;
+            }
+            codec = i;
+            #endif
+            break;
+        /* k, check */
+        case 33:
+        case 34:
+            DBG("case 33,34\n");
+            if(strcasecmp(optarg, "none") == 0) {
+                mjpeg_check = MJPEG_CHECK_NONE;
+            } else if(strcasecmp(optarg, "markers") == 0) {
+                mjpeg_check = MJPEG_CHECK_MARKERS;
+            } else if(strcasecmp(optarg, "restarts") == 0) {
+                mjpeg_check = MJPEG_CHECK_RESTARTS;
+            } else {
+                help();
+                return 1;
+            }
+            break;
+        /* i, idle */
+        case 35:
+        case 36:
+            DBG("case 35,36\n");
+            idle_timeout = MAX(strtod(optarg, NULL), 0) * 1000;
+            break;
+        /* I, idle_fps */
+        case 37:
+        case 38:
+            DBG("case 37,38\n");
+            if((idle_limit = parse_rate(optarg)) == 0)
+                return 1;
+            break;
         default:
             DBG("default case\n");
             help();
@@ -310,6 +446,19 @@ int input_init(input_parameter *param, int id)
         exit(EXIT_FAILURE);
     }
     memset(cams[id].videoIn, 0, sizeof(struct vdIn));
+    cams[id].videoIn->zerocopy = zerocopy;
+    cams[id].videoIn->buffers = buffers;
+    cams[id].videoIn->latest = latest;
+    cams[id].videoIn->stall_timeout = stall_timeout;
+    cams[id].videoIn->fps_requested = fps_requested;
+    cams[id].videoIn->idle_timeout = idle_timeout;
+    cams[id].videoIn->idle_limit = idle_limit;
+
+    /* H.264 frames refer to the previous ones, none may be skipped */
+    if(format == V4L2_PIX_FMT_H264) {
+        cams[id].videoIn->latest = 0;
+        cams[id].videoIn->idle_limit = 0;
+    }
 
     /* display the parsed values */
     IPRINT("Using V4L2 device.: %s\n", dev);
@@ -317,7 +466,7 @@ int input_init(input_parameter *param, int id)
     if (fps == -1) {
         IPRINT("Frames Per Second.: not limited\n");
     } else {
-        IPRINT("Frames Per Second.: %i\n", fps);
+        IPRINT("Frames Per Second.: %u.%03u\n", fps_requested / 1000, fps_requested % 1000);
     }
 
     char *fmtString = NULL;
@@ -325,6 +474,9 @@ int input_init(input_parameter *param, int id)
         case V4L2_PIX_FMT_MJPEG:
             fmtString = "JPEG";
             break;
+        case V4L2_PIX_FMT_H264:
+            fmtString = "H264, passed through";
+            break;
         #ifndef NO_LIBJPG
             case V4L2_PIX_FMT_YUYV:
                 fmtString = "YUYV";
@@ -335,6 +487,12 @@ int input_init(input_parameter *param, int id)
             case V4L2_PIX_FMT_RGB24:
                 fmtString = "RGB3";
                 break;
+            case V4L2_PIX_FMT_NV12:
+                fmtString = "NV12";
+                break;
+            case V4L2_PIX_FMT_YUV420:
+                fmtString = "YU12";
+                break;
         #endif
         default:
             fmtString = "Unknown format";
@@ -342,8 +500,10 @@ int input_init(input_parameter *param, int id)
 
     IPRINT("Format............: %s\n", fmtString);
     #ifndef NO_LIBJPEG
-        if(format != V4L2_PIX_FMT_MJPEG)
+        if(format != V4L2_PIX_FMT_MJPEG && format != V4L2_PIX_FMT_H264) {
             IPRINT("JPEG Quality......: %d\n", gquality);
+            IPRINT("JPEG codec........: %s\n", jpeg_codec_name(codec));
+        }
     #endif
 
     if (tvnorm != V4L2_STD_UNKNOWN) {
@@ -352,6 +512,22 @@ int input_init(input_parameter *param, int id)
         IPRINT("TV-Norm...........: DEFAULT\n");
     }
 
+    if(idle_timeout > 0) {
+        if(idle_limit > 0)
+            IPRINT("Without consumers.: %u.%03u fps after %d ms\n", idle_limit / 1000, idle_limit % 1000, idle_timeout);
+        else
+            IPRINT("Without consumers.: stop after %d ms\n", idle_timeout);
+    }
+
+    if(format == V4L2_PIX_FMT_MJPEG) {
+        IPRINT("Frame check.......: %s\n", (mjpeg_check == MJPEG_CHECK_RESTARTS) ? "restarts" :
+               (mjpeg_check == MJPEG_CHECK_MARKERS) ? "markers" : "none");
+    }
+
+    /* the remaining work does not touch the option variables, the next input may start */
+    cams[id].dynctrls = dynctrls;
+    input_options_parsed(id);
+
     DBG("vdIn pn: %d\n", id);
     /* open video device and prepare data structure */
     if(init_videoIn(cams[id].videoIn, dev, width, height, fps, format, 1, cams[id].pglobal, id, tvnorm) < 0) {
@@ -359,15 +535,73 @@ int input_init(input_parameter *param, int id)
         closelog();
         exit(EXIT_FAILURE);
     }
+    IPRINT("Zero-copy.........: %s\n", cams[id].videoIn->zerocopy ? "enabled" : "disabled");
+    IPRINT("Capture buffers...: %d\n", cams[id].videoIn->nbuffers);
+    IPRINT("Latest frame only.: %s\n", cams[id].videoIn->latest ? "enabled" : "disabled");
+    if(cams[id].videoIn->stall_timeout > 0) {
+        IPRINT("Stall timeout.....: %d ms\n", cams[id].videoIn->stall_timeout);
+    } else {
+        IPRINT("Stall timeout.....: %s\n", "disabled");
+    }
+    /* the controls are enumerated when they are used first, see input_enumerate() */
+
+    return 0;
+}
+
+/******************************************************************************
+Description.: Enumerates the controls of the camera when they are needed first,
+              it takes an ioctl per control and menu item and slows down the
+              startup of many cameras. Starts the threads that apply controls.
+              The ioctls run under state_mutex, while the device is lost
+              nothing is enumerated and the next call tries again.
+Input Value.: id of the input
+Return Value: 0 if ok, -1 if the device is lost
+******************************************************************************/
+int input_enumerate(int id)
+{
+    struct timespec start, end;
+    struct vdIn *vd = cams[id].videoIn;
+
+    pthread_mutex_lock(&cams[id].controls_mutex);
+    if(vd->enumerated) {
+        pthread_mutex_unlock(&cams[id].controls_mutex);
+        return 0;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    lock_capture(vd);
+    if(vd->lost || vd->fd < 0) {
+        unlock_capture(vd);
+        pthread_mutex_unlock(&cams[id].controls_mutex);
+        return -1;
+    }
+
     /*
      * recent linux-uvc driver (revision > ~#125) requires to use dynctrls
      * for pan/tilt/focus/...
      * dynctrls must get initialized
      */
-    if(dynctrls)
-        initDynCtrls(cams[id].videoIn->fd);
+    if(cams[id].dynctrls)
+        initDynCtrls(vd->fd);
+
+    enumerateControls(vd, cams[id].pglobal, id); // enumerate V4L2 controls after UVC extended mapping
+    unlock_capture(vd);
+
+    /* pan/tilt moves take seconds, they are sent to the motors in the background */
+    if(v4l2HasControl(vd, V4L2_CID_PAN_RELATIVE) &&
+       v4l2HasControl(vd, V4L2_CID_TILT_RELATIVE) &&
+       (vd->motion = motion_start(vd, &cams[id].pglobal->in[id])) == NULL)
+        IPRINT("pan/tilt is not available\n");
 
-    enumerateControls(cams[id].videoIn, cams[id].pglobal, id); // enumerate V4L2 controls after UVC extended mapping
+    /* without the worker controls are set by the thread that changes them */
+    if((vd->controls = control_worker_start(vd, &cams[id].pglobal->in[id])) == NULL)
+        IPRINT("controls are applied synchronously\n");
+
+    __atomic_store_n(&vd->enumerated, 1, __ATOMIC_RELEASE);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    IPRINT("Controls..........: %d of %s enumerated in %ld ms\n", cams[id].pglobal->in[id].parametercount,
+           vd->videodevice, (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000);
+    pthread_mutex_unlock(&cams[id].controls_mutex);
 
     return 0;
 }
@@ -380,6 +614,10 @@ Return Value: always 0
 int input_stop(int id)
 {
     DBG("will cancel camera thread #%02d\n", id);
+    wake_capture(cams[id].videoIn);
+    pthread_mutex_lock(&cams[id].pglobal->in[id].db);
+    pthread_cond_broadcast(&cams[id].pglobal->in[id].demand);
+    pthread_mutex_unlock(&cams[id].pglobal->in[id].db);
     pthread_cancel(cams[id].threadID);
     return 0;
 }
@@ -397,6 +635,35 @@ int input_run(int id)
         exit(EXIT_FAILURE);
     }
 
+    /* raw formats are published as JPEG */
+    cams[id].pglobal->in[id].fourcc = (cams[id].videoIn->formatIn == V4L2_PIX_FMT_H264) ? V4L2_PIX_FMT_H264 : V4L2_PIX_FMT_MJPEG;
+    cams[id].pglobal->in[id].keyframe = 1;
+
+    #ifndef NO_LIBJPEG
+    /* raw formats get compressed by encoder threads on all cores */
+    cams[id].encoders = NULL;
+    cams[id].jpeg = NULL;
+    if(cams[id].videoIn->formatIn != V4L2_PIX_FMT_MJPEG && cams[id].videoIn->formatIn != V4L2_PIX_FMT_H264) {
+        if(encoders < 0)
+            encoders = MIN(MAX(sysconf(_SC_NPROCESSORS_ONLN), 1), MAX_ENCODERS);
+        if(encoders > 0 && (cams[id].encoders = encoder_start(&cams[id].pglobal->in[id], encoders, codec)) == NULL) {
+            IPRINT("could not start the encoder threads\n");
+            exit(EXIT_FAILURE);
+        }
+        if(encoders == 0) {
+            if((cams[id].jpeg = malloc(sizeof(jpeg_encoder))) == NULL) {
+                fprintf(stderr, "could not allocate memory\n");
+                exit(EXIT_FAILURE);
+            }
+            if(jpeg_encoder_init(cams[id].jpeg, codec) < 0) {
+                IPRINT("could not create a %s compressor, using libjpeg\n", jpeg_codec_name(codec));
+                jpeg_encoder_init(cams[id].jpeg, CODEC_LIBJPEG);
+            }
+        }
+        IPRINT("Encoder threads...: %d\n", encoders);
+    }
+    #endif
+
     DBG("launching camera thread #%02d\n", id);
     /* create thread and pass context to thread function */
     pthread_create(&(cams[id].threadID), NULL, cam_thread, &(cams[id]));
@@ -432,31 +699,86 @@ void help(void)
     "\n                          example: 640x480\n");
 
 #ifndef NO_LIBJPEG
-    fprintf(stderr, " [-f | --fps ]..........: frames per second\n" \
+    fprintf(stderr, " [-f | --fps ]..........: frames per second, fractions like 7.5 or 1/5\n" \
     "                          (activates YUYV format, disables MJPEG)\n" \
     " [-m | --minimum_size ].: drop frames smaller then this limit, useful\n" \
     "                          if the webcam produces small-sized garbage frames\n" \
-    "                          may happen under low light conditions\n" \
+    "                          may happen under low light conditions, broken\n" \
+    "                          MJPEG frames are also found by --check\n" \
     " [-n | --no_dynctrl ]...: do not initalize dynctrls of Linux-UVC driver\n" \
     " [-l | --led ]..........: switch the LED \"on\", \"off\", let it \"blink\" or leave\n" \
     "                          it up to the driver using the value \"auto\"\n" \
+    " [-fourcc ].............: capture RGBP, RGB3, NV12 or YU12 instead of MJPEG,\n"
+    "                          or H264 which is passed through untouched\n" \
     " ---------------------------------------------------------------\n\n"
     " [-t | --tvnorm ] ......: set TV-Norm pal, ntsc or secam\n"
-    " ---------------------------------------------------------------\n\n");
+    " [-z | --zerocopy ].....: publish the MJPEG capture buffers without\n"
+    "                          copying them, one more buffer is requested\n" \
+    " [-b | --buffers ]......: number of capture buffers, default %d,\n"
+    "                          more buffers let the driver drop less frames\n" \
+    " [-L | --latest ].......: always grab the newest frame and drop the\n"
+    "                          older queued ones, for the lowest latency\n" \
+    " [-s | --stall ]........: restart the stream if no frame arrives within\n"
+    "                          this many milliseconds, default %d, 0 disables\n" \
+    " [-e | --encoders ].....: threads that compress YUYV and RGB frames,\n"
+    "                          default one per CPU, 0 compresses in the\n"
+    "                          capture thread\n"
+    " [-c | --codec ]........: library that compresses the frames, \"libjpeg\"\n"
+    "                          or \"turbojpeg\" if built with USE_TURBOJPEG,\n"
+    "                          default %s\n"
+    " [-k | --check ]........: drop MJPEG frames with broken structure,\n"
+    "                          \"none\", \"markers\" checks SOI, header and EOI\n"
+    "                          (default), \"restarts\" also the restart markers\n"
+    " [-i | --idle ].........: seconds without consumers until the capture\n"
+    "                          stops, default 0 captures all the time\n"
+    " [-I | --idle_fps ].....: keep capturing at this rate instead of stopping\n"
+    " ---------------------------------------------------------------\n\n", NB_BUFFER, DEFAULT_STALL_TIMEOUT, jpeg_codec_name(DEFAULT_CODEC));
 #else
-    fprintf(stderr, " [-f | --fps ]..........: frames per second\n" \
+    fprintf(stderr, " [-f | --fps ]..........: frames per second, fractions like 7.5 or 1/5\n" \
     "                          (activates YUYV format, disables MJPEG)\n" \
     " [-m | --minimum_size ].: drop frames smaller then this limit, useful\n" \
     "                          if the webcam produces small-sized garbage frames\n" \
-    "                          may happen under low light conditions\n" \
+    "                          may happen under low light conditions, broken\n" \
+    "                          MJPEG frames are also found by --check\n" \
     " [-n | --no_dynctrl ]...: do not initalize dynctrls of Linux-UVC driver\n" \
     " [-l | --led ]..........: switch the LED \"on\", \"off\", let it \"blink\" or leave\n" \
     "                          it up to the driver using the value \"auto\"\n" \
+    " [-fourcc ].............: capture H264 instead of MJPEG, it is passed\n"
+    "                          through untouched\n" \
     " [-t | --tvnorm ] ......: set TV-Norm pal, ntsc or secam\n"
-    " ---------------------------------------------------------------\n\n");
+    " [-z | --zerocopy ].....: publish the MJPEG capture buffers without\n"
+    "                          copying them, one more buffer is requested\n" \
+    " [-b | --buffers ]......: number of capture buffers, default %d,\n"
+    "                          more buffers let the driver drop less frames\n" \
+    " [-L | --latest ].......: always grab the newest frame and drop the\n"
+    "                          older queued ones, for the lowest latency\n" \
+    " [-s | --stall ]........: restart the stream if no frame arrives within\n"
+    "                          this many milliseconds, default %d, 0 disables\n" \
+    " [-e | --encoders ].....: threads that compress YUYV and RGB frames,\n"
+    "                          default one per CPU, 0 compresses in the\n"
+    "                          capture thread\n"
+    " [-k | --check ]........: drop MJPEG frames with broken structure,\n"
+    "                          \"none\", \"markers\" checks SOI, header and EOI\n"
+    "                          (default), \"restarts\" also the restart markers\n"
+    " [-i | --idle ].........: seconds without consumers until the capture\n"
+    "                          stops, default 0 captures all the time\n"
+    " [-I | --idle_fps ].....: keep capturing at this rate instead of stopping\n"
+    " ---------------------------------------------------------------\n\n", NB_BUFFER, DEFAULT_STALL_TIMEOUT);
 #endif
 }
 
+/******************************************************************************
+Description.: gives a frame that will not be published back to the driver,
+              only needed in zero-copy mode, otherwise it was copied already
+Input Value.: the device
+Return Value: -
+******************************************************************************/
+static void drop_frame(struct vdIn *vd)
+{
+    if(vd->zerocopy && vd->buf.bytesused > 0)
+        requeue_buffer(vd, vd->buf.index);
+}
+
 /******************************************************************************
 Description.: this thread worker grabs a frame and copies it to the global buffer
 Input Value.: unused
@@ -466,20 +788,62 @@ void *cam_thread(void *arg)
 {
 
     context *pcontext = arg;
+    int ret;
     pglobal = pcontext->pglobal;
 
     /* set cleanup handler to cleanup allocated ressources */
     pthread_cleanup_push(cam_cleanup, pcontext);
 
+    /*
+     * the state mutex is only released while waiting, so other threads
+     * can not pull the buffers away while a frame is processed
+     */
+    pthread_mutex_lock(&pcontext->videoIn->state_mutex);
+    pthread_cleanup_push((void (*)(void *))pthread_mutex_unlock, &pcontext->videoIn->state_mutex);
+
     while(!pglobal->stop) {
-        while(pcontext->videoIn->streamingState == STREAMING_PAUSED) {
-            usleep(1); // maybe not the best way so FIXME
+        wait_capture(pcontext->videoIn);
+
+        /* wait for an unplugged device, the consumers keep the last frame */
+        if(pcontext->videoIn->lost) {
+            if(reconnect_device(pcontext->videoIn, pglobal, pcontext->id) < 0) {
+                wait_device(pcontext->videoIn, RECONNECT_INTERVAL);
+                continue;
+            }
+            IPRINT("device %s is back after %lu ms\n", pcontext->videoIn->videodevice, pcontext->videoIn->stats.recovery_time);
         }
 
+        /* without consumers the capture stops or slows down */
+        if(pcontext->videoIn->idle_timeout > 0 &&
+           !wait_demand(pcontext->videoIn, &pglobal->in[pcontext->id]))
+            continue;
+
         /* grab a frame */
-        if(uvcGrab(pcontext->videoIn) < 0) {
-            IPRINT("Error grabbing frames\n");
-            exit(EXIT_FAILURE);
+        ret = uvcGrab(pcontext->videoIn);
+        if(ret == GRAB_WAKEUP)
+            continue;
+
+        if(ret < 0 || ret == GRAB_STALLED) {
+            IPRINT("%s, restarting the stream\n", (ret < 0) ? "Error grabbing frames" : "Capture stalled");
+            if(restart_stream(pcontext->videoIn) == 0)
+                continue;
+            ret = GRAB_LOST;
+        }
+
+        if(ret == GRAB_LOST) {
+            IPRINT("device %s lost, waiting for it to come back\n", pcontext->videoIn->videodevice);
+            lose_device(pcontext->videoIn);
+
+            pthread_mutex_lock(&pglobal->in[pcontext->id].db);
+            pglobal->in[pcontext->id].stale = 1;
+            /* with encoder threads these are counted by the pool */
+            pcontext->videoIn->stats.published = pglobal->in[pcontext->id].stats.published;
+            pcontext->videoIn->stats.latency_total = pglobal->in[pcontext->id].stats.latency_total;
+            pcontext->videoIn->stats.latency_max = pglobal->in[pcontext->id].stats.latency_max;
+            pglobal->in[pcontext->id].stats = pcontext->videoIn->stats;
+            pthread_cond_broadcast(&pglobal->in[pcontext->id].db_update);
+            pthread_mutex_unlock(&pglobal->in[pcontext->id].db);
+            continue;
         }
 
         //DBG("received frame of size: %d from plugin: %d\n", pcontext->videoIn->buf.bytesused, pcontext->id);
@@ -490,27 +854,59 @@ void *cam_thread(void *arg)
          * The good thing is such frames are quite small compared to the regular pictures.
          * For example a VGA (640x480) webcam picture is normally >= 8kByte large,
          * corrupted frames are smaller.
+         * H.264 frames without changes are small as well, they are kept.
          */
-        if(pcontext->videoIn->buf.bytesused < minimum_size) {
+        if(pcontext->videoIn->buf.bytesused == 0 ||
+           (pcontext->videoIn->buf.bytesused < minimum_size && pcontext->videoIn->formatIn != V4L2_PIX_FMT_H264)) {
             DBG("dropping too small frame, assuming it as broken\n");
+            drop_frame(pcontext->videoIn);
             continue;
         }
 
-        // use software frame dropping on low fps
-        if (pcontext->videoIn->soft_framedrop == 1) {
-            unsigned long last = pglobal->in[pcontext->id].timestamp.tv_sec * 1000 +
-                                (pglobal->in[pcontext->id].timestamp.tv_usec/1000); // convert to ms
-            unsigned long current = pcontext->videoIn->buf.timestamp.tv_sec * 1000 +
-                                    pcontext->videoIn->buf.timestamp.tv_usec/1000; // convert to ms
-
-            // if the requested time did not esplashed skip the frame
-            if ((current - last) < pcontext->videoIn->frame_period_time) {
-                //DBG("Last frame taken %d ms ago so drop it\n", (current - last));
+        /* truncated MJPEG frames would show up as grey bars, so check their structure */
+        if(pcontext->videoIn->formatIn == V4L2_PIX_FMT_MJPEG) {
+            unsigned char *frame = pcontext->videoIn->zerocopy ? pcontext->videoIn->mem[pcontext->videoIn->buf.index] : pcontext->videoIn->tmpbuffer;
+
+            ret = mjpeg_validate(frame, pcontext->videoIn->buf.bytesused, mjpeg_check,
+                                 &pcontext->videoIn->mjpeg_cache, &pcontext->videoIn->layout);
+            if(ret != MJPEG_OK && mjpeg_check != MJPEG_CHECK_NONE) {
+                DBG("dropping broken frame: %s\n", mjpeg_error_string(ret));
+                pcontext->videoIn->stats.corrupt++;
+                drop_frame(pcontext->videoIn);
+                continue;
+            }
+        }
+
+        /* a frame without a picture may still carry SPS and PPS for the next keyframe */
+        if(pcontext->videoIn->formatIn == V4L2_PIX_FMT_H264) {
+            ret = h264_parse(pcontext->videoIn->tmpbuffer, pcontext->videoIn->buf.bytesused, &pcontext->videoIn->h264_layout);
+            if(ret != H264_OK) {
+                DBG("dropping H.264 frame: %s\n", h264_error_string(ret));
+                if(ret == H264_NO_SLICE) {
+                    pthread_mutex_lock(&pglobal->in[pcontext->id].db);
+                    h264_keep_params(pcontext->videoIn->tmpbuffer, &pcontext->videoIn->h264_layout, &pcontext->videoIn->h264_params);
+                    pthread_mutex_unlock(&pglobal->in[pcontext->id].db);
+                } else {
+                    pcontext->videoIn->stats.corrupt++;
+                }
                 continue;
             }
-            DBG("Lagg: %ld\n", (current - last) - pcontext->videoIn->frame_period_time);
         }
 
+        // use software frame dropping on low fps
+        if(!pace_frame(pcontext->videoIn)) {
+            drop_frame(pcontext->videoIn);
+            continue;
+        }
+
+        #ifndef NO_LIBJPEG
+        /* the encoder threads compress and publish the frame */
+        if(pcontext->encoders != NULL) {
+            encoder_submit(pcontext->encoders, pcontext->videoIn, gquality);
+            continue;
+        }
+        #endif
+
         /* copy JPG picture to global buffer */
         pthread_mutex_lock(&pglobal->in[pcontext->id].db);
 
@@ -522,17 +918,32 @@ void *cam_thread(void *arg)
          */
         #ifndef NO_LIBJPEG
         if ((pcontext->videoIn->formatIn == V4L2_PIX_FMT_YUYV) ||
+            (pcontext->videoIn->formatIn == V4L2_PIX_FMT_NV12) ||
+            (pcontext->videoIn->formatIn == V4L2_PIX_FMT_YUV420) ||
             (pcontext->videoIn->formatIn == V4L2_PIX_FMT_RGB565) ||
             (pcontext->videoIn->formatIn == V4L2_PIX_FMT_RGB24)) {
             DBG("compressing frame from input: %d\n", (int)pcontext->id);
-            pglobal->in[pcontext->id].size = compress_image_to_jpeg(pcontext->videoIn, pglobal->in[pcontext->id].buf, pcontext->videoIn->framesizeIn, gquality);
-        } else {
+            int size = compress_image_to_jpeg(pcontext->jpeg, pcontext->videoIn, pglobal->in[pcontext->id].buf, pcontext->videoIn->framesizeIn, gquality);
+            if(size < 0) {
+                pthread_mutex_unlock(&pglobal->in[pcontext->id].db);
+                pcontext->videoIn->stats.drops++;
+                continue;
+            }
+            pglobal->in[pcontext->id].size = size;
+        } else
         #endif
+        if(pcontext->videoIn->formatIn == V4L2_PIX_FMT_H264) {
+            publish_h264(pcontext->videoIn, &pglobal->in[pcontext->id]);
+        } else if(pcontext->videoIn->zerocopy) {
+            /* the capture buffer itself becomes the frame */
+            if(publish_picture(pcontext->videoIn, &pglobal->in[pcontext->id]) < 0) {
+                pthread_mutex_unlock(&pglobal->in[pcontext->id].db);
+                continue;
+            }
+        } else {
             //DBG("copying frame from input: %d\n", (int)pcontext->id);
-            pglobal->in[pcontext->id].size = memcpy_picture(pglobal->in[pcontext->id].buf, pcontext->videoIn->tmpbuffer, pcontext->videoIn->buf.bytesused);
-        #ifndef NO_LIBJPEG
+            pglobal->in[pcontext->id].size = memcpy_picture(pglobal->in[pcontext->id].buf, pcontext->videoIn->tmpbuffer, pcontext->videoIn->buf.bytesused, &pcontext->videoIn->layout);
         }
-        #endif
 
 #if 0
         /* motion detection can be done just by comparing the picture size, but it is not very accurate!! */
@@ -544,6 +955,11 @@ void *cam_thread(void *arg)
 
         /* copy this frame's timestamp to user space */
         pglobal->in[pcontext->id].timestamp = pcontext->videoIn->buf.timestamp;
+        account_publish(&pcontext->videoIn->stats, pcontext->videoIn->captured);
+        pcontext->videoIn->stats.cpu_time = thread_cpu_time();
+        pglobal->in[pcontext->id].stats = pcontext->videoIn->stats;
+        pglobal->in[pcontext->id].stale = 0;
+        input_set_format(&pglobal->in[pcontext->id], pcontext->videoIn->width, pcontext->videoIn->height);
 
         /* signal fresh_frame */
         pthread_cond_broadcast(&pglobal->in[pcontext->id].db_update);
@@ -552,6 +968,7 @@ void *cam_thread(void *arg)
 
     DBG("leaving input thread, calling cleanup function now\n");
     pthread_cleanup_pop(1);
+    pthread_cleanup_pop(1);
 
     return NULL;
 }
@@ -574,6 +991,23 @@ void cam_cleanup(void *arg)
     first_run = 0;
     IPRINT("cleaning up ressources allocated by input thread\n");
 
+    if(pcontext->videoIn->motion != NULL)
+        motion_stop(pcontext->videoIn->motion);
+    pcontext->videoIn->motion = NULL;
+    if(pcontext->videoIn->controls != NULL)
+        control_worker_stop(pcontext->videoIn->controls);
+    pcontext->videoIn->controls = NULL;
+
+    #ifndef NO_LIBJPEG
+    if(pcontext->encoders != NULL)
+        encoder_stop(pcontext->encoders);
+    pcontext->encoders = NULL;
+    if(pcontext->jpeg != NULL) {
+        jpeg_encoder_destroy(pcontext->jpeg);
+        free(pcontext->jpeg);
+    }
+    pcontext->jpeg = NULL;
+    #endif
     close_v4l2(pcontext->videoIn);
     if(pcontext->videoIn->tmpbuffer != NULL) free(pcontext->videoIn->tmpbuffer);
     if(pcontext->videoIn != NULL) free(pcontext->videoIn);
@@ -594,6 +1028,7 @@ int input_cmd(int plugin_number, unsigned int control_id, unsigned int group, in
     int ret = -1;
     int i = 0;
     DBG("Requested cmd (id: %d) for the %d plugin. Group: %d value: %d\n", control_id, plugin_number, group, value);
+    input_enumerate(plugin_number);
     switch(group) {
     case IN_CMD_GENERIC: {
             int i;
@@ -609,10 +1044,15 @@ int input_cmd(int plugin_number, unsigned int control_id, unsigned int group, in
             return -1;
         } break;
     case IN_CMD_V4L2: {
+            /* relative moves are tracked and merged like the ones of IN_CMD_PANTILT */
+            if(cams[plugin_number].videoIn->motion != NULL &&
+               (control_id == V4L2_CID_PAN_RELATIVE || control_id == V4L2_CID_TILT_RELATIVE)) {
+                motion_move(cams[plugin_number].videoIn->motion,
+                            (control_id == V4L2_CID_PAN_RELATIVE) ? MOTION_PAN : MOTION_TILT, value);
+                return 0;
+            }
             ret = v4l2SetControl(cams[plugin_number].videoIn, control_id, value, plugin_number, pglobal);
-            if(ret == 0) {
-                pglobal->in[plugin_number].in_parameters[i].value = value;
-            } else {
+            if(ret != 0) {
                 DBG("v4l2SetControl failed: %d\n", ret);
             }
             return ret;
@@ -625,12 +1065,50 @@ int input_cmd(int plugin_number, unsigned int control_id, unsigned int group, in
         }
         int height = pglobal->in[plugin_number].in_formats[pglobal->in[plugin_number].currentFormat].supportedResolutions[value].height;
         int width = pglobal->in[plugin_number].in_formats[pglobal->in[plugin_number].currentFormat].supportedResolutions[value].width;
-        ret = setResolution(cams[plugin_number].videoIn, width, height);
+        ret = setResolution(cams[plugin_number].videoIn, &pglobal->in[plugin_number], width, height);
         if(ret == 0) {
             pglobal->in[plugin_number].in_formats[pglobal->in[plugin_number].currentFormat].currentResolution = value;
         }
         return ret;
     } break;
+    case IN_CMD_PANTILT:
+        if(cams[plugin_number].videoIn->motion == NULL)
+            return -1;
+        switch(control_id) {
+        case MOTION_CTRL_PAN:
+            motion_move_to(cams[plugin_number].videoIn->motion, MOTION_PAN, value * ONE_DEGREE);
+            return 0;
+        case MOTION_CTRL_TILT:
+            motion_move_to(cams[plugin_number].videoIn->motion, MOTION_TILT, value * ONE_DEGREE);
+            return 0;
+        case MOTION_CTRL_RESET:
+            return motion_reset(cams[plugin_number].videoIn->motion);
+        }
+        return -1;
+    case IN_CMD_FRAMERATE:
+        if(value < 0 || value > MAX_FRAME_LIMIT) {
+            DBG("Frame rate limit is out of range\n");
+            return -1;
+        }
+        /* while idling at idle_limit the new limit applies once consumers are back */
+        lock_capture(cams[plugin_number].videoIn);
+        if(cams[plugin_number].videoIn->idle && cams[plugin_number].videoIn->idle_limit > 0 &&
+           cams[plugin_number].videoIn->formatIn != V4L2_PIX_FMT_H264) {
+            cams[plugin_number].videoIn->busy_limit = value;
+            ret = 0;
+        } else {
+            ret = set_frame_limit(cams[plugin_number].videoIn, value);
+        }
+        unlock_capture(cams[plugin_number].videoIn);
+        if(ret < 0)
+            return -1;
+
+        cams[plugin_number].videoIn->fps_requested = value;
+        for(i = 0; i < pglobal->in[plugin_number].parametercount; i++) {
+            if(pglobal->in[plugin_number].in_parameters[i].group == IN_CMD_FRAMERATE)
+                pglobal->in[plugin_number].in_parameters[i].value = value;
+        }
+        return 0;
     case IN_CMD_JPEG_QUALITY:
         if((value >= 0) && (value < 101)) {
             pglobal->in[plugin_number].jpegcomp.quality = value;
@@ -661,9 +1139,12 @@ Return Value: depends in the command, for most cases 0 means no errors and
 ******************************************************************************/
 int input_cmd_old(in_cmd_type cmd, int id, int value) {
   int res=0;
-  static int pan=0, tilt=0, pan_tilt_valid=-1;
   static int focus=-1;
   const int one_degree = ONE_DEGREE;
+  motion *pan_tilt;
+
+  input_enumerate(id);
+  pan_tilt = cams[id].videoIn->motion;
 
   /* certain commands do not need the mutex */
   if ( cmd != IN_CMD_RESET_PAN_TILT_NO_MUTEX )
@@ -686,146 +1167,37 @@ int input_cmd_old(in_cmd_type cmd, int id, int value) {
     case IN_CMD_RESET_PAN_TILT:
     case IN_CMD_RESET_PAN_TILT_NO_MUTEX:
       DBG("about to set pan/tilt to default position\n");
-      if ( uvcPanTilt(cams[id].videoIn->fd, 0, 0, 3) != 0 ) {
-        res = -1;
-        break;
-      }
-      pan_tilt_valid = 1;
-      pan = tilt = 0;
-      sleep(4);
+      res = (pan_tilt != NULL) ? motion_reset(pan_tilt) : -1;
       break;
 
     case IN_CMD_PAN_SET:
       DBG("set pan to %d degrees\n", value);
-
-      /* in order to calculate absolute positions we must check for initialized values */
-      if ( pan_tilt_valid != 1 ) {
-        if ( input_cmd_old(IN_CMD_RESET_PAN_TILT_NO_MUTEX, id, 0) == -1 ) {
-          res = -1;
-          break;
-        }
-      }
-
-      /* limit pan-value to min and max, multiply it with constant "one_degree" */
-      value = MIN(MAX(value*one_degree, MIN_PAN), MAX_PAN);
-
-      /* calculate the relative degrees to move to the desired absolute pan-value */
-      if( (res = value - pan) == 0 ) {
-        /* do not move if this would mean to move by 0 degrees */
-        res = pan/one_degree;
-        break;
-      }
-
-      /* move it */
-      pan = value;
-      uvcPanTilt(cams[id].videoIn->fd, res, 0, 0);
-      res = pan/one_degree;
-
-      DBG("pan: %d\n", pan);
+      res = (pan_tilt != NULL) ? motion_move_to(pan_tilt, MOTION_PAN, value*one_degree)/one_degree : -1;
       break;
 
     case IN_CMD_PAN_PLUS:
       DBG("pan +\n");
-
-      if ( pan_tilt_valid != 1 ) {
-        if ( input_cmd_old(IN_CMD_RESET_PAN_TILT_NO_MUTEX, id, 0) == -1 ) {
-          res = -1;
-          break;
-        }
-      }
-
-      if ( (MAX_PAN) >= (pan+MIN_RES) ) {
-        pan += MIN_RES;
-        uvcPanTilt(cams[id].videoIn->fd, MIN_RES, 0, 0);
-      }
-      res = pan/one_degree;
-
-      DBG("pan: %d\n", pan);
+      res = (pan_tilt != NULL) ? motion_move(pan_tilt, MOTION_PAN, MIN_RES)/one_degree : -1;
       break;
 
     case IN_CMD_PAN_MINUS:
       DBG("pan -\n");
-
-      if ( pan_tilt_valid != 1 ) {
-        if ( input_cmd_old(IN_CMD_RESET_PAN_TILT_NO_MUTEX, id, 0) == -1 ) {
-          res = -1;
-          break;
-        }
-      }
-
-      if ( (MIN_PAN) <= (pan-MIN_RES) ) {
-        pan -= MIN_RES;
-        uvcPanTilt(cams[id].videoIn->fd, -MIN_RES, 0, 0);
-      }
-      res = pan/one_degree;
-
-      DBG("pan: %d\n", pan);
+      res = (pan_tilt != NULL) ? motion_move(pan_tilt, MOTION_PAN, -MIN_RES)/one_degree : -1;
       break;
 
     case IN_CMD_TILT_SET:
       DBG("set tilt to %d degrees\n", value);
-
-      if ( pan_tilt_valid != 1 ) {
-        if ( input_cmd_old(IN_CMD_RESET_PAN_TILT_NO_MUTEX, id, 0) == -1 ) {
-          res = -1;
-          break;
-        }
-      }
-
-      /* limit pan-value to min and max, multiply it with constant "one_degree" */
-      value = MIN(MAX(value*one_degree, MIN_TILT), MAX_TILT);
-
-      /* calculate the relative degrees to move to the desired absolute pan-value */
-      if( (res = value - tilt) == 0 ) {
-        /* do not move if this would mean to move by 0 degrees */
-        res = tilt/one_degree;
-        break;
-      }
-
-      /* move it */
-      tilt = value;
-      uvcPanTilt(cams[id].videoIn->fd, 0, res, 0);
-      res = tilt/one_degree;
-
-      DBG("tilt: %d\n", tilt);
+      res = (pan_tilt != NULL) ? motion_move_to(pan_tilt, MOTION_TILT, value*one_degree)/one_degree : -1;
       break;
 
     case IN_CMD_TILT_PLUS:
       DBG("tilt +\n");
-
-      if ( pan_tilt_valid != 1 ) {
-        if ( input_cmd_old(IN_CMD_RESET_PAN_TILT_NO_MUTEX, id, 0) == -1 ) {
-          res = -1;
-          break;
-        }
-      }
-
-      if ( (MAX_TILT) >= (tilt+MIN_RES) ) {
-        tilt += MIN_RES;
-        uvcPanTilt(cams[id].videoIn->fd, 0, MIN_RES, 0);
-      }
-      res = tilt/one_degree;
-
-      DBG("tilt: %d\n", tilt);
+      res = (pan_tilt != NULL) ? motion_move(pan_tilt, MOTION_TILT, MIN_RES)/one_degree : -1;
       break;
 
     case IN_CMD_TILT_MINUS:
       DBG("tilt -\n");
-
-      if ( pan_tilt_valid != 1 ) {
-        if ( input_cmd_old(IN_CMD_RESET_PAN_TILT_NO_MUTEX, id, 0) == -1 ) {
-          res = -1;
-          break;
-        }
-      }
-
-      if ( (MIN_TILT) <= (tilt-MIN_RES) ) {
-        tilt -= MIN_RES;
-        uvcPanTilt(cams[id].videoIn->fd, 0, -MIN_RES, 0);
-      }
-      res = tilt/one_degree;
-
-      DBG("tilt: %d\n", tilt);
+      res = (pan_tilt != NULL) ? motion_move(pan_tilt, MOTION_TILT, -MIN_RES)/one_degree : -1;
       break;
 
     case IN_CMD_SATURATION_PLUS:
@@ -967,47 +1339,3 @@ int input_cmd_old(in_cmd_type cmd, int id, int value) {
 
   return res;
 }
-
-/*
-SRC: https://lists.berlios.de/pipermail/linux-uvc-devel/2007-July/001888.html
-
-- dev: the device file descriptor
-- pan: pan angle in 1/64th of degree
-- tilt: tilt angle in 1/64th of degree
-- reset: set to 1 to reset pan/tilt to the device origin, set to 0 otherwise
-*/
-int uvcPanTilt(int dev, int pan, int tilt, int reset) {
-  struct v4l2_ext_control xctrls[2];
-  struct v4l2_ext_controls ctrls;
-
-  if (reset) {
-    xctrls[0].id = V4L2_CID_PAN_RESET;
-    xctrls[0].value = 3;
-
-    ctrls.count = 1;
-    ctrls.controls = xctrls;
-
-    if ( ioctl(dev, VIDIOC_S_EXT_CTRLS, &ctrls) < 0 ) {
-      return -1;
-    }
-    xctrls[0].id = V4L2_CID_TILT_RESET;
-    if ( ioctl(dev, VIDIOC_S_EXT_CTRLS, &ctrls) < 0 ) {
-      return -1;
-    }
-    return 0;
-  } else {
-    xctrls[0].id = V4L2_CID_PAN_RELATIVE;
-    xctrls[0].value = pan;
-    xctrls[1].id = V4L2_CID_TILT_RELATIVE;
-    xctrls[1].value = tilt;
-
-    ctrls.count = 2;
-    ctrls.controls = xctrls;
-  }
-
-  if ( ioctl(dev, VIDIOC_S_EXT_CTRLS, &ctrls) < 0 ) {
-    return -1;
-  }
-
-  return 0;
-}
@@ -0,0 +1,508 @@
+/*******************************************************************************
+# Linux-UVC streaming input-plugin for MJPG-streamer                           #
+#                                                                              #
+# This package work with the Logitech UVC based webcams with the mjpeg feature #
+#                                                                              #
+#   Copyright (C) 2007  Tom Stöveken                                           #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; either version 2 of the License, or            #
+# (at your option) any later version.                                          #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+/*
+ * Checks the pixel conversion kernels of jpeg_utils.c, built and run by
+ * "make check". Every vector kernel this CPU supports is compared with its
+ * scalar version for all lengths up to a limit, on random input at varying
+ * alignments, and bytes written behind the output are detected. Then each
+ * kernel is timed on a whole frame.
+ * Finally frames of every raw format are compressed with the codec chosen
+ * by "-codec", timed and decoded again with libjpeg to check the result.
+ * The kernels are static, so jpeg_utils.c is included instead of linked.
+ */
+
+#include <getopt.h>
+#include <time.h>
+
+#include "../../utils.h"
+#include "jpeg_utils.c"
+
+/* bytes behind each output that must stay untouched */
+#define GUARD 64
+#define GUARD_BYTE 0xa5
+
+/* how long each kernel and format gets timed */
+#define BENCH_TIME_MS 300
+
+#ifdef USE_TURBOJPEG
+#define CODECS "libjpeg or turbojpeg"
+#else
+#define CODECS "libjpeg"
+#endif
+
+typedef void (*yuyv_kernel)(const unsigned char *, unsigned char *, unsigned char *, unsigned char *, int);
+typedef void (*rgb565_kernel)(const unsigned char *, unsigned char *, int);
+
+typedef struct {
+    const char *name;
+    yuyv_kernel yuyv;
+    rgb565_kernel rgb565;
+} kernel;
+
+/* raw formats the encoder compresses, bytes per frame in eighths of a pixel */
+static const struct {
+    const char *name;
+    int format;
+    int eighths;
+} formats[] = {
+    { "YUYV", V4L2_PIX_FMT_YUYV, 16 },
+    { "NV12", V4L2_PIX_FMT_NV12, 12 },
+    { "YU12", V4L2_PIX_FMT_YUV420, 12 },
+    { "RGB565", V4L2_PIX_FMT_RGB565, 16 },
+    { "RGB24", V4L2_PIX_FMT_RGB24, 24 },
+};
+
+#define FORMATS (int)(sizeof(formats) / sizeof(formats[0]))
+
+/* a libjpeg decoder that returns instead of exiting on errors */
+typedef struct {
+    struct jpeg_error_mgr pub;
+    jmp_buf error;
+} check_error_mgr;
+
+/* the scalar kernels come first, they are the reference */
+static const kernel kernels[] = {
+    { "scalar", deinterleave_yuyv_scalar, rgb565_to_rgb24_scalar },
+#if defined(__x86_64__) || defined(__i386__)
+    { "sse2", deinterleave_yuyv_sse2, NULL },
+    { "avx2", deinterleave_yuyv_avx2, NULL },
+    { "ssse3", NULL, rgb565_to_rgb24_ssse3 },
+#endif
+#ifdef __ARM_NEON
+    { "neon", deinterleave_yuyv_neon, rgb565_to_rgb24_neon },
+#endif
+};
+
+#define KERNELS (int)(sizeof(kernels) / sizeof(kernels[0]))
+
+/******************************************************************************
+Description.: tells if the CPU can run a kernel
+Input Value.: name of the kernel
+Return Value: 1 if it can, 0 otherwise
+******************************************************************************/
+static int cpu_supports(const char *name)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if(strcmp(name, "sse2") == 0)
+        return __builtin_cpu_supports("sse2");
+    if(strcmp(name, "avx2") == 0)
+        return __builtin_cpu_supports("avx2");
+    if(strcmp(name, "ssse3") == 0)
+        return __builtin_cpu_supports("ssse3");
+#endif
+    return 1;
+}
+
+static void help(char *program)
+{
+    fprintf(stderr, " ---------------------------------------------------------------\n" \
+    " Help for %s\n" \
+    " ---------------------------------------------------------------\n" \
+    " The following parameters can be passed:\n" \
+    " [-n | --lengths ]......: compare the kernels for lengths 0 to this (default 1024)\n" \
+    " [-r | --resolution ]...: frame size of the timings (default 1920x1080)\n" \
+    " [-s | --seed ].........: seed of the random input\n" \
+    " [-codec ]..............: codec the frames are compressed with: " CODECS ",\n" \
+    "                          default %s\n" \
+    " [-q | --quality ]......: JPEG quality (default 80)\n" \
+    " ---------------------------------------------------------------\n", program, jpeg_codec_name(DEFAULT_CODEC));
+}
+
+/******************************************************************************
+Description.: fills a buffer with random bytes
+Input Value.: * buffer, size: the buffer
+Return Value: -
+******************************************************************************/
+static void randomize(unsigned char *buffer, int size)
+{
+    int i;
+
+    for(i = 0; i < size; i++)
+        buffer[i] = rand() & 0xff;
+}
+
+/******************************************************************************
+Description.: allocates an output buffer with guard bytes behind it
+Input Value.: size of the output
+Return Value: the buffer, the program exits if there is no memory
+******************************************************************************/
+static unsigned char *guarded(int size)
+{
+    unsigned char *buffer = malloc(size + GUARD);
+
+    if(buffer == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    memset(buffer, GUARD_BYTE, size + GUARD);
+    return buffer;
+}
+
+/******************************************************************************
+Description.: tells if the guard bytes behind an output are untouched
+Input Value.: * buffer, size: the output
+Return Value: 1 if they are, 0 otherwise
+******************************************************************************/
+static int guard_intact(const unsigned char *buffer, int size)
+{
+    int i;
+
+    for(i = 0; i < GUARD; i++) {
+        if(buffer[size + i] != GUARD_BYTE)
+            return 0;
+    }
+    return 1;
+}
+
+/******************************************************************************
+Description.: compares a YUYV kernel with the scalar one for all lengths
+Input Value.: * k......: the kernel
+              * lengths: largest number of pixel pairs
+Return Value: 0 if it matches, -1 otherwise
+******************************************************************************/
+static int check_yuyv(const kernel *k, int lengths)
+{
+    unsigned char *src, *y[2], *cb[2], *cr[2];
+    int pairs, offset, i;
+
+    for(pairs = 0; pairs <= lengths; pairs++) {
+        /* the source is read at every alignment within a vector */
+        offset = pairs % 32;
+        src = guarded(offset + pairs * 4);
+        randomize(src + offset, pairs * 4);
+
+        for(i = 0; i < 2; i++) {
+            y[i] = guarded(pairs * 2);
+            cb[i] = guarded(pairs);
+            cr[i] = guarded(pairs);
+            (i == 0 ? kernels[0].yuyv : k->yuyv)(src + offset, y[i], cb[i], cr[i], pairs);
+        }
+
+        i = (memcmp(y[0], y[1], pairs * 2) == 0 && memcmp(cb[0], cb[1], pairs) == 0 &&
+             memcmp(cr[0], cr[1], pairs) == 0 && guard_intact(y[1], pairs * 2) &&
+             guard_intact(cb[1], pairs) && guard_intact(cr[1], pairs));
+
+        free(src);
+        free(y[0]); free(cb[0]); free(cr[0]);
+        free(y[1]); free(cb[1]); free(cr[1]);
+        if(!i) {
+            printf("  yuyv   %-7s MISMATCH at %d pixel pairs\n", k->name, pairs);
+            return -1;
+        }
+    }
+
+    printf("  yuyv   %-7s ok for 0 to %d pixel pairs\n", k->name, lengths);
+    return 0;
+}
+
+/******************************************************************************
+Description.: compares a RGB565 kernel with the scalar one for all lengths
+Input Value.: * k......: the kernel
+              * lengths: largest number of pixels
+Return Value: 0 if it matches, -1 otherwise
+******************************************************************************/
+static int check_rgb565(const kernel *k, int lengths)
+{
+    unsigned char *src, *dst[2];
+    int pixels, offset, i;
+
+    for(pixels = 0; pixels <= lengths; pixels++) {
+        offset = pixels % 32;
+        src = guarded(offset + pixels * 2);
+        randomize(src + offset, pixels * 2);
+
+        for(i = 0; i < 2; i++) {
+            dst[i] = guarded(pixels * 3);
+            (i == 0 ? kernels[0].rgb565 : k->rgb565)(src + offset, dst[i], pixels);
+        }
+
+        i = (memcmp(dst[0], dst[1], pixels * 3) == 0 && guard_intact(dst[1], pixels * 3));
+
+        free(src);
+        free(dst[0]);
+        free(dst[1]);
+        if(!i) {
+            printf("  rgb565 %-7s MISMATCH at %d pixels\n", k->name, pixels);
+            return -1;
+        }
+    }
+
+    printf("  rgb565 %-7s ok for 0 to %d pixels\n", k->name, lengths);
+    return 0;
+}
+
+/******************************************************************************
+Description.: milliseconds of CLOCK_MONOTONIC
+Input Value.: -
+Return Value: the time
+******************************************************************************/
+static double now_ms(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000.0 + now.tv_nsec / 1000000.0;
+}
+
+/******************************************************************************
+Description.: times the kernels of a CPU on whole frames, row by row the way
+              the encoder calls them
+Input Value.: * k.............: the kernels
+              * width, height.: size of the frame
+Return Value: -
+******************************************************************************/
+static void bench(const kernel *k, int width, int height)
+{
+    unsigned char *src = guarded(width * height * 3), *dst = guarded(width * height * 3);
+    double start, elapsed;
+    long frames;
+    int row;
+
+    randomize(src, width * height * 3);
+
+    if(k->yuyv != NULL) {
+        start = now_ms();
+        for(frames = 0; (elapsed = now_ms() - start) < BENCH_TIME_MS; frames++) {
+            for(row = 0; row < height; row++)
+                k->yuyv(src + row * width * 2, dst + row * width, dst + width * height + row * width / 2,
+                        dst + width * height * 2 + row * width / 2, width / 2);
+        }
+        printf("  yuyv   %-7s %9.1f Mpix/s\n", k->name, (double) frames * width * height / elapsed / 1000.0);
+    }
+
+    if(k->rgb565 != NULL) {
+        start = now_ms();
+        for(frames = 0; (elapsed = now_ms() - start) < BENCH_TIME_MS; frames++) {
+            for(row = 0; row < height; row++)
+                k->rgb565(src + row * width * 2, dst + row * width * 3, width);
+        }
+        printf("  rgb565 %-7s %9.1f Mpix/s\n", k->name, (double) frames * width * height / elapsed / 1000.0);
+    }
+
+    free(src);
+    free(dst);
+}
+
+/******************************************************************************
+Description.: libjpeg calls this for fatal errors of the decoder
+Input Value.: the decompressor
+Return Value: does not return
+******************************************************************************/
+static void check_error_exit(j_common_ptr cinfo)
+{
+    check_error_mgr *err = (check_error_mgr *) cinfo->err;
+
+    (*cinfo->err->output_message)(cinfo);
+    longjmp(err->error, 1);
+}
+
+/******************************************************************************
+Description.: decodes a compressed frame with libjpeg
+Input Value.: * jpeg, size....: the compressed frame
+              * width, height.: the size it must have
+Return Value: 0 if it decodes to that size, -1 otherwise
+******************************************************************************/
+static int decode_check(const unsigned char *jpeg, int size, int width, int height)
+{
+    struct jpeg_decompress_struct cinfo;
+    check_error_mgr err;
+    JSAMPROW row = NULL;
+    int ret = -1;
+
+    cinfo.err = jpeg_std_error(&err.pub);
+    err.pub.error_exit = check_error_exit;
+    jpeg_create_decompress(&cinfo);
+    if(setjmp(err.error)) {
+        free(row);
+        jpeg_destroy_decompress(&cinfo);
+        return -1;
+    }
+
+    jpeg_mem_src(&cinfo, (unsigned char *) jpeg, size);
+    jpeg_read_header(&cinfo, TRUE);
+    jpeg_start_decompress(&cinfo);
+    if((row = malloc(cinfo.output_width * cinfo.output_components)) != NULL) {
+        while(cinfo.output_scanline < cinfo.output_height)
+            jpeg_read_scanlines(&cinfo, &row, 1);
+        ret = (cinfo.output_width == width && cinfo.output_height == height) ? 0 : -1;
+    }
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    free(row);
+    return ret;
+}
+
+/******************************************************************************
+Description.: Compresses frames of every raw format with a codec, reports
+              frames and pixels per second and the size, and decodes the
+              result again. The frames hold gradients with some noise, like
+              a camera picture rather than random bytes.
+Input Value.: * codec.........: the codec
+              * width, height.: size of the frames
+              * quality.......: JPEG quality
+Return Value: number of formats that failed
+******************************************************************************/
+static int bench_codec(jpeg_codec codec, int width, int height, int quality)
+{
+    jpeg_encoder encoder;
+    unsigned char *frame, *jpeg;
+    int size = width * height * 3, failed = 0, written, f, i;
+    double start, elapsed;
+    long frames;
+
+    if(jpeg_encoder_init(&encoder, codec) < 0) {
+        printf("  the %s encoder could not be created\n", jpeg_codec_name(codec));
+        return FORMATS;
+    }
+    frame = guarded(size);
+    jpeg = guarded(size);
+    for(i = 0; i < size; i++)
+        frame[i] = ((i % (width * 2)) / 8 + (i / (width * 2)) / 4 + (rand() & 7)) & 0xff;
+
+    for(f = 0; f < FORMATS; f++) {
+        written = compress_frame_to_jpeg(&encoder, frame, width, height, formats[f].format, jpeg, size, quality);
+        if(written <= 0 || decode_check(jpeg, written, width, height) < 0 || !guard_intact(jpeg, size)) {
+            printf("  %-7s FAILED\n", formats[f].name);
+            failed++;
+            continue;
+        }
+
+        start = now_ms();
+        for(frames = 0; (elapsed = now_ms() - start) < BENCH_TIME_MS; frames++)
+            compress_frame_to_jpeg(&encoder, frame, width, height, formats[f].format, jpeg, size, quality);
+        printf("  %-7s %7.1f fps %9.1f Mpix/s %7d KB from %d KB\n", formats[f].name, frames * 1000.0 / elapsed,
+               (double) frames * width * height / elapsed / 1000.0, written / 1024, width * height * formats[f].eighths / 8 / 1024);
+    }
+
+    jpeg_encoder_destroy(&encoder);
+    free(frame);
+    free(jpeg);
+    return failed;
+}
+
+int main(int argc, char *argv[])
+{
+    int lengths = 1024, width = 1920, height = 1080, quality = 80, failed = 0, i;
+    jpeg_codec codec = DEFAULT_CODEC;
+    unsigned int seed = time(NULL);
+
+    while(1) {
+        int option_index = 0, c = 0;
+        static struct option long_options[] = {
+            {"h", no_argument, 0, 0},
+            {"help", no_argument, 0, 0},
+            {"n", required_argument, 0, 0},
+            {"lengths", required_argument, 0, 0},
+            {"r", required_argument, 0, 0},
+            {"resolution", required_argument, 0, 0},
+            {"s", required_argument, 0, 0},
+            {"seed", required_argument, 0, 0},
+            {"codec", required_argument, 0, 0},
+            {"q", required_argument, 0, 0},
+            {"quality", required_argument, 0, 0},
+            {0, 0, 0, 0}
+        };
+
+        c = getopt_long_only(argc, argv, "", long_options, &option_index);
+
+        /* no more options to parse */
+        if(c == -1) break;
+
+        /* unrecognized option */
+        if(c == '?') {
+            help(argv[0]);
+            return EXIT_FAILURE;
+        }
+
+        switch(option_index) {
+            /* h, help */
+        case 0:
+        case 1:
+            help(argv[0]);
+            return EXIT_SUCCESS;
+
+            /* n, lengths */
+        case 2:
+        case 3:
+            lengths = atoi(optarg);
+            break;
+
+            /* r, resolution */
+        case 4:
+        case 5:
+            if(sscanf(optarg, "%dx%d", &width, &height) != 2 || width < 2 || height < 1) {
+                help(argv[0]);
+                return EXIT_FAILURE;
+            }
+            width &= ~1;
+            break;
+
+            /* s, seed */
+        case 6:
+        case 7:
+            seed = strtoul(optarg, NULL, 10);
+            break;
+
+            /* codec */
+        case 8:
+            if((i = jpeg_codec_by_name(optarg)) < 0) {
+                fprintf(stderr, "codec %s is unknown or not compiled in\n", optarg);
+                return EXIT_FAILURE;
+            }
+            codec = i;
+            break;
+
+            /* q, quality */
+        case 9:
+        case 10:
+            quality = MIN(MAX(atoi(optarg), 0), 100);
+            break;
+        }
+    }
+
+    printf("comparing with the scalar kernels, seed %u\n", seed);
+    srand(seed);
+    for(i = 1; i < KERNELS; i++) {
+        if(!cpu_supports(kernels[i].name)) {
+            printf("  %-14s not supported by this CPU\n", kernels[i].name);
+            continue;
+        }
+        if(kernels[i].yuyv != NULL && check_yuyv(&kernels[i], lengths) < 0)
+            failed++;
+        if(kernels[i].rgb565 != NULL && check_rgb565(&kernels[i], lengths) < 0)
+            failed++;
+    }
+
+    printf("throughput at %dx%d\n", width, height);
+    for(i = 0; i < KERNELS; i++) {
+        if(cpu_supports(kernels[i].name))
+            bench(&kernels[i], width, height);
+    }
+
+    printf("%s at quality %d\n", jpeg_codec_name(codec), quality);
+    failed += bench_codec(codec, width, height, quality);
+
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
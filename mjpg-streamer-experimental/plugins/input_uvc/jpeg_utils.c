@@ -26,30 +26,42 @@
 #include <stdio.h>
 #include <jpeglib.h>
 #include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
 
 #include <linux/types.h>          /* for videodev2.h */
 #include <linux/videodev2.h>
 
 #include "v4l2uvc.h"
 
+#include "jpeg_utils.h"
+
+/* output that does not fit into the buffer gets discarded here */
 #define OUTPUT_BUF_SIZE  4096
 
 typedef struct {
     struct jpeg_destination_mgr pub; /* public fields */
 
-    JOCTET * buffer;    /* start of buffer */
-
     unsigned char *outbuffer;
     int outbuffer_size;
-    unsigned char *outbuffer_cursor;
     int *written;
+    int overflow;
 
+    JOCTET discard[OUTPUT_BUF_SIZE];
 } mjpg_destination_mgr;
 
 typedef mjpg_destination_mgr * mjpg_dest_ptr;
 
 /******************************************************************************
-Description.:
+Description.: libjpeg writes directly into the output buffer
 Input Value.:
 Return Value:
 ******************************************************************************/
@@ -57,17 +69,16 @@ METHODDEF(void) init_destination(j_compress_ptr cinfo)
 {
     mjpg_dest_ptr dest = (mjpg_dest_ptr) cinfo->dest;
 
-    /* Allocate the output buffer --- it will be released when done with image */
-    dest->buffer = (JOCTET *)(*cinfo->mem->alloc_small)((j_common_ptr) cinfo, JPOOL_IMAGE, OUTPUT_BUF_SIZE * sizeof(JOCTET));
-
     *(dest->written) = 0;
+    dest->overflow = 0;
 
-    dest->pub.next_output_byte = dest->buffer;
-    dest->pub.free_in_buffer = OUTPUT_BUF_SIZE;
+    dest->pub.next_output_byte = dest->outbuffer;
+    dest->pub.free_in_buffer = dest->outbuffer_size;
 }
 
 /******************************************************************************
-Description.: called whenever local jpeg buffer fills up
+Description.: called when the output buffer is full, the rest of the picture
+              gets discarded and the compression fails in the end
 Input Value.:
 Return Value:
 ******************************************************************************/
@@ -75,11 +86,8 @@ METHODDEF(boolean) empty_output_buffer(j_compress_ptr cinfo)
 {
     mjpg_dest_ptr dest = (mjpg_dest_ptr) cinfo->dest;
 
-    memcpy(dest->outbuffer_cursor, dest->buffer, OUTPUT_BUF_SIZE);
-    dest->outbuffer_cursor += OUTPUT_BUF_SIZE;
-    *(dest->written) += OUTPUT_BUF_SIZE;
-
-    dest->pub.next_output_byte = dest->buffer;
+    dest->overflow = 1;
+    dest->pub.next_output_byte = dest->discard;
     dest->pub.free_in_buffer = OUTPUT_BUF_SIZE;
 
     return TRUE;
@@ -87,23 +95,21 @@ METHODDEF(boolean) empty_output_buffer(j_compress_ptr cinfo)
 
 /******************************************************************************
 Description.: called by jpeg_finish_compress after all data has been written.
-              Usually needs to flush buffer.
 Input Value.:
 Return Value:
 ******************************************************************************/
 METHODDEF(void) term_destination(j_compress_ptr cinfo)
 {
     mjpg_dest_ptr dest = (mjpg_dest_ptr) cinfo->dest;
-    size_t datacount = OUTPUT_BUF_SIZE - dest->pub.free_in_buffer;
 
-    /* Write any data remaining in the buffer */
-    memcpy(dest->outbuffer_cursor, dest->buffer, datacount);
-    dest->outbuffer_cursor += datacount;
-    *(dest->written) += datacount;
+    if(dest->overflow)
+        *(dest->written) = -1;
+    else
+        *(dest->written) = dest->outbuffer_size - dest->pub.free_in_buffer;
 }
 
 /******************************************************************************
-Description.: Prepare for output to a stdio stream.
+Description.: Prepare for output to a memory buffer.
 Input Value.: buffer is the already allocated buffer memory that will hold
               the compressed picture. "size" is the size in bytes.
 Return Value: -
@@ -122,115 +128,607 @@ GLOBAL(void) dest_buffer(j_compress_ptr cinfo, unsigned char *buffer, int size,
     dest->pub.term_destination = term_destination;
     dest->outbuffer = buffer;
     dest->outbuffer_size = size;
-    dest->outbuffer_cursor = buffer;
     dest->written = written;
 }
 
+/******************************************************************************
+Description.: libjpeg calls this for fatal errors, by default it would exit
+Input Value.: the compressor
+Return Value: does not return
+******************************************************************************/
+METHODDEF(void) error_exit(j_common_ptr cinfo)
+{
+    jpeg_encoder *encoder = (jpeg_encoder *) cinfo;
+
+    (*cinfo->err->output_message)(cinfo);
+    longjmp(encoder->error, 1);
+}
+
+/*
+ * Pixel conversion kernels. Each has a scalar version and vector versions
+ * that produce exactly the same output, the best one the CPU supports gets
+ * selected at the first compression.
+ */
+
+/******************************************************************************
+Description.: sorts YUYV samples into separate Y, Cb and Cr rows
+Input Value.: * src.......: YUYV samples
+              * y, cb, cr.: destination rows
+              * pairs.....: number of pixel pairs
+Return Value: -
+******************************************************************************/
+static void deinterleave_yuyv_scalar(const unsigned char *src, unsigned char *y, unsigned char *cb, unsigned char *cr, int pairs)
+{
+    int x;
+
+    for(x = 0; x < pairs; x++, src += 4) {
+        y[2 * x] = src[0];
+        cb[x] = src[1];
+        y[2 * x + 1] = src[2];
+        cr[x] = src[3];
+    }
+}
+
+/******************************************************************************
+Description.: expands RGB565 pixels to RGB24
+Input Value.: * src...: little endian RGB565 pixels
+              * dst...: RGB24 destination
+              * pixels: number of pixels
+Return Value: -
+******************************************************************************/
+static void rgb565_to_rgb24_scalar(const unsigned char *src, unsigned char *dst, int pixels)
+{
+    int x;
+
+    for(x = 0; x < pixels; x++, src += 2) {
+        unsigned int twoByte = (src[1] << 8) + src[0];
+        *(dst++) = (src[1] & 248);
+        *(dst++) = (unsigned char)((twoByte & 2016) >> 3);
+        *(dst++) = ((src[0] & 31) * 8);
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+static void deinterleave_yuyv_sse2(const unsigned char *src, unsigned char *y, unsigned char *cb, unsigned char *cr, int pairs)
+{
+    const __m128i low = _mm_set1_epi16(0x00ff);
+    int x;
+
+    /* 16 pixels per round */
+    for(x = 0; x + 8 <= pairs; x += 8, src += 32) {
+        __m128i a = _mm_loadu_si128((const __m128i *) src);
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + 16));
+        __m128i c = _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8));
+
+        _mm_storeu_si128((__m128i *)(y + 2 * x), _mm_packus_epi16(_mm_and_si128(a, low), _mm_and_si128(b, low)));
+        _mm_storel_epi64((__m128i *)(cb + x), _mm_packus_epi16(_mm_and_si128(c, low), _mm_setzero_si128()));
+        _mm_storel_epi64((__m128i *)(cr + x), _mm_packus_epi16(_mm_srli_epi16(c, 8), _mm_setzero_si128()));
+    }
+    deinterleave_yuyv_scalar(src, y + 2 * x, cb + x, cr + x, pairs - x);
+}
+
+__attribute__((target("avx2")))
+static void deinterleave_yuyv_avx2(const unsigned char *src, unsigned char *y, unsigned char *cb, unsigned char *cr, int pairs)
+{
+    const __m256i low = _mm256_set1_epi16(0x00ff);
+    int x;
+
+    /* 32 pixels per round, packus works per lane so the quads get reordered */
+    for(x = 0; x + 16 <= pairs; x += 16, src += 64) {
+        __m256i a = _mm256_loadu_si256((const __m256i *) src);
+        __m256i b = _mm256_loadu_si256((const __m256i *)(src + 32));
+        __m256i c = _mm256_permute4x64_epi64(_mm256_packus_epi16(_mm256_srli_epi16(a, 8), _mm256_srli_epi16(b, 8)), 0xd8);
+        __m256i luma = _mm256_permute4x64_epi64(_mm256_packus_epi16(_mm256_and_si256(a, low), _mm256_and_si256(b, low)), 0xd8);
+        __m256i u = _mm256_permute4x64_epi64(_mm256_packus_epi16(_mm256_and_si256(c, low), _mm256_setzero_si256()), 0xd8);
+        __m256i v = _mm256_permute4x64_epi64(_mm256_packus_epi16(_mm256_srli_epi16(c, 8), _mm256_setzero_si256()), 0xd8);
+
+        _mm256_storeu_si256((__m256i *)(y + 2 * x), luma);
+        _mm_storeu_si128((__m128i *)(cb + x), _mm256_castsi256_si128(u));
+        _mm_storeu_si128((__m128i *)(cr + x), _mm256_castsi256_si128(v));
+    }
+    deinterleave_yuyv_scalar(src, y + 2 * x, cb + x, cr + x, pairs - x);
+}
+
+/* SSE2 has no byte shuffle to interleave the three channels, SSSE3 does */
+__attribute__((target("ssse3")))
+static void rgb565_to_rgb24_ssse3(const unsigned char *src, unsigned char *dst, int pixels)
+{
+    const __m128i mask = _mm_set1_epi16(0xf8);
+    const __m128i rg_first = _mm_setr_epi8(0, 8, -1, 1, 9, -1, 2, 10, -1, 3, 11, -1, 4, 12, -1, 5);
+    const __m128i b_first = _mm_setr_epi8(-1, -1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1);
+    const __m128i rg_second = _mm_setr_epi8(13, -1, 6, 14, -1, 7, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i b_second = _mm_setr_epi8(-1, 5, -1, -1, 6, -1, -1, 7, -1, -1, -1, -1, -1, -1, -1, -1);
+    int x;
+
+    /* 8 pixels per round */
+    for(x = 0; x + 8 <= pixels; x += 8, src += 16, dst += 24) {
+        __m128i p = _mm_loadu_si128((const __m128i *) src);
+        __m128i r = _mm_and_si128(_mm_srli_epi16(p, 8), mask);
+        __m128i g = _mm_and_si128(_mm_srli_epi16(p, 3), _mm_set1_epi16(0xfc));
+        __m128i b = _mm_and_si128(_mm_slli_epi16(p, 3), mask);
+        __m128i rg = _mm_packus_epi16(r, g);
+        __m128i bb = _mm_packus_epi16(b, b);
+
+        _mm_storeu_si128((__m128i *) dst, _mm_or_si128(_mm_shuffle_epi8(rg, rg_first), _mm_shuffle_epi8(bb, b_first)));
+        _mm_storel_epi64((__m128i *)(dst + 16), _mm_or_si128(_mm_shuffle_epi8(rg, rg_second), _mm_shuffle_epi8(bb, b_second)));
+    }
+    rgb565_to_rgb24_scalar(src, dst, pixels - x);
+}
+#endif
+
+#ifdef __ARM_NEON
+static void deinterleave_yuyv_neon(const unsigned char *src, unsigned char *y, unsigned char *cb, unsigned char *cr, int pairs)
+{
+    int x;
+
+    /* 16 pixels per round */
+    for(x = 0; x + 8 <= pairs; x += 8, src += 32) {
+        uint8x8x4_t p = vld4_u8(src);
+        uint8x8x2_t luma;
+
+        luma.val[0] = p.val[0];
+        luma.val[1] = p.val[2];
+        vst2_u8(y + 2 * x, luma);
+        vst1_u8(cb + x, p.val[1]);
+        vst1_u8(cr + x, p.val[3]);
+    }
+    deinterleave_yuyv_scalar(src, y + 2 * x, cb + x, cr + x, pairs - x);
+}
+
+static void rgb565_to_rgb24_neon(const unsigned char *src, unsigned char *dst, int pixels)
+{
+    int x;
+
+    /* 8 pixels per round */
+    for(x = 0; x + 8 <= pixels; x += 8, src += 16, dst += 24) {
+        uint16x8_t p = vld1q_u16((const uint16_t *) src);
+        uint8x8x3_t rgb;
+
+        rgb.val[0] = vand_u8(vshrn_n_u16(p, 8), vdup_n_u8(0xf8));
+        rgb.val[1] = vand_u8(vshrn_n_u16(p, 3), vdup_n_u8(0xfc));
+        rgb.val[2] = vshl_n_u8(vmovn_u16(p), 3);
+        vst3_u8(dst, rgb);
+    }
+    rgb565_to_rgb24_scalar(src, dst, pixels - x);
+}
+#endif
+
+static void (*deinterleave_yuyv)(const unsigned char *, unsigned char *, unsigned char *, unsigned char *, int) = deinterleave_yuyv_scalar;
+static void (*rgb565_to_rgb24)(const unsigned char *, unsigned char *, int) = rgb565_to_rgb24_scalar;
+static pthread_once_t kernels_selected = PTHREAD_ONCE_INIT;
+
+/******************************************************************************
+Description.: selects the fastest conversion kernels this CPU supports
+Input Value.: -
+Return Value: -
+******************************************************************************/
+static void select_kernels(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))
+        deinterleave_yuyv = deinterleave_yuyv_avx2;
+    else if(__builtin_cpu_supports("sse2"))
+        deinterleave_yuyv = deinterleave_yuyv_sse2;
+    if(__builtin_cpu_supports("ssse3"))
+        rgb565_to_rgb24 = rgb565_to_rgb24_ssse3;
+#endif
+#ifdef __ARM_NEON
+    deinterleave_yuyv = deinterleave_yuyv_neon;
+    rgb565_to_rgb24 = rgb565_to_rgb24_neon;
+#endif
+}
+
+/******************************************************************************
+Description.: repeats the last sample of a row up to the padded width
+Input Value.: * row...: the row
+              * used..: samples filled in
+              * padded: width of the row
+Return Value: -
+******************************************************************************/
+static void pad_row(unsigned char *row, int used, int padded)
+{
+    if(padded > used)
+        memset(row + used, row[used - 1], padded - used);
+}
+
+/******************************************************************************
+Description.: makes sure the row buffer of an encoder holds enough bytes
+Input Value.: * encoder: the encoder
+              * needed.: bytes required
+Return Value: 0 if ok, -1 if the buffer could not be enlarged
+******************************************************************************/
+static int grow_rows(jpeg_encoder *encoder, int needed)
+{
+    unsigned char *rows;
+
+    if(needed <= encoder->rows_size)
+        return 0;
+
+    if((rows = realloc(encoder->rows, needed)) == NULL)
+        return -1;
+    encoder->rows = rows;
+    encoder->rows_size = needed;
+    return 0;
+}
+
+/******************************************************************************
+Description.: Sets the compression parameters and prepares the row buffers,
+              called only when the picture differs from the previous one.
+              YUYV, NV12 and YUV420 frames are compressed without colour
+              conversion. The planes are handed to libjpeg as raw data, YUYV
+              already is 4:2:2 and NV12 or YUV420 are 4:2:0, so only the
+              samples have to be sorted into rows of one component each.
+Input Value.: * encoder.......: the encoder
+              * width, height.: size of the picture
+              * format........: V4L2 pixel format of the picture
+              * quality.......: JPEG quality
+Return Value: 0 if ok, -1 if the row buffers could not be allocated
+******************************************************************************/
+static int setup_encoder(jpeg_encoder *encoder, int width, int height, int format, int quality)
+{
+    struct jpeg_compress_struct *cinfo = &encoder->cinfo;
+    int v_samp = (format == V4L2_PIX_FMT_YUYV) ? 1 : 2;
+    int y_width = (width + 2 * DCTSIZE - 1) & ~(2 * DCTSIZE - 1);
+    int needed, i;
+
+    encoder->ycbcr = (format == V4L2_PIX_FMT_YUYV || format == V4L2_PIX_FMT_NV12 || format == V4L2_PIX_FMT_YUV420);
+    encoder->lines = v_samp * DCTSIZE;
+    encoder->y_width = y_width;
+    encoder->c_width = y_width / 2;
+
+    needed = encoder->ycbcr ? y_width * encoder->lines + 2 * encoder->c_width * DCTSIZE : width * 3 * 2 * DCTSIZE;
+    if(grow_rows(encoder, needed) < 0)
+        return -1;
+
+    cinfo->image_width = width;
+    cinfo->image_height = height;
+    cinfo->input_components = 3;
+    cinfo->in_color_space = JCS_RGB;
+    jpeg_set_defaults(cinfo);
+
+    if(encoder->ycbcr) {
+        jpeg_set_colorspace(cinfo, JCS_YCbCr);
+        cinfo->raw_data_in = TRUE;
+        cinfo->comp_info[0].h_samp_factor = 2;
+        cinfo->comp_info[0].v_samp_factor = v_samp;
+        cinfo->comp_info[1].h_samp_factor = 1;
+        cinfo->comp_info[1].v_samp_factor = 1;
+        cinfo->comp_info[2].h_samp_factor = 1;
+        cinfo->comp_info[2].v_samp_factor = 1;
+
+        for(i = 0; i < encoder->lines; i++)
+            encoder->y_rows[i] = encoder->rows + i * y_width;
+        for(i = 0; i < DCTSIZE; i++) {
+            encoder->cb_rows[i] = encoder->rows + encoder->lines * y_width + i * encoder->c_width;
+            encoder->cr_rows[i] = encoder->cb_rows[i] + DCTSIZE * encoder->c_width;
+        }
+    }
+    jpeg_set_quality(cinfo, quality, TRUE);
+
+    encoder->width = width;
+    encoder->height = height;
+    encoder->format = format;
+    encoder->quality = quality;
+    return 0;
+}
+
+/******************************************************************************
+Description.: writes a YUYV, NV12 or YUV420 frame as raw data, rows are padded
+              to whole MCUs by repeating the edge samples
+Input Value.: * encoder: the encoder, the compression is started
+              * frame..: the raw picture
+Return Value: -
+******************************************************************************/
+static void write_ycbcr(jpeg_encoder *encoder, const unsigned char *frame)
+{
+    struct jpeg_compress_struct *cinfo = &encoder->cinfo;
+    JSAMPARRAY planes[3] = {encoder->y_rows, encoder->cb_rows, encoder->cr_rows};
+    const unsigned char *src, *cb_src, *cr_src;
+    int width = encoder->width, height = encoder->height;
+    int i, x, row, c_row;
+
+    while(cinfo->next_scanline < height) {
+        for(i = 0; i < encoder->lines; i++) {
+            /* the rows below the picture repeat its last row */
+            row = cinfo->next_scanline + i;
+            if(row >= height)
+                row = height - 1;
+
+            if(encoder->format == V4L2_PIX_FMT_YUYV) {
+                deinterleave_yuyv(frame + row * width * 2, encoder->y_rows[i], encoder->cb_rows[i], encoder->cr_rows[i], width / 2);
+                pad_row(encoder->y_rows[i], width, encoder->y_width);
+                pad_row(encoder->cb_rows[i], width / 2, encoder->c_width);
+                pad_row(encoder->cr_rows[i], width / 2, encoder->c_width);
+                continue;
+            }
+
+            memcpy(encoder->y_rows[i], frame + row * width, width);
+            pad_row(encoder->y_rows[i], width, encoder->y_width);
+            if(i % 2)
+                continue;
+
+            c_row = row / 2;
+            if(encoder->format == V4L2_PIX_FMT_NV12) {
+                src = frame + width * height + c_row * width;
+                for(x = 0; x < width / 2; x++, src += 2) {
+                    encoder->cb_rows[i / 2][x] = src[0];
+                    encoder->cr_rows[i / 2][x] = src[1];
+                }
+            } else {
+                cb_src = frame + width * height + c_row * (width / 2);
+                cr_src = cb_src + (width / 2) * (height / 2);
+                memcpy(encoder->cb_rows[i / 2], cb_src, width / 2);
+                memcpy(encoder->cr_rows[i / 2], cr_src, width / 2);
+            }
+            pad_row(encoder->cb_rows[i / 2], width / 2, encoder->c_width);
+            pad_row(encoder->cr_rows[i / 2], width / 2, encoder->c_width);
+        }
+
+        jpeg_write_raw_data(cinfo, planes, encoder->lines);
+    }
+}
+
+/******************************************************************************
+Description.: looks up a codec by the name given on the command line
+Input Value.: "libjpeg" or "turbojpeg"
+Return Value: the codec, -1 if unknown or not compiled in
+******************************************************************************/
+int jpeg_codec_by_name(const char *name)
+{
+    if(strcasecmp(name, "libjpeg") == 0)
+        return CODEC_LIBJPEG;
+#ifdef USE_TURBOJPEG
+    if(strcasecmp(name, "turbojpeg") == 0)
+        return CODEC_TURBOJPEG;
+#endif
+    return -1;
+}
+
+/******************************************************************************
+Description.: name of a codec for messages
+Input Value.: the codec
+Return Value: its name
+******************************************************************************/
+const char *jpeg_codec_name(jpeg_codec codec)
+{
+    return (codec == CODEC_TURBOJPEG) ? "turbojpeg" : "libjpeg";
+}
+
+/******************************************************************************
+Description.: creates the compressor of an encoder, it is kept for all frames
+Input Value.: * encoder: the encoder
+              * codec..: library that compresses the frames
+Return Value: 0 if ok, -1 if the compressor could not be created
+******************************************************************************/
+int jpeg_encoder_init(jpeg_encoder *encoder, jpeg_codec codec)
+{
+    memset(encoder, 0, sizeof(jpeg_encoder));
+    encoder->codec = codec;
+    encoder->cinfo.err = jpeg_std_error(&encoder->jerr);
+    encoder->jerr.error_exit = error_exit;
+    jpeg_create_compress(&encoder->cinfo);
+
+#ifdef USE_TURBOJPEG
+    if(codec == CODEC_TURBOJPEG && (encoder->tj = tjInitCompress()) == NULL) {
+        jpeg_destroy_compress(&encoder->cinfo);
+        return -1;
+    }
+#else
+    if(codec != CODEC_LIBJPEG) {
+        jpeg_destroy_compress(&encoder->cinfo);
+        return -1;
+    }
+#endif
+    return 0;
+}
+
+/******************************************************************************
+Description.: frees the compressor and the buffers of an encoder
+Input Value.: the encoder
+Return Value: -
+******************************************************************************/
+void jpeg_encoder_destroy(jpeg_encoder *encoder)
+{
+    jpeg_destroy_compress(&encoder->cinfo);
+    free(encoder->rows);
+    encoder->rows = NULL;
+    encoder->rows_size = 0;
+
+#ifdef USE_TURBOJPEG
+    if(encoder->tj != NULL)
+        tjDestroy(encoder->tj);
+    encoder->tj = NULL;
+    tjFree(encoder->tj_buffer);
+    encoder->tj_buffer = NULL;
+    encoder->tj_size = 0;
+#endif
+}
+
+#ifdef USE_TURBOJPEG
+/******************************************************************************
+Description.: compresses a whole frame with TurboJPEG. YUV420 planes are
+              passed as they are, YUYV and NV12 are split into planes and
+              RGB565 is expanded to RGB24 first, the colour conversion and
+              subsampling of RGB frames are done by TurboJPEG.
+              The JPEG is compressed into a buffer that is large enough for
+              the worst case and copied over if it fits the destination.
+Input Value.: see compress_frame_to_jpeg()
+Return Value: the size of the compressed picture or -1
+******************************************************************************/
+static int compress_frame_turbo(jpeg_encoder *encoder, const unsigned char *frame, int width, int height, int format, unsigned char *buffer, int size, int quality)
+{
+    const unsigned char *planes[3], *src;
+    unsigned char *cb, *cr;
+    int strides[3];
+    int subsamp = (format == V4L2_PIX_FMT_YUYV) ? TJSAMP_422 : TJSAMP_420;
+    int c_width = width / 2, y, x, ret;
+    unsigned long needed = tjBufSize(width, height, subsamp), jpeg_size;
+
+    if(needed == (unsigned long) -1)
+        return -1;
+
+    if(needed > encoder->tj_size) {
+        tjFree(encoder->tj_buffer);
+        encoder->tj_size = 0;
+        if((encoder->tj_buffer = tjAlloc(needed)) == NULL)
+            return -1;
+        encoder->tj_size = needed;
+    }
+    jpeg_size = encoder->tj_size;
+
+    strides[0] = width;
+    strides[1] = strides[2] = c_width;
+
+    switch(format) {
+    case V4L2_PIX_FMT_YUYV:
+        if(grow_rows(encoder, width * height * 2) < 0)
+            return -1;
+        planes[0] = encoder->rows;
+        planes[1] = cb = encoder->rows + width * height;
+        planes[2] = cr = cb + c_width * height;
+        for(y = 0; y < height; y++)
+            deinterleave_yuyv(frame + y * width * 2, encoder->rows + y * width, cb + y * c_width, cr + y * c_width, c_width);
+        break;
+
+    case V4L2_PIX_FMT_NV12:
+        if(grow_rows(encoder, c_width * (height / 2) * 2) < 0)
+            return -1;
+        planes[0] = frame;
+        planes[1] = cb = encoder->rows;
+        planes[2] = cr = cb + c_width * (height / 2);
+        src = frame + width * height;
+        for(x = 0; x < c_width * (height / 2); x++, src += 2) {
+            cb[x] = src[0];
+            cr[x] = src[1];
+        }
+        break;
+
+    case V4L2_PIX_FMT_YUV420:
+        planes[0] = frame;
+        planes[1] = frame + width * height;
+        planes[2] = planes[1] + c_width * (height / 2);
+        break;
+
+    case V4L2_PIX_FMT_RGB565:
+        if(grow_rows(encoder, width * height * 3) < 0)
+            return -1;
+        rgb565_to_rgb24(frame, encoder->rows, width * height);
+        frame = encoder->rows;
+        /* fall through */
+    case V4L2_PIX_FMT_RGB24:
+        ret = tjCompress2(encoder->tj, (unsigned char *) frame, width, width * 3, height, TJPF_RGB,
+                          &encoder->tj_buffer, &jpeg_size, subsamp, quality, TJFLAG_NOREALLOC);
+        goto compressed;
+
+    default:
+        return -1;
+    }
+
+    ret = tjCompressFromYUVPlanes(encoder->tj, planes, width, strides, height, subsamp,
+                                  &encoder->tj_buffer, &jpeg_size, quality, TJFLAG_NOREALLOC);
+
+compressed:
+    if(ret < 0) {
+        fprintf(stderr, "TurboJPEG: %s\n", tjGetErrorStr2(encoder->tj));
+        return -1;
+    }
+    if(jpeg_size > size)
+        return -1;
+
+    memcpy(buffer, encoder->tj_buffer, jpeg_size);
+    return jpeg_size;
+}
+#endif
+
 /******************************************************************************
 Description.: yuv2jpeg function is based on compress_yuyv_to_jpeg written by
               Gabriel A. Devenyi.
               modified to support other formats like RGB5:6:5 by Miklós Márton
               It uses the destination manager implemented above to compress
-              YUYV data to JPEG. Most other implementations use the
-              "jpeg_stdio_dest" from libjpeg, which can not store compressed
-              pictures to memory instead of a file.
-Input Value.: video structure from v4l2uvc.c/h, destination buffer and buffersize
-              the buffer must be large enough, no error/size checking is done!
-Return Value: the buffer will contain the compressed data
-******************************************************************************/
-int compress_image_to_jpeg(struct vdIn *vd, unsigned char *buffer, int size, int quality)
-{
-    struct jpeg_compress_struct cinfo;
-    struct jpeg_error_mgr jerr;
-    JSAMPROW *row_pointer;
-    unsigned char *line_buffer, *yuyv;
-    int z;
-    static int written;
-
-    line_buffer = calloc(vd->width * 3, 1);
-    yuyv = vd->framebuffer;
-
-    cinfo.err = jpeg_std_error(&jerr);
-    jpeg_create_compress(&cinfo);
-    /* jpeg_stdio_dest (&cinfo, file); */
-    dest_buffer(&cinfo, buffer, size, &written);
-
-    cinfo.image_width = vd->width;
-    cinfo.image_height = vd->height;
-    cinfo.input_components = 3;
-    cinfo.in_color_space = JCS_RGB;
-
-    jpeg_set_defaults(&cinfo);
-    jpeg_set_quality(&cinfo, quality, TRUE);
-
-    jpeg_start_compress(&cinfo, TRUE);
-
-    z = 0;
-    if (vd->formatIn == V4L2_PIX_FMT_YUYV) {
-        while(cinfo.next_scanline < vd->height) {
-            int x;
-            unsigned char *ptr = line_buffer;
-
-
-            for(x = 0; x < vd->width; x++) {
-                int r, g, b;
-                int y, u, v;
-
-                if(!z)
-                    y = yuyv[0] << 8;
-                else
-                    y = yuyv[2] << 8;
-                u = yuyv[1] - 128;
-                v = yuyv[3] - 128;
-
-                r = (y + (359 * v)) >> 8;
-                g = (y - (88 * u) - (183 * v)) >> 8;
-                b = (y + (454 * u)) >> 8;
-
-                *(ptr++) = (r > 255) ? 255 : ((r < 0) ? 0 : r);
-                *(ptr++) = (g > 255) ? 255 : ((g < 0) ? 0 : g);
-                *(ptr++) = (b > 255) ? 255 : ((b < 0) ? 0 : b);
-
-                if(z++) {
-                    z = 0;
-                    yuyv += 4;
-                }
-            }
+              YUYV, NV12, YUV420, RGB565 and RGB24 data to JPEG. Most other
+              implementations use the "jpeg_stdio_dest" from libjpeg, which
+              can not store compressed pictures to memory instead of a file.
+              The parameters and tables are only set up again if the size,
+              format or quality of the picture changes.
+              Encoders using CODEC_TURBOJPEG compress the whole frame with
+              compress_frame_turbo() instead.
+Input Value.: * encoder.......: encoder set up with jpeg_encoder_init()
+              * frame.........: the raw picture
+              * width, height.: size of the picture
+              * format........: V4L2 pixel format of the picture
+              * buffer, size..: destination buffer and its size
+              * quality.......: JPEG quality
+Return Value: the size of the compressed picture, -1 if it did not fit into
+              the buffer or could not be compressed
+******************************************************************************/
+int compress_frame_to_jpeg(jpeg_encoder *encoder, const unsigned char *frame, int width, int height, int format, unsigned char *buffer, int size, int quality)
+{
+    struct jpeg_compress_struct *cinfo = &encoder->cinfo;
+    JSAMPROW row_pointer[2 * DCTSIZE];
+    int written = -1, lines, i;
 
-            row_pointer = (JSAMPROW*)line_buffer;
-            jpeg_write_scanlines(&cinfo, row_pointer, 1);
-        }
-    } else if (vd->formatIn == V4L2_PIX_FMT_RGB565) {
-        while(cinfo.next_scanline < vd->height) {
-            int x;
-            unsigned char *ptr = line_buffer;
-
-            for(x = 0; x < vd->width; x++) {
-                /*
-                unsigned int tb = ((unsigned char)raw[i+1] << 8) + (unsigned char)raw[i];
-                r =  ((unsigned char)(raw[i+1]) & 248);
-                g = (unsigned char)(( tb & 2016) >> 3);
-                b =  ((unsigned char)raw[i] & 31) * 8;
-                */
-                unsigned int twoByte = (yuyv[1] << 8) + yuyv[0];
-                *(ptr++) = (yuyv[1] & 248);
-                *(ptr++) = (unsigned char)((twoByte & 2016) >> 3);
-                *(ptr++) = ((yuyv[0] & 31) * 8);
-                yuyv += 2;
-            }
+    pthread_once(&kernels_selected, select_kernels);
+
+#ifdef USE_TURBOJPEG
+    if(encoder->codec == CODEC_TURBOJPEG)
+        return compress_frame_turbo(encoder, frame, width, height, format, buffer, size, quality);
+#endif
+
+    if(setjmp(encoder->error)) {
+        /* set everything up again for the next frame */
+        jpeg_abort_compress(cinfo);
+        encoder->format = 0;
+        return -1;
+    }
+
+    dest_buffer(cinfo, buffer, size, &written);
 
-            row_pointer = (JSAMPROW*)line_buffer;
-            jpeg_write_scanlines(&cinfo, row_pointer, 1);
+    if(width != encoder->width || height != encoder->height ||
+       format != encoder->format || quality != encoder->quality) {
+        if(setup_encoder(encoder, width, height, format, quality) < 0) {
+            encoder->format = 0;
+            return -1;
         }
-    } else if (vd->formatIn == V4L2_PIX_FMT_RGB24) {
-        jpeg_write_scanlines(&cinfo, (JSAMPROW*)vd->framebuffer, vd->height);
     }
 
-    jpeg_finish_compress(&cinfo);
-    jpeg_destroy_compress(&cinfo);
+    jpeg_start_compress(cinfo, TRUE);
+
+    if(encoder->ycbcr) {
+        write_ycbcr(encoder, frame);
+    } else {
+        /* hand over one MCU row of RGB24 scanlines per call */
+        while(cinfo->next_scanline < height) {
+            lines = height - cinfo->next_scanline;
+            if(lines > 2 * DCTSIZE)
+                lines = 2 * DCTSIZE;
+
+            for(i = 0; i < lines; i++) {
+                if(format == V4L2_PIX_FMT_RGB565) {
+                    row_pointer[i] = encoder->rows + i * width * 3;
+                    rgb565_to_rgb24(frame + (cinfo->next_scanline + i) * width * 2, row_pointer[i], width);
+                } else {
+                    row_pointer[i] = (JSAMPROW)(frame + (cinfo->next_scanline + i) * width * 3);
+                }
+            }
+            jpeg_write_scanlines(cinfo, row_pointer, lines);
+        }
+    }
 
-    free(line_buffer);
+    jpeg_finish_compress(cinfo);
 
     return (written);
 }
+
+/******************************************************************************
+Description.: compresses the current frame of a device
+Input Value.: encoder, video structure from v4l2uvc.c/h, destination buffer
+              and buffersize
+Return Value: the size of the compressed picture or -1
+******************************************************************************/
+int compress_image_to_jpeg(jpeg_encoder *encoder, struct vdIn *vd, unsigned char *buffer, int size, int quality)
+{
+    return compress_frame_to_jpeg(encoder, vd->framebuffer, vd->width, vd->height, vd->formatIn, buffer, size, quality);
+}
 #endif
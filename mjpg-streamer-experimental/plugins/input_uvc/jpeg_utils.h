@@ -1,3 +1,62 @@
+#ifndef JPEG_UTILS_H
+#define JPEG_UTILS_H
 #ifndef NO_LIBJPEG
-int compress_image_to_jpeg(struct vdIn *vd, unsigned char *buffer, int size, int quality);
+#include <stdio.h>
+#include <setjmp.h>
+#include <jpeglib.h>
+#ifdef USE_TURBOJPEG
+#include <turbojpeg.h>
+#endif
+
+/* libraries the frames can be compressed with */
+enum _jpeg_codec {
+    CODEC_LIBJPEG = 0,          /* scanline API of libjpeg */
+    CODEC_TURBOJPEG = 1         /* whole-frame TurboJPEG API, if compiled in */
+};
+typedef enum _jpeg_codec jpeg_codec;
+
+#ifdef USE_TURBOJPEG
+#define DEFAULT_CODEC CODEC_TURBOJPEG
+#else
+#define DEFAULT_CODEC CODEC_LIBJPEG
+#endif
+
+/*
+ * An encoder keeps its compressor, parameters and row buffers from frame to
+ * frame. Each thread that compresses needs its own encoder. The libjpeg
+ * compressor is used with CODEC_LIBJPEG, the TurboJPEG handle with
+ * CODEC_TURBOJPEG.
+ */
+typedef struct _jpeg_encoder jpeg_encoder;
+struct _jpeg_encoder {
+    struct jpeg_compress_struct cinfo;  /* must be the first member */
+    struct jpeg_error_mgr jerr;
+    jmp_buf error;
+    jpeg_codec codec;
+
+    /* the picture the parameters were set up for, format 0 if none */
+    int width, height, format, quality;
+
+    /* rows handed to libjpeg */
+    unsigned char *rows;
+    int rows_size;
+    int ycbcr;                  /* raw YCbCr input instead of RGB scanlines */
+    int lines;                  /* luma rows per call of jpeg_write_raw_data() */
+    int y_width, c_width;       /* padded to whole blocks */
+    JSAMPROW y_rows[2 * DCTSIZE], cb_rows[DCTSIZE], cr_rows[DCTSIZE];
+
+#ifdef USE_TURBOJPEG
+    tjhandle tj;
+    unsigned char *tj_buffer;   /* large enough for any picture of this size */
+    unsigned long tj_size;
+#endif
+};
+
+int jpeg_codec_by_name(const char *name);
+const char *jpeg_codec_name(jpeg_codec codec);
+int jpeg_encoder_init(jpeg_encoder *encoder, jpeg_codec codec);
+void jpeg_encoder_destroy(jpeg_encoder *encoder);
+int compress_frame_to_jpeg(jpeg_encoder *encoder, const unsigned char *frame, int width, int height, int format, unsigned char *buffer, int size, int quality);
+int compress_image_to_jpeg(jpeg_encoder *encoder, struct vdIn *vd, unsigned char *buffer, int size, int quality);
+#endif
 #endif
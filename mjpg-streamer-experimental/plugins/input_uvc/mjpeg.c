@@ -0,0 +1,287 @@
+/*******************************************************************************
+# Linux-UVC streaming input-plugin for MJPG-streamer                           #
+#                                                                              #
+# This package work with the Logitech UVC based webcams with the mjpeg feature #
+#                                                                              #
+#   Copyright (C) 2007  Tom Stöveken                                           #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; either version 2 of the License, or            #
+# (at your option) any later version.                                          #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+#include <stdlib.h>
+#include <string.h>
+
+#include "mjpeg.h"
+
+#define MARKER_SOI  0xd8
+#define MARKER_EOI  0xd9
+#define MARKER_SOS  0xda
+#define MARKER_DHT  0xc4
+#define MARKER_DRI  0xdd
+#define MARKER_RST0 0xd0
+
+/* reads a big endian 16 bit value */
+#define BE16(p) (((p)[0] << 8) | (p)[1])
+
+/******************************************************************************
+Description.: Walks the marker segments of a JPEG from the SOI up to the SOS.
+              Only the segment lengths are followed, no byte of a segment is
+              searched, so this costs a few dozen steps for a typical header.
+Input Value.: * frame, size: the JPEG
+              * layout.....: receives the offsets of the segments
+Return Value: MJPEG_OK or the reason the header is broken
+******************************************************************************/
+int mjpeg_parse_header(const unsigned char *frame, int size, mjpeg_layout *layout)
+{
+    int pos = 2, length, marker, hmax = 1, vmax = 1, components, i;
+
+    layout->dht = layout->sof = layout->dri = layout->sos = layout->scan = layout->eoi = -1;
+    layout->width = layout->height = layout->mcus = layout->restart_interval = 0;
+
+    if(size < 4 || frame[0] != 0xff || frame[1] != MARKER_SOI)
+        return MJPEG_NO_SOI;
+
+    while(pos + 4 <= size) {
+        if(frame[pos] != 0xff)
+            return MJPEG_BAD_SEGMENT;
+
+        /* any number of 0xff may precede a marker */
+        marker = frame[pos + 1];
+        if(marker == 0xff) {
+            pos++;
+            continue;
+        }
+
+        /* markers without a segment */
+        if(marker == 0x01 || (marker >= MARKER_RST0 && marker <= MARKER_RST0 + 7)) {
+            pos += 2;
+            continue;
+        }
+        if(marker == MARKER_SOI || marker == MARKER_EOI)
+            return MJPEG_BAD_SEGMENT;
+
+        length = BE16(frame + pos + 2);
+        if(length < 2 || pos + 2 + length > size)
+            return MJPEG_BAD_SEGMENT;
+
+        if(marker == MARKER_DHT) {
+            if(layout->dht < 0)
+                layout->dht = pos;
+        } else if(marker >= 0xc0 && marker <= 0xcf && marker != 0xc8 && marker != 0xcc) {
+            /* SOF: precision, height, width, components and their sampling */
+            if(length < 8)
+                return MJPEG_BAD_SEGMENT;
+            layout->sof = pos;
+            layout->height = BE16(frame + pos + 5);
+            layout->width = BE16(frame + pos + 7);
+            components = frame[pos + 9];
+            if(length < 8 + components * 3)
+                return MJPEG_BAD_SEGMENT;
+            for(i = 0; i < components; i++) {
+                int sampling = frame[pos + 11 + i * 3];
+                if((sampling >> 4) > hmax)
+                    hmax = sampling >> 4;
+                if((sampling & 0x0f) > vmax)
+                    vmax = sampling & 0x0f;
+            }
+            if(components == 1)
+                hmax = vmax = 1;
+            layout->mcus = ((layout->width + 8 * hmax - 1) / (8 * hmax)) * ((layout->height + 8 * vmax - 1) / (8 * vmax));
+        } else if(marker == MARKER_DRI) {
+            if(length < 4)
+                return MJPEG_BAD_SEGMENT;
+            layout->dri = pos;
+            layout->restart_interval = BE16(frame + pos + 4);
+        } else if(marker == MARKER_SOS) {
+            layout->sos = pos;
+            layout->scan = pos + 2 + length;
+            return (layout->sof < 0) ? MJPEG_BAD_SEGMENT : MJPEG_OK;
+        }
+
+        pos += 2 + length;
+    }
+
+    return MJPEG_NO_SOS;
+}
+
+/******************************************************************************
+Description.: checks whether a segment of the frame equals its cached copy
+Input Value.: * frame, size: the frame
+              * pos........: offset of the segment in the frame
+              * copy, length: the cached segment including its marker
+Return Value: 1 if it is the same, 0 if not
+******************************************************************************/
+static int same_segment(const unsigned char *frame, int size, int pos, const unsigned char *copy, int length)
+{
+    return pos + length <= size && memcmp(frame + pos, copy, length) == 0;
+}
+
+/******************************************************************************
+Description.: Gets the layout of a frame from the cache if the frame has the
+              same header structure as the one the cache learned, otherwise
+              the header is parsed and the cache learns it. The check is
+              bounded: SOI, the DHT marker and the SOF, DRI and SOS segments
+              are compared at their cached offsets. Any segment that changed
+              its length moves the SOS, so this detects a changed structure.
+              Segments that keep their length, like the quantisation tables
+              of cameras that vary the quality, do not matter.
+Input Value.: * frame, size: the frame
+              * cache......: the cache, it is updated
+              * layout.....: receives the layout of the frame
+Return Value: MJPEG_OK or the reason the header is broken
+******************************************************************************/
+int mjpeg_parse_cached(const unsigned char *frame, int size, mjpeg_cache *cache, mjpeg_layout *layout)
+{
+    const mjpeg_layout *cached = &cache->layout;
+    int ret;
+
+    if(cache->valid && size > cached->scan &&
+       frame[0] == 0xff && frame[1] == MARKER_SOI &&
+       (cached->dht < 0 || (frame[cached->dht] == 0xff && frame[cached->dht + 1] == MARKER_DHT)) &&
+       same_segment(frame, size, cached->sof, cache->sof, cache->sof_length) &&
+       (cached->dri < 0 || same_segment(frame, size, cached->dri, cache->dri, sizeof(cache->dri))) &&
+       same_segment(frame, size, cached->sos, cache->sos, cache->sos_length)) {
+        *layout = *cached;
+        cache->hits++;
+        return MJPEG_OK;
+    }
+
+    cache->misses++;
+    cache->valid = 0;
+    if((ret = mjpeg_parse_header(frame, size, layout)) != MJPEG_OK)
+        return ret;
+
+    /* learn the header, the segments are complete since the parse succeeded */
+    cache->sof_length = 2 + BE16(frame + layout->sof + 2);
+    cache->sos_length = layout->scan - layout->sos;
+    if(cache->sof_length > MJPEG_CACHED_SEGMENT || cache->sos_length > MJPEG_CACHED_SEGMENT)
+        return MJPEG_OK;
+
+    memcpy(cache->sof, frame + layout->sof, cache->sof_length);
+    memcpy(cache->sos, frame + layout->sos, cache->sos_length);
+    if(layout->dri >= 0)
+        memcpy(cache->dri, frame + layout->dri, sizeof(cache->dri));
+    cache->layout = *layout;
+    cache->valid = 1;
+
+    return MJPEG_OK;
+}
+
+/******************************************************************************
+Description.: Checks the restart markers within the scan. Entropy coded data
+              contains 0xff only stuffed with 0x00 or as a marker, so memchr()
+              jumps from one 0xff to the next. The restart markers must count
+              up modulo 8 and there must be one per interval, any other marker
+              means that a frame got spliced into this one.
+Input Value.: * frame.: the JPEG
+              * layout: its layout including "eoi"
+Return Value: MJPEG_OK or MJPEG_BAD_RESTART
+******************************************************************************/
+static int check_restarts(const unsigned char *frame, const mjpeg_layout *layout)
+{
+    const unsigned char *p = frame + layout->scan, *end = frame + layout->eoi;
+    int count = 0, expected = 0;
+
+    if(layout->restart_interval > 0 && layout->mcus > 0)
+        expected = (layout->mcus + layout->restart_interval - 1) / layout->restart_interval - 1;
+
+    while(p < end && (p = memchr(p, 0xff, end - p)) != NULL) {
+        if(p + 1 >= end)
+            return MJPEG_BAD_RESTART;
+
+        if(p[1] == 0x00) {
+            p += 2;
+        } else if(p[1] == 0xff) {
+            p++;
+        } else if(p[1] == MARKER_RST0 + (count & 7)) {
+            count++;
+            p += 2;
+        } else {
+            return MJPEG_BAD_RESTART;
+        }
+    }
+
+    if(layout->restart_interval > 0 && count != expected)
+        return MJPEG_BAD_RESTART;
+
+    return MJPEG_OK;
+}
+
+/******************************************************************************
+Description.: Checks an MJPEG frame as delivered by the camera. The header is
+              walked like mjpeg_parse_header() does, then the last EOI marker
+              is searched backwards from the end with memrchr(), which is
+              vectorized by the C library. Cameras may pad the buffer behind
+              the EOI, so the search does not stop at the last two bytes.
+Input Value.: * frame, size: the frame
+              * check......: one of MJPEG_CHECK_*
+              * cache......: header cache of the stream, NULL to always
+                             parse the header
+              * layout.....: receives the offsets of the segments
+Return Value: MJPEG_OK or the reason the frame is broken
+******************************************************************************/
+int mjpeg_validate(const unsigned char *frame, int size, int check, mjpeg_cache *cache, mjpeg_layout *layout)
+{
+    const unsigned char *p;
+    int ret, length;
+
+    if(cache != NULL)
+        ret = mjpeg_parse_cached(frame, size, cache, layout);
+    else
+        ret = mjpeg_parse_header(frame, size, layout);
+    if(ret != MJPEG_OK || check == MJPEG_CHECK_NONE)
+        return ret;
+
+    /* the EOI is the last 0xff 0xd9 of the frame, it never occurs in the scan */
+    length = size - layout->scan;
+    while(length > 1 && (p = memrchr(frame + layout->scan + 1, MARKER_EOI, length - 1)) != NULL) {
+        if(p[-1] == 0xff) {
+            layout->eoi = p - 1 - frame;
+            break;
+        }
+        length = p - (frame + layout->scan);
+    }
+    if(layout->eoi < 0)
+        return MJPEG_NO_EOI;
+
+    if(check >= MJPEG_CHECK_RESTARTS)
+        return check_restarts(frame, layout);
+
+    return MJPEG_OK;
+}
+
+/******************************************************************************
+Description.: describes the result of mjpeg_validate()
+Input Value.: the result
+Return Value: a constant string
+******************************************************************************/
+const char *mjpeg_error_string(int error)
+{
+    switch(error) {
+    case MJPEG_OK:
+        return "ok";
+    case MJPEG_NO_SOI:
+        return "no SOI marker";
+    case MJPEG_BAD_SEGMENT:
+        return "malformed header segment";
+    case MJPEG_NO_SOS:
+        return "no SOS marker";
+    case MJPEG_NO_EOI:
+        return "no EOI marker";
+    case MJPEG_BAD_RESTART:
+        return "restart markers out of sequence";
+    }
+    return "unknown error";
+}
@@ -0,0 +1,82 @@
+/*******************************************************************************
+# Linux-UVC streaming input-plugin for MJPG-streamer                           #
+#                                                                              #
+# This package work with the Logitech UVC based webcams with the mjpeg feature #
+#                                                                              #
+#   Copyright (C) 2007  Tom Stöveken                                           #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; either version 2 of the License, or            #
+# (at your option) any later version.                                          #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+#ifndef MJPEG_H
+#define MJPEG_H
+
+/*
+ * Where the segments of an MJPEG frame are, offsets from the start of the
+ * frame. Filled by mjpeg_parse_header(), mjpeg_validate() adds "eoi".
+ */
+typedef struct _mjpeg_layout mjpeg_layout;
+struct _mjpeg_layout {
+    int dht;                    /* first DHT marker, -1 if the huffman tables are missing */
+    int sof;                    /* SOF marker */
+    int dri;                    /* DRI marker, -1 if there is none */
+    int sos;                    /* SOS marker */
+    int scan;                   /* first byte of the entropy coded data */
+    int eoi;                    /* EOI marker */
+    int width, height;
+    int mcus;                   /* minimum coded units in the scan */
+    int restart_interval;       /* MCUs between restart markers, 0 if there are none */
+};
+
+/* how thoroughly mjpeg_validate() checks a frame */
+enum _mjpeg_check {
+    MJPEG_CHECK_NONE = 0,       /* only parse the header */
+    MJPEG_CHECK_MARKERS = 1,    /* SOI, segments up to SOS and the EOI */
+    MJPEG_CHECK_RESTARTS = 2    /* and the markers within the scan */
+};
+
+/* why a frame is broken */
+enum _mjpeg_error {
+    MJPEG_OK = 0,
+    MJPEG_NO_SOI = -1,
+    MJPEG_BAD_SEGMENT = -2,     /* a segment is malformed or runs past the end */
+    MJPEG_NO_SOS = -3,
+    MJPEG_NO_EOI = -4,
+    MJPEG_BAD_RESTART = -5      /* restart markers missing, out of sequence or a stray marker */
+};
+
+/*
+ * Cameras send the same header on every frame. The layout of the last
+ * parsed header is kept together with a copy of its SOF, DRI and SOS
+ * segments, a frame whose bytes match at the same offsets has the same
+ * layout and its header is not walked again.
+ */
+#define MJPEG_CACHED_SEGMENT 32
+
+typedef struct _mjpeg_cache mjpeg_cache;
+struct _mjpeg_cache {
+    int valid;
+    mjpeg_layout layout;
+    unsigned char sof[MJPEG_CACHED_SEGMENT], dri[6], sos[MJPEG_CACHED_SEGMENT];
+    int sof_length, sos_length;
+    unsigned int hits, misses;
+};
+
+int mjpeg_parse_header(const unsigned char *frame, int size, mjpeg_layout *layout);
+int mjpeg_parse_cached(const unsigned char *frame, int size, mjpeg_cache *cache, mjpeg_layout *layout);
+int mjpeg_validate(const unsigned char *frame, int size, int check, mjpeg_cache *cache, mjpeg_layout *layout);
+const char *mjpeg_error_string(int error);
+
+#endif
@@ -0,0 +1,371 @@
+/*******************************************************************************
+# Linux-UVC streaming input-plugin for MJPG-streamer                           #
+#                                                                              #
+# This package work with the Logitech UVC based webcams with the mjpeg feature #
+#                                                                              #
+#   Copyright (C) 2007  Tom Stöveken                                           #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; either version 2 of the License, or            #
+# (at your option) any later version.                                          #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "v4l2uvc.h"
+#include "dynctrl.h"
+#include "controls.h"
+#include "motion.h"
+
+static const int motion_min[2] = { MIN_PAN, MIN_TILT };
+static const int motion_max[2] = { MAX_PAN, MAX_TILT };
+
+/******************************************************************************
+Description.: the position all queued moves end at, the caller holds the mutex
+Input Value.: * m...: the motion
+              * axis: MOTION_PAN or MOTION_TILT
+Return Value: position in 1/64 degree
+******************************************************************************/
+static int target(motion *m, motion_axis axis)
+{
+    return (m->reset ? 0 : m->position[axis]) + m->delta[axis];
+}
+
+/******************************************************************************
+Description.: publishes the position and the state as IN_CMD_PANTILT controls,
+              the caller holds the mutex
+Input Value.: the motion
+Return Value: -
+******************************************************************************/
+static void publish_motion(motion *m)
+{
+    control *ctrl;
+    int i;
+
+    for(i = 0; i < m->in->parametercount; i++) {
+        ctrl = &m->in->in_parameters[i];
+        if(ctrl->group != IN_CMD_PANTILT)
+            continue;
+        switch(ctrl->ctrl.id) {
+        case MOTION_CTRL_PAN:
+            ctrl->value = target(m, MOTION_PAN) / 64;
+            break;
+        case MOTION_CTRL_TILT:
+            ctrl->value = target(m, MOTION_TILT) / 64;
+            break;
+        case MOTION_CTRL_MOVING:
+            ctrl->value = (m->state != MOTION_IDLE || m->reset || m->delta[MOTION_PAN] || m->delta[MOTION_TILT]);
+            break;
+        }
+    }
+}
+
+/******************************************************************************
+Description.: sends the next queued move to the motors, the caller holds the
+              mutex, it is released during the ioctl, which runs under
+              state_mutex
+Input Value.: the motion
+Return Value: -
+******************************************************************************/
+static void start_move(motion *m)
+{
+    control_request requests[2];
+    struct timespec now;
+    int reset = m->reset;
+    int pan = m->delta[MOTION_PAN], tilt = m->delta[MOTION_TILT];
+    int duration, ok;
+
+    memset(requests, 0, sizeof(requests));
+    if(reset) {
+        requests[0].id = V4L2_CID_PAN_RESET;
+        requests[1].id = V4L2_CID_TILT_RESET;
+        requests[0].value = requests[1].value = 1;
+        requests[0].type = requests[1].type = V4L2_CTRL_TYPE_BUTTON;
+        m->reset = 0;
+    } else {
+        requests[0].id = V4L2_CID_PAN_RELATIVE;
+        requests[0].value = pan;
+        requests[1].id = V4L2_CID_TILT_RELATIVE;
+        requests[1].value = tilt;
+        requests[0].type = requests[1].type = V4L2_CTRL_TYPE_INTEGER;
+        m->delta[MOTION_PAN] = m->delta[MOTION_TILT] = 0;
+    }
+
+    /* the capture thread closes and reopens fd, a lost device fails the move */
+    pthread_mutex_unlock(&m->mutex);
+    lock_capture(m->vd);
+    ok = (!m->vd->lost && m->vd->fd >= 0 && apply_controls(m->vd->fd, requests, 2) == 0);
+    unlock_capture(m->vd);
+    pthread_mutex_lock(&m->mutex);
+
+    if(!ok) {
+        /* the motors may have moved partly, the position is unknown now */
+        DBG("pan/tilt %s failed\n", reset ? "reset" : "move");
+        m->failed++;
+        m->valid = 0;
+        m->reset = 0;
+        m->delta[MOTION_PAN] = m->delta[MOTION_TILT] = 0;
+        return;
+    }
+
+    if(reset) {
+        m->valid = 1;
+        m->position[MOTION_PAN] = m->position[MOTION_TILT] = 0;
+        m->state = MOTION_RESETTING;
+        duration = MOTION_RESET_TIME;
+    } else {
+        m->position[MOTION_PAN] += pan;
+        m->position[MOTION_TILT] += tilt;
+        m->state = MOTION_MOVING;
+        duration = ((abs(pan) > abs(tilt)) ? abs(pan) : abs(tilt)) * 1000 / MOTION_SPEED;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    m->done.tv_sec = now.tv_sec + duration / 1000;
+    m->done.tv_nsec = now.tv_nsec + (duration % 1000) * 1000000L;
+    if(m->done.tv_nsec >= 1000000000L) {
+        m->done.tv_sec++;
+        m->done.tv_nsec -= 1000000000L;
+    }
+}
+
+/******************************************************************************
+Description.: thread that drives the motors, one move at a time
+Input Value.: the motion
+Return Value: unused, always NULL
+******************************************************************************/
+static void *motion_thread(void *arg)
+{
+    motion *m = arg;
+
+    pthread_mutex_lock(&m->mutex);
+    while(!m->stop) {
+        if(m->state != MOTION_IDLE) {
+            /* the motors turn, wait for them */
+            if(pthread_cond_timedwait(&m->work, &m->mutex, &m->done) != ETIMEDOUT)
+                continue;
+            m->state = MOTION_IDLE;
+            m->moves++;
+        }
+
+        if(m->reset || m->delta[MOTION_PAN] || m->delta[MOTION_TILT])
+            start_move(m);
+
+        publish_motion(m);
+        if(m->state == MOTION_IDLE && !m->stop)
+            pthread_cond_wait(&m->work, &m->mutex);
+    }
+    pthread_mutex_unlock(&m->mutex);
+
+    return NULL;
+}
+
+/******************************************************************************
+Description.: appends a pseudo control of the IN_CMD_PANTILT group
+Input Value.: * in.......: the input
+              * id, name.: the control
+              * type.....: V4L2_CTRL_TYPE_*
+              * min, max.: its range
+              * flags....: V4L2_CTRL_FLAG_*
+Return Value: 0 if ok, -1 in case of error
+******************************************************************************/
+static int add_control(input *in, int id, const char *name, int type, int min, int max, int flags)
+{
+    control *params = realloc(in->in_parameters, (in->parametercount + 1) * sizeof(control));
+    control *ctrl;
+
+    if(params == NULL)
+        return -1;
+    in->in_parameters = params;
+    ctrl = &in->in_parameters[in->parametercount];
+    memset(ctrl, 0, sizeof(control));
+    ctrl->ctrl.id = id;
+    snprintf((char *)ctrl->ctrl.name, sizeof(ctrl->ctrl.name), "%s", name);
+    ctrl->ctrl.type = type;
+    ctrl->ctrl.minimum = min;
+    ctrl->ctrl.maximum = max;
+    ctrl->ctrl.step = 1;
+    ctrl->ctrl.flags = flags;
+    ctrl->group = IN_CMD_PANTILT;
+    in->parametercount++;
+    return 0;
+}
+
+/******************************************************************************
+Description.: Starts the motion thread of a camera and adds its controls to the
+              input. Must be called before other threads use in_parameters.
+Input Value.: * vd: the device, it must have relative pan and tilt controls
+              * in: the input of the device
+Return Value: the motion or NULL in case of error
+******************************************************************************/
+motion *motion_start(struct vdIn *vd, input *in)
+{
+    pthread_condattr_t attr;
+    motion *m;
+
+    if((m = calloc(1, sizeof(motion))) == NULL)
+        return NULL;
+
+    if(add_control(in, MOTION_CTRL_PAN, "Pan (degrees)", V4L2_CTRL_TYPE_INTEGER, MIN_PAN / 64, MAX_PAN / 64, 0) < 0 ||
+       add_control(in, MOTION_CTRL_TILT, "Tilt (degrees)", V4L2_CTRL_TYPE_INTEGER, MIN_TILT / 64, MAX_TILT / 64, 0) < 0 ||
+       add_control(in, MOTION_CTRL_RESET, "Pan/tilt reset", V4L2_CTRL_TYPE_BUTTON, 0, 0, 0) < 0 ||
+       add_control(in, MOTION_CTRL_MOVING, "Pan/tilt moving", V4L2_CTRL_TYPE_BOOLEAN, 0, 1, V4L2_CTRL_FLAG_READ_ONLY) < 0) {
+        free(m);
+        return NULL;
+    }
+
+    m->vd = vd;
+    m->in = in;
+    pthread_mutex_init(&m->mutex, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&m->work, &attr);
+    pthread_condattr_destroy(&attr);
+    if(pthread_create(&m->threadID, NULL, motion_thread, m) != 0) {
+        pthread_cond_destroy(&m->work);
+        pthread_mutex_destroy(&m->mutex);
+        free(m);
+        return NULL;
+    }
+
+    return m;
+}
+
+/******************************************************************************
+Description.: queues a move to the origin, earlier queued moves are dropped
+Input Value.: the motion
+Return Value: 0
+******************************************************************************/
+int motion_reset(motion *m)
+{
+    pthread_mutex_lock(&m->mutex);
+    m->reset = 1;
+    m->delta[MOTION_PAN] = m->delta[MOTION_TILT] = 0;
+    publish_motion(m);
+    pthread_cond_signal(&m->work);
+    pthread_mutex_unlock(&m->mutex);
+    return 0;
+}
+
+/******************************************************************************
+Description.: Queues a relative move, it is merged with other queued moves.
+              The target is kept within the range of the motors. As long as
+              the position is unknown a reset is queued in front of it. The
+              caller holds the mutex.
+Input Value.: * m....: the motion
+              * axis.: MOTION_PAN or MOTION_TILT
+              * delta: 1/64 degree to move
+Return Value: the position the queued moves end at
+******************************************************************************/
+static int queue_move(motion *m, motion_axis axis, int delta)
+{
+    int from, to;
+
+    if(!m->valid && !m->reset) {
+        m->reset = 1;
+        m->delta[MOTION_PAN] = m->delta[MOTION_TILT] = 0;
+    }
+
+    from = target(m, axis);
+    to = from + delta;
+    if(to < motion_min[axis])
+        to = motion_min[axis];
+    if(to > motion_max[axis])
+        to = motion_max[axis];
+    if(to != from) {
+        if(m->delta[axis] != 0 || m->state == MOTION_MOVING)
+            m->merged++;
+        m->delta[axis] += to - from;
+        pthread_cond_signal(&m->work);
+    }
+    publish_motion(m);
+
+    return to;
+}
+
+/******************************************************************************
+Description.: queues a relative move
+Input Value.: * m....: the motion
+              * axis.: MOTION_PAN or MOTION_TILT
+              * delta: 1/64 degree to move
+Return Value: the position the queued moves end at
+******************************************************************************/
+int motion_move(motion *m, motion_axis axis, int delta)
+{
+    int position;
+
+    pthread_mutex_lock(&m->mutex);
+    position = queue_move(m, axis, delta);
+    pthread_mutex_unlock(&m->mutex);
+
+    return position;
+}
+
+/******************************************************************************
+Description.: queues a move to an absolute position
+Input Value.: * m.......: the motion
+              * axis....: MOTION_PAN or MOTION_TILT
+              * position: in 1/64 degree from the origin
+Return Value: the position the queued moves end at
+******************************************************************************/
+int motion_move_to(motion *m, motion_axis axis, int position)
+{
+    pthread_mutex_lock(&m->mutex);
+    if(!m->valid && !m->reset)
+        queue_move(m, axis, 0);
+    position = queue_move(m, axis, position - target(m, axis));
+    pthread_mutex_unlock(&m->mutex);
+
+    return position;
+}
+
+/******************************************************************************
+Description.: tells where the queued moves end
+Input Value.: * m...: the motion
+              * axis: MOTION_PAN or MOTION_TILT
+Return Value: position in 1/64 degree
+******************************************************************************/
+int motion_target(motion *m, motion_axis axis)
+{
+    int position;
+
+    pthread_mutex_lock(&m->mutex);
+    position = target(m, axis);
+    pthread_mutex_unlock(&m->mutex);
+
+    return position;
+}
+
+/******************************************************************************
+Description.: stops the motion thread, queued moves are dropped
+Input Value.: the motion
+Return Value: -
+******************************************************************************/
+void motion_stop(motion *m)
+{
+    pthread_mutex_lock(&m->mutex);
+    m->stop = 1;
+    pthread_cond_signal(&m->work);
+    pthread_mutex_unlock(&m->mutex);
+
+    pthread_join(m->threadID, NULL);
+    DBG("pan/tilt: %lu moves, %lu merged, %lu failed\n", m->moves, m->merged, m->failed);
+    pthread_cond_destroy(&m->work);
+    pthread_mutex_destroy(&m->mutex);
+    free(m);
+}
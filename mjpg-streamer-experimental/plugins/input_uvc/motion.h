@@ -0,0 +1,85 @@
+/*******************************************************************************
+# Linux-UVC streaming input-plugin for MJPG-streamer                           #
+#                                                                              #
+# This package work with the Logitech UVC based webcams with the mjpeg feature #
+#                                                                              #
+#   Copyright (C) 2007  Tom Stöveken                                           #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; either version 2 of the License, or            #
+# (at your option) any later version.                                          #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#ifndef MOTION_H
+#define MOTION_H
+
+#include <pthread.h>
+
+#include "v4l2uvc.h"
+
+#define MOTION_RESET_TIME 4000      /* ms the motors need to return to the origin */
+#define MOTION_SPEED (60*64)        /* 1/64 degree the motors turn per second */
+
+/* pseudo controls of the IN_CMD_PANTILT group */
+#define MOTION_CTRL_PAN    1        /* absolute pan in degrees */
+#define MOTION_CTRL_TILT   2        /* absolute tilt in degrees */
+#define MOTION_CTRL_RESET  3        /* move to the origin */
+#define MOTION_CTRL_MOVING 4        /* read only, 1 until all queued moves are done */
+
+typedef enum _motion_axis motion_axis;
+enum _motion_axis {
+    MOTION_PAN = 0,
+    MOTION_TILT = 1,
+};
+
+typedef enum _motion_state motion_state;
+enum _motion_state {
+    MOTION_IDLE = 0,
+    MOTION_RESETTING = 1,
+    MOTION_MOVING = 2,
+};
+
+/*
+ * Pan/tilt motors do not report their position or when they stop, so the
+ * position is estimated from the moves sent to them. Moves are queued and
+ * sent by a thread per camera, which waits as long as a move is estimated
+ * to take before it sends the next one. Relative moves queued meanwhile are
+ * merged into a single one, absolute moves are converted to relative ones
+ * from the position the queued moves end at. Positions are in 1/64 degree.
+ */
+typedef struct _motion motion;
+struct _motion {
+    struct vdIn *vd;
+    input *in;                  /* publishes the position as IN_CMD_PANTILT controls */
+    pthread_t threadID;
+    pthread_mutex_t mutex;
+    pthread_cond_t work;        /* a move was queued or the thread stops */
+    motion_state state;
+    struct timespec done;       /* CLOCK_MONOTONIC, the running move ends */
+    int valid;                  /* the position is known, after the first reset */
+    int position[2];            /* where the running move ends */
+    int reset;                  /* a reset is queued, the delta follows it */
+    int delta[2];               /* queued relative move */
+    unsigned long moves, merged, failed;
+    int stop;
+};
+
+motion *motion_start(struct vdIn *vd, input *in);
+int motion_reset(motion *m);
+int motion_move(motion *m, motion_axis axis, int delta);
+int motion_move_to(motion *m, motion_axis axis, int position);
+int motion_target(motion *m, motion_axis axis);
+void motion_stop(motion *m);
+
+#endif
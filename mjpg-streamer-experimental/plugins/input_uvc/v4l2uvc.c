@@ -25,9 +25,13 @@
 
 #include <stdlib.h>
 #include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <libgen.h>
 #include "v4l2uvc.h"
 #include "huffman.h"
 #include "dynctrl.h"
+#include "controls.h"
 
 static int debug = 0;
 
@@ -53,6 +57,53 @@ int xioctl(int fd, int IOCTL_X, void *arg)
 }
 
 static int init_v4l2(struct vdIn *vd);
+static int queue_buffers(struct vdIn *vd);
+static void release_published(struct vdIn *vd);
+static int device_gone(struct vdIn *vd);
+static void unmap_buffers(struct vdIn *vd);
+
+/******************************************************************************
+Description.: (Re)allocates the buffers a frame gets copied to for the current
+              resolution and format, the capture must not run meanwhile
+Input Value.: the device
+Return Value: 0 if ok, -1 if the format is unknown or memory is missing
+******************************************************************************/
+static int alloc_framebuffers(struct vdIn *vd)
+{
+    /* alloc a temp buffer to reconstruct the pict */
+    vd->framesizeIn = (vd->width * vd->height << 1);
+    free(vd->tmpbuffer);
+    free(vd->framebuffer);
+    vd->tmpbuffer = NULL;
+    vd->framebuffer = NULL;
+
+    switch(vd->formatIn) {
+    case V4L2_PIX_FMT_MJPEG: // in JPG mode the frame size is varies at every frame, so we allocate a bit bigger buffer
+        vd->tmpbuffer = (unsigned char *) calloc(1, (size_t) vd->framesizeIn);
+        if(!vd->tmpbuffer)
+            return -1;
+        vd->framebuffer =
+            (unsigned char *) calloc(1, (size_t) vd->width * (vd->height + 8) * 2);
+        break;
+    case V4L2_PIX_FMT_H264: // passed through, only copied from the capture buffer
+        vd->tmpbuffer = (unsigned char *) calloc(1, (size_t) vd->framesizeIn);
+        return vd->tmpbuffer ? 0 : -1;
+    case V4L2_PIX_FMT_RGB24:
+        vd->framesizeIn = vd->width * vd->height * 3;
+        /* fall through */
+    case V4L2_PIX_FMT_RGB565: // buffer allocation for non varies on frame size formats
+    case V4L2_PIX_FMT_YUYV:
+    case V4L2_PIX_FMT_NV12:
+    case V4L2_PIX_FMT_YUV420:
+        vd->framebuffer =
+            (unsigned char *) calloc(1, (size_t) vd->framesizeIn);
+        break;
+    default:
+        return -1;
+    }
+
+    return vd->framebuffer ? 0 : -1;
+}
 
 int init_videoIn(struct vdIn *vd, char *device, int width,
                  int height, int fps, int format, int grabmethod, globals *pglobal, int id, v4l2_std_id vstd)
@@ -79,7 +130,23 @@ int init_videoIn(struct vdIn *vd, char *device, int width,
     vd->formatIn = format;
 	vd->vstd = vstd;
     vd->grabmethod = grabmethod;
-    vd->soft_framedrop = 0;
+    vd->frame_limit = 0;
+    vd->pausing = 0;
+    vd->lost = 0;
+    vd->inotify_fd = -1;
+    vd->in = &pglobal->in[id];
+    vd->enumerated = 0;
+    vd->controls = NULL;
+    vd->motion = NULL;
+    if((vd->event_fd = eventfd(0, EFD_NONBLOCK)) < 0) {
+        perror("Unable to create eventfd");
+        goto error;
+    }
+    if(pthread_mutex_init(&vd->state_mutex, NULL) != 0 ||
+       pthread_cond_init(&vd->state_cond, NULL) != 0) {
+        fprintf(stderr, "could not initialize the capture state\n");
+        goto error;
+    }
     if(init_v4l2(vd) < 0) {
         fprintf(stderr, " Init v4L2 failed !! exit fatal \n");
         goto error;;
@@ -178,28 +245,11 @@ int init_videoIn(struct vdIn *vd, char *device, int width,
         DBG("current resolution: %d\n", pglobal->in[id].in_formats[pglobal->in[id].formatCount].currentResolution);
     }
 
-    /* alloc a temp buffer to reconstruct the pict */
-    vd->framesizeIn = (vd->width * vd->height << 1);
-    switch(vd->formatIn) {
-    case V4L2_PIX_FMT_MJPEG: // in JPG mode the frame size is varies at every frame, so we allocate a bit bigger buffer
-        vd->tmpbuffer = (unsigned char *) calloc(1, (size_t) vd->framesizeIn);
-        if(!vd->tmpbuffer)
-            goto error;
-        vd->framebuffer =
-            (unsigned char *) calloc(1, (size_t) vd->width * (vd->height + 8) * 2);
-        break;
-    case V4L2_PIX_FMT_RGB565: // buffer allocation for non varies on frame size formats
-    case V4L2_PIX_FMT_YUYV:
-    case V4L2_PIX_FMT_RGB24:
-        vd->framebuffer =
-            (unsigned char *) calloc(1, (size_t) vd->framesizeIn);
-        break;
-    default:
+    if(alloc_framebuffers(vd) < 0) {
         fprintf(stderr, " should never arrive exit fatal !!\n");
         goto error;
-        break;
-
     }
+    vd->framesizeMax = vd->framesizeIn;
 
     if(!vd->framebuffer)
         goto error;
@@ -294,6 +344,16 @@ static int init_v4l2(struct vdIn *vd)
             } else if (vd->formatIn == V4L2_PIX_FMT_RGB24) {
                 fprintf(stderr, "The input device does not supports RGB3 format\n");
                 goto fatal;
+            } else if (vd->formatIn == V4L2_PIX_FMT_NV12) {
+                fprintf(stderr, "The input device does not supports NV12 format\n");
+                goto fatal;
+            } else if (vd->formatIn == V4L2_PIX_FMT_YUV420) {
+                fprintf(stderr, "The input device does not supports YU12 format\n");
+                goto fatal;
+            } else if (vd->formatIn == V4L2_PIX_FMT_H264) {
+                fprintf(stderr, "The input device does not supports H264 format\n"
+                                "Cameras that offer H.264 and MJPEG often have a separate device for each\n");
+                goto fatal;
             }
         } else {
             vd->formatIn = vd->fmt.fmt.pix.pixelformat;
@@ -330,10 +390,10 @@ static int init_v4l2(struct vdIn *vd)
                     }
 
                     // if we selecting lower FPS than the allowed then we will use software framedropping
-                    if (vd->fps < setfps->parm.capture.timeperframe.denominator) {
-                        vd->soft_framedrop = 1;
-                        vd->frame_period_time = 1000/vd->fps; // calcualate frame period time in ms
-                        IPRINT("Frame period time ......: %ld ms\n", vd->frame_period_time);
+                    if (setfps->parm.capture.timeperframe.numerator > 0 &&
+                        (unsigned long long)vd->fps_requested * setfps->parm.capture.timeperframe.numerator <
+                        1000ULL * setfps->parm.capture.timeperframe.denominator) {
+                        set_frame_limit(vd, vd->fps_requested);
 
                         // set FPS to maximum in order to minimize the lagging
                         memset(setfps, 0, sizeof(struct v4l2_streamparm));
@@ -348,9 +408,7 @@ static int init_v4l2(struct vdIn *vd)
                 }
             } else {
                 perror("Setting FPS on the capture device is not supported, fallback to software framedropping\n");
-                vd->soft_framedrop = 1;
-                vd->frame_period_time = 1000/vd->fps; // calcualate frame period time in ms
-                IPRINT("Frame period time ......: %ld ms\n", vd->frame_period_time);
+                set_frame_limit(vd, vd->fps_requested);
             }
         } else {
             perror("Unable to query that the FPS change is supported\n");
@@ -360,8 +418,13 @@ static int init_v4l2(struct vdIn *vd)
     /*
      * request buffers
      */
+    if(vd->formatIn != V4L2_PIX_FMT_MJPEG)
+        vd->zerocopy = 0;
+    vd->held = -1;
+
+    /* one more buffer in zero-copy mode, it is held by the consumers */
     memset(&vd->rb, 0, sizeof(struct v4l2_requestbuffers));
-    vd->rb.count = NB_BUFFER;
+    vd->rb.count = ((vd->buffers > 0) ? vd->buffers : NB_BUFFER) + (vd->zerocopy ? 1 : 0);
     vd->rb.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
     vd->rb.memory = V4L2_MEMORY_MMAP;
 
@@ -371,10 +434,23 @@ static int init_v4l2(struct vdIn *vd)
         goto fatal;
     }
 
+    /* the driver may provide less buffers, one must stay queued while another one is published */
+    vd->nbuffers = vd->rb.count;
+    if(vd->zerocopy && vd->nbuffers < 3) {
+        fprintf(stderr, "Only %d buffers available, zero-copy capture disabled\n", vd->nbuffers);
+        vd->zerocopy = 0;
+    }
+
+    free(vd->mem);
+    if((vd->mem = calloc(vd->nbuffers, sizeof(void *))) == NULL) {
+        perror("Unable to allocate buffer table");
+        goto fatal;
+    }
+
     /*
      * map the buffers
      */
-    for(i = 0; i < NB_BUFFER; i++) {
+    for(i = 0; i < vd->nbuffers; i++) {
         memset(&vd->buf, 0, sizeof(struct v4l2_buffer));
         vd->buf.index = i;
         vd->buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
@@ -393,30 +469,46 @@ static int init_v4l2(struct vdIn *vd)
                           vd->buf.m.offset);
         if(vd->mem[i] == MAP_FAILED) {
             perror("Unable to map buffer");
+            vd->mem[i] = NULL;
             goto fatal;
         }
         if(debug)
             fprintf(stderr, "Buffer mapped at address %p.\n", vd->mem[i]);
     }
 
-    /*
-     * Queue the buffers.
-     */
-    for(i = 0; i < NB_BUFFER; ++i) {
+    if(queue_buffers(vd) < 0)
+        goto fatal;
+
+    vd->stats.buffers = vd->nbuffers;
+    return 0;
+fatal:
+    return -1;
+
+}
+
+/******************************************************************************
+Description.: Queues all buffers, the stream must be off
+Input Value.: the device
+Return Value: 0 if ok, -1 in case of error
+******************************************************************************/
+static int queue_buffers(struct vdIn *vd)
+{
+    int i;
+
+    for(i = 0; i < vd->nbuffers; ++i) {
         memset(&vd->buf, 0, sizeof(struct v4l2_buffer));
         vd->buf.index = i;
         vd->buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
         vd->buf.memory = V4L2_MEMORY_MMAP;
-        ret = xioctl(vd->fd, VIDIOC_QBUF, &vd->buf);
-        if(ret < 0) {
+        if(xioctl(vd->fd, VIDIOC_QBUF, &vd->buf) < 0) {
             perror("Unable to queue buffer");
-            goto fatal;;
+            return -1;
         }
     }
-    return 0;
-fatal:
-    return -1;
 
+    vd->stats.queue_depth = vd->nbuffers;
+    vd->sequence_valid = 0;
+    return 0;
 }
 
 static int video_enable(struct vdIn *vd)
@@ -449,57 +541,301 @@ static int video_disable(struct vdIn *vd, streaming_state disabledState)
 }
 
 /******************************************************************************
-Description.:
-Input Value.:
-Return Value:
+Description.: Copies an MJPEG frame and inserts the default huffman tables in
+              front of the SOF marker if the camera left them out.
+Input Value.: * out....: destination, large enough for the frame and dht_data
+              * buf....: the frame
+              * size...: size of the frame
+              * layout.: layout of the frame from mjpeg_validate(), NULL to
+                         parse the header here
+Return Value: size of the copied frame
 ******************************************************************************/
-int is_huffman(unsigned char *buf)
+int memcpy_picture(unsigned char *out, unsigned char *buf, int size, const mjpeg_layout *layout)
 {
-    unsigned char *ptbuf;
-    int i = 0;
-    ptbuf = buf;
-    while(((ptbuf[0] << 8) | ptbuf[1]) != 0xffda) {
-        if(i++ > 2048)
-            return 0;
-        if(((ptbuf[0] << 8) | ptbuf[1]) == 0xffc4)
-            return 1;
-        ptbuf++;
+    mjpeg_layout parsed;
+    int pos = 0;
+
+    if(layout == NULL) {
+        mjpeg_parse_header(buf, size, &parsed);
+        layout = &parsed;
     }
+
+    if(layout->dht < 0 && layout->sof >= 0) {
+        memcpy(out + pos, buf, layout->sof); pos += layout->sof;
+        memcpy(out + pos, dht_data, sizeof(dht_data)); pos += sizeof(dht_data);
+        memcpy(out + pos, buf + layout->sof, size - layout->sof); pos += size - layout->sof;
+    } else {
+        memcpy(out + pos, buf, size); pos += size;
+    }
+    return pos;
+}
+
+/******************************************************************************
+Description.: counts a frame handed to the consumers and the time it took from
+              the capture until then
+Input Value.: * stats...: statistics of the publishing thread
+              * captured: CLOCK_MONOTONIC nanoseconds the frame was captured
+Return Value: -
+******************************************************************************/
+void account_publish(input_stats *stats, long long captured)
+{
+    struct timespec now;
+    long long latency;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    latency = (now.tv_sec * 1000000000LL + now.tv_nsec - captured) / 1000;
+    if(latency < 0)
+        latency = 0;
+
+    stats->published++;
+    stats->latency_total += latency;
+    if(latency > stats->latency_max)
+        stats->latency_max = latency;
+}
+
+/* CPU time the calling thread used so far in microseconds */
+unsigned long long thread_cpu_time(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/******************************************************************************
+Description.: Publishes the dequeued MJPEG buffer itself as the frame of the
+              input, nothing gets copied. The caller must hold the "db" mutex.
+              Consumers copy the frame while holding "db" as well, so the
+              buffer published before is not read any more and gets requeued.
+              A missing huffman table is not inserted into the buffer, it is
+              passed as "insert" to the consumers instead.
+Input Value.: * vd: the device with a dequeued MJPEG buffer, vd->layout
+                    describes the frame
+              * in: the input to publish the frame with
+Return Value: size of the frame, -1 if the frame was dropped
+******************************************************************************/
+int publish_picture(struct vdIn *vd, input *in)
+{
+    unsigned char *frame = vd->mem[vd->buf.index];
+    int size = vd->buf.bytesused;
+
+    in->insert = NULL;
+    in->insert_size = 0;
+    in->insert_at = 0;
+
+    /* the layout was filled in when the frame got validated */
+    if(vd->layout.dht < 0) {
+        if(vd->layout.sof < 0) {
+            requeue_buffer(vd, vd->buf.index);
+            return -1;
+        }
+
+        in->insert = dht_data;
+        in->insert_size = sizeof(dht_data);
+        in->insert_at = vd->layout.sof;
+    }
+
+    /* the buffer allocated for copied frames is not needed any more */
+    if(vd->published == NULL) {
+        free(in->buf);
+        vd->published = in;
+    }
+
+    if(vd->held >= 0)
+        requeue_buffer(vd, vd->held);
+    vd->held = vd->buf.index;
+
+    in->buf = frame;
+    in->size = size + in->insert_size;
+    return in->size;
+}
+
+/******************************************************************************
+Description.: Publishes the H.264 frame in vd->tmpbuffer. A keyframe without
+              SPS and PPS gets the ones of an earlier frame inserted, so a
+              consumer can start decoding at any keyframe. The caller must
+              hold "db" of the input, the inserted bytes are changed only then.
+Input Value.: * vd: the device, vd->h264_layout was filled by h264_parse()
+              * in: the input to publish the frame
+Return Value: size of the frame
+******************************************************************************/
+int publish_h264(struct vdIn *vd, input *in)
+{
+    h264_layout *layout = &vd->h264_layout;
+
+    memcpy(in->buf, vd->tmpbuffer, vd->buf.bytesused);
+    in->insert = NULL;
+    in->insert_size = 0;
+    in->insert_at = 0;
+    in->keyframe = layout->keyframe || (vd->buf.flags & V4L2_BUF_FLAG_KEYFRAME);
+
+    if(layout->sps >= 0 && layout->pps >= 0) {
+        h264_keep_params(vd->tmpbuffer, layout, &vd->h264_params);
+    } else if(in->keyframe && vd->h264_params.size > 0) {
+        in->insert = vd->h264_params.data;
+        in->insert_size = vd->h264_params.size;
+        in->insert_at = layout->first;
+    }
+
+    if(in->keyframe)
+        vd->stats.keyframes++;
+    in->size = vd->buf.bytesused + in->insert_size;
+    return in->size;
+}
+
+/******************************************************************************
+Description.: Hands a buffer back to the driver
+Input Value.: * vd...: the device
+              * index: index of the dequeued buffer
+Return Value: 0 if ok, -1 in case of error
+******************************************************************************/
+int requeue_buffer(struct vdIn *vd, int index)
+{
+    struct v4l2_buffer buf;
+
+    memset(&buf, 0, sizeof(struct v4l2_buffer));
+    buf.index = index;
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf.memory = V4L2_MEMORY_MMAP;
+
+    if(xioctl(vd->fd, VIDIOC_QBUF, &buf) < 0) {
+        perror("Unable to requeue buffer");
+        return -1;
+    }
+    vd->stats.queue_depth++;
     return 0;
 }
 
 /******************************************************************************
-Description.:
-Input Value.:
-Return Value:
+Description.: Accounts a dequeued buffer, gaps in the sequence numbers are
+              frames the driver dropped because no buffer was queued
+Input Value.: * vd..: the device
+              * wait: microseconds VIDIOC_DQBUF blocked
+Return Value: -
 ******************************************************************************/
-int memcpy_picture(unsigned char *out, unsigned char *buf, int size)
+static void update_stats(struct vdIn *vd, unsigned long wait)
 {
-    unsigned char *ptdeb, *ptlimit, *ptcur = buf;
-    int sizein, pos = 0;
-
-    if(!is_huffman(buf)) {
-        ptdeb = ptcur = buf;
-        ptlimit = buf + size;
-        while((((ptcur[0] << 8) | ptcur[1]) != 0xffc0) && (ptcur < ptlimit))
-            ptcur++;
-        if(ptcur >= ptlimit)
-            return pos;
-        sizein = ptcur - ptdeb;
-
-        memcpy(out + pos, buf, sizein); pos += sizein;
-        memcpy(out + pos, dht_data, sizeof(dht_data)); pos += sizeof(dht_data);
-        memcpy(out + pos, ptcur, size - sizein); pos += size - sizein;
+    struct timespec now;
+
+    /* buffer timestamps are CLOCK_MONOTONIC with most drivers */
+    if((vd->buf.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC &&
+       (vd->buf.timestamp.tv_sec != 0 || vd->buf.timestamp.tv_usec != 0)) {
+        vd->captured = vd->buf.timestamp.tv_sec * 1000000000LL + vd->buf.timestamp.tv_usec * 1000LL;
     } else {
-        memcpy(out + pos, ptcur, size); pos += size;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        vd->captured = now.tv_sec * 1000000000LL + now.tv_nsec;
     }
-    return pos;
+
+    vd->stats.frames++;
+    vd->stats.queue_depth--;
+    vd->stats.wait_total += wait;
+    if(wait > vd->stats.wait_max)
+        vd->stats.wait_max = wait;
+
+    if(vd->sequence_valid && vd->buf.sequence - vd->sequence > 1) {
+        vd->stats.drops += vd->buf.sequence - vd->sequence - 1;
+        DBG("driver dropped %u frames\n", vd->buf.sequence - vd->sequence - 1);
+    }
+    vd->sequence = vd->buf.sequence;
+    vd->sequence_valid = 1;
+}
+
+/******************************************************************************
+Description.: Dequeues all buffers the driver filled meanwhile and keeps only
+              the newest one in vd->buf, the older ones are requeued right away
+              and counted as dropped. This keeps the latency at about one frame
+              interval if the consumers are slower than the camera.
+Input Value.: the device with a dequeued buffer in vd->buf
+Return Value: 0 if ok, -1 in case of error
+******************************************************************************/
+static int skip_to_latest(struct vdIn *vd)
+{
+    struct pollfd pfd;
+    struct v4l2_buffer newer;
+
+    pfd.fd = vd->fd;
+    pfd.events = POLLIN;
+    while(poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN)) {
+        memset(&newer, 0, sizeof(struct v4l2_buffer));
+        newer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        newer.memory = V4L2_MEMORY_MMAP;
+        if(xioctl(vd->fd, VIDIOC_DQBUF, &newer) < 0) {
+            perror("Unable to dequeue buffer");
+            return -1;
+        }
+
+        if(xioctl(vd->fd, VIDIOC_QBUF, &vd->buf) < 0) {
+            perror("Unable to requeue buffer");
+            return -1;
+        }
+        vd->stats.queue_depth++;
+        vd->stats.drops++;
+
+        vd->buf = newer;
+        update_stats(vd, 0);
+    }
+
+    return 0;
+}
+
+/******************************************************************************
+Description.: Unmaps the capture buffers and frees their table, buffers a
+              failed init_v4l2() did not map are skipped
+Input Value.: the device
+Return Value: -
+******************************************************************************/
+static void unmap_buffers(struct vdIn *vd)
+{
+    int i;
+
+    if(vd->mem == NULL)
+        return;
+
+    for(i = 0; i < vd->nbuffers; i++) {
+        if(vd->mem[i] != NULL)
+            munmap(vd->mem[i], vd->buf.length);
+    }
+    free(vd->mem);
+    vd->mem = NULL;
+}
+
+/******************************************************************************
+Description.: Takes the published buffer away from the consumers before the
+              buffers get unmapped
+Input Value.: the device
+Return Value: -
+******************************************************************************/
+static void release_published(struct vdIn *vd)
+{
+    unsigned char *copy;
+
+    if(vd->published == NULL)
+        return;
+
+    /* keep serving a copy, publish_picture() frees it later */
+    pthread_mutex_lock(&vd->published->db);
+    copy = malloc((vd->published->size > vd->framesizeMax) ? vd->published->size : vd->framesizeMax);
+    if(copy != NULL)
+        input_copy_frame(vd->published, copy);
+    else
+        vd->published->size = 0;
+    vd->published->buf = copy;
+    vd->published->insert = NULL;
+    vd->published->insert_size = 0;
+    vd->published->insert_at = 0;
+    pthread_mutex_unlock(&vd->published->db);
+
+    /* streamoff returns all buffers, including the held one */
+    vd->published = NULL;
+    vd->held = -1;
 }
 
 int uvcGrab(struct vdIn *vd)
 {
 #define HEADERFRAME1 0xaf
     int ret;
+    struct timespec start, end;
+    struct pollfd pfd[2];
 
     if(vd->streamingState == STREAMING_OFF) {
         if(video_enable(vd))
@@ -509,11 +845,44 @@ int uvcGrab(struct vdIn *vd)
     vd->buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
     vd->buf.memory = V4L2_MEMORY_MMAP;
 
+    /* wait for a frame, a wakeup or the stall timeout */
+    pfd[0].fd = vd->fd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = vd->event_fd;
+    pfd[1].events = POLLIN;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ret = poll(pfd, 2, (vd->stall_timeout > 0) ? vd->stall_timeout : -1);
+    if(ret < 0) {
+        if(errno == EINTR)
+            return GRAB_WAKEUP;
+        perror("Unable to poll the device");
+        goto err;
+    }
+    if(ret == 0) {
+        fprintf(stderr, "No frame within %d ms\n", vd->stall_timeout);
+        return GRAB_STALLED;
+    }
+    if((pfd[0].revents & (POLLERR | POLLHUP)) && device_gone(vd))
+        return GRAB_LOST;
+    if(pfd[1].revents & POLLIN) {
+        uint64_t count;
+        if(read(vd->event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+            perror("Unable to read eventfd");
+        return GRAB_WAKEUP;
+    }
+
     ret = xioctl(vd->fd, VIDIOC_DQBUF, &vd->buf);
     if(ret < 0) {
         perror("Unable to dequeue buffer");
+        if(device_gone(vd))
+            return GRAB_LOST;
         goto err;
     }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    update_stats(vd, (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000);
+
+    if(vd->latest && skip_to_latest(vd) < 0)
+        goto err;
 
     switch(vd->formatIn) {
     case V4L2_PIX_FMT_MJPEG:
@@ -521,15 +890,13 @@ int uvcGrab(struct vdIn *vd)
             /* Prevent crash
                                                         * on empty image */
             fprintf(stderr, "Ignoring empty buffer ...\n");
-            return 0;
+            vd->buf.bytesused = 0;
+            goto requeue;
         }
 
-        /* memcpy(vd->tmpbuffer, vd->mem[vd->buf.index], vd->buf.bytesused);
-
-        memcpy (vd->tmpbuffer, vd->mem[vd->buf.index], HEADERFRAME1);
-        memcpy (vd->tmpbuffer + HEADERFRAME1, dht_data, sizeof(dht_data));
-        memcpy (vd->tmpbuffer + HEADERFRAME1 + sizeof(dht_data), vd->mem[vd->buf.index] + HEADERFRAME1, (vd->buf.bytesused - HEADERFRAME1));
-        */
+        /* the buffer stays dequeued until publish_picture() replaces it */
+        if(vd->zerocopy)
+            return 0;
 
         memcpy(vd->tmpbuffer, vd->mem[vd->buf.index], vd->buf.bytesused);
 
@@ -538,23 +905,36 @@ int uvcGrab(struct vdIn *vd)
         break;
     case V4L2_PIX_FMT_RGB565:
     case V4L2_PIX_FMT_YUYV:
+    case V4L2_PIX_FMT_NV12:
+    case V4L2_PIX_FMT_YUV420:
     case V4L2_PIX_FMT_RGB24:
         if(vd->buf.bytesused > vd->framesizeIn)
             memcpy(vd->framebuffer, vd->mem[vd->buf.index], (size_t) vd->framesizeIn);
         else
             memcpy(vd->framebuffer, vd->mem[vd->buf.index], (size_t) vd->buf.bytesused);
         break;
+    case V4L2_PIX_FMT_H264:
+        /* a truncated frame would break the following ones as well */
+        if(vd->buf.bytesused > vd->framesizeIn) {
+            fprintf(stderr, "Ignoring oversized H.264 frame of %d bytes\n", vd->buf.bytesused);
+            vd->buf.bytesused = 0;
+            goto requeue;
+        }
+        memcpy(vd->tmpbuffer, vd->mem[vd->buf.index], vd->buf.bytesused);
+        break;
 
     default:
         goto err;
         break;
     }
 
+requeue:
     ret = xioctl(vd->fd, VIDIOC_QBUF, &vd->buf);
     if(ret < 0) {
         perror("Unable to requeue buffer");
         goto err;
     }
+    vd->stats.queue_depth++;
 
     return 0;
 
@@ -565,8 +945,16 @@ err:
 
 int close_v4l2(struct vdIn *vd)
 {
+    release_published(vd);
     if(vd->streamingState == STREAMING_ON)
         video_disable(vd, STREAMING_OFF);
+    unmap_buffers(vd);
+    if(vd->event_fd >= 0)
+        close(vd->event_fd);
+    vd->event_fd = -1;
+    if(vd->inotify_fd >= 0)
+        close(vd->inotify_fd);
+    vd->inotify_fd = -1;
     if(vd->tmpbuffer)
         free(vd->tmpbuffer);
     vd->tmpbuffer = NULL;
@@ -582,243 +970,204 @@ int close_v4l2(struct vdIn *vd)
     return 0;
 }
 
-/* return >= 0 ok otherwhise -1 */
-static int isv4l2Control(struct vdIn *vd, int control, struct v4l2_queryctrl *queryctrl)
+/******************************************************************************
+Description.: looks up the cached state of a V4L2 control, the controls were
+              queried by enumerateControls() so no ioctl is needed
+Input Value.: * vd.....: the device
+              * control: the control id
+Return Value: the control or NULL if the device does not have it
+******************************************************************************/
+static control *find_control(struct vdIn *vd, int control_id)
 {
-    int err = 0;
+    int i;
 
-    queryctrl->id = control;
-    if((err = xioctl(vd->fd, VIDIOC_QUERYCTRL, queryctrl)) < 0) {
-        //fprintf(stderr, "ioctl querycontrol error %d \n",errno);
-        return -1;
-    }
+    if(vd->in == NULL)
+        return NULL;
 
-    if(queryctrl->flags & V4L2_CTRL_FLAG_DISABLED) {
-        //fprintf(stderr, "control %s disabled \n", (char *) queryctrl->name);
-        return -1;
+    for(i = 0; i < vd->in->parametercount; i++) {
+        if(vd->in->in_parameters[i].group == IN_CMD_V4L2 &&
+           vd->in->in_parameters[i].ctrl.id == control_id &&
+           !(vd->in->in_parameters[i].ctrl.flags & V4L2_CTRL_FLAG_DISABLED))
+            return &vd->in->in_parameters[i];
     }
 
-    if(queryctrl->type & V4L2_CTRL_TYPE_BOOLEAN) {
-        return 1;
-    }
+    return NULL;
+}
 
-    if(queryctrl->type & V4L2_CTRL_TYPE_INTEGER) {
-        return 0;
+/* return 1 if the device has the control, 0 otherwise */
+int v4l2HasControl(struct vdIn *vd, int control_id)
+{
+    return find_control(vd, control_id) != NULL;
+}
+
+/******************************************************************************
+Description.: sets a control on the device without the control worker, under
+              state_mutex like the worker, as the capture thread closes and
+              reopens fd
+Input Value.: * vd..: the device
+              * ctrl: the cached control
+              * value: its new value
+Return Value: 0 if ok, -1 in case of error or while the device is lost
+******************************************************************************/
+static int apply_control_now(struct vdIn *vd, control *ctrl, int value)
+{
+    control_request request;
+    int ret = -1;
+
+    request.id = ctrl->ctrl.id;
+    request.type = ctrl->ctrl.type;
+    request.value = value;
+    request.failed = 0;
+    lock_capture(vd);
+    if(!vd->lost && vd->fd >= 0)
+        ret = apply_controls(vd->fd, &request, 1);
+    unlock_capture(vd);
+    if(ret != 0) {
+        DBG("control id: 0x%08x failed to set value %d\n", ctrl->ctrl.id, value);
+        return -1;
     }
 
-    fprintf(stderr, "contol %s unsupported  \n", (char *) queryctrl->name);
-    return -1;
+    DBG("V4L2 ctrl %d new value: %d\n", ctrl->ctrl.id, value);
+    ctrl->value = value;
+    return 0;
 }
 
-int v4l2GetControl(struct vdIn *vd, int control)
+/******************************************************************************
+Description.: Reads the value of a control. Only controls the device may change
+              by itself are read from the device, all others are answered from
+              the values cached in in_parameters. The device is read under
+              state_mutex, while it is lost the read fails.
+Input Value.: * vd.....: the device
+              * control: the control id
+Return Value: the value or -1 in case of error
+******************************************************************************/
+int v4l2GetControl(struct vdIn *vd, int control_id)
 {
-    struct v4l2_queryctrl queryctrl;
     struct v4l2_control control_s;
-    int err;
+    control *ctrl;
+    int ret = -1;
 
-    if((err = isv4l2Control(vd, control, &queryctrl)) < 0) {
+    if((ctrl = find_control(vd, control_id)) == NULL)
         return -1;
-    }
 
-    control_s.id = control;
-    if((err = xioctl(vd->fd, VIDIOC_G_CTRL, &control_s)) < 0) {
+    if(!(ctrl->ctrl.flags & (V4L2_CTRL_FLAG_VOLATILE | V4L2_CTRL_FLAG_WRITE_ONLY)))
+        return ctrl->value;
+
+    control_s.id = control_id;
+    lock_capture(vd);
+    if(!vd->lost && vd->fd >= 0)
+        ret = xioctl(vd->fd, VIDIOC_G_CTRL, &control_s);
+    unlock_capture(vd);
+    if(ret < 0)
         return -1;
-    }
 
+    ctrl->value = control_s.value;
     return control_s.value;
 }
 
+/******************************************************************************
+Description.: Sets a control. The cached value is updated at once, the device
+              gets the value from the control worker of the input if there is
+              one, so the caller does not wait for the ioctl. Only without a
+              worker the control is set synchronously.
+Input Value.: * vd...........: the device
+              * control_id...: the control id
+              * value........: the new value
+              * plugin_number: the input number
+              * pglobal......: the global context
+Return Value: 0 if ok, -1 in case of error
+******************************************************************************/
 int v4l2SetControl(struct vdIn *vd, int control_id, int value, int plugin_number, globals *pglobal)
 {
-    struct v4l2_control control_s;
-    int min, max;
-    int ret = 0;
-    int err;
-    int i;
-    int got = -1;
+    control *ctrl;
+
     DBG("Looking for the %d V4L2 control\n", control_id);
-    for (i = 0; i<pglobal->in[plugin_number].parametercount; i++) {
-        if (pglobal->in[plugin_number].in_parameters[i].ctrl.id == control_id) {
-            got = 0;
-            break;
-        }
+    if((ctrl = find_control(vd, control_id)) == NULL) {
+        DBG("Invalid V4L2_set_control request for the id: %d. Control cannot be found in the list\n", control_id);
+        return -1;
     }
 
-    if (got == 0) { // we have found the control with the specified id
-        DBG("V4L2 ctrl %d found\n", control_id);
-        if (pglobal->in[plugin_number].in_parameters[i].class_id == V4L2_CTRL_CLASS_USER) {
-            DBG("Control type: USER\n");
-            min = pglobal->in[plugin_number].in_parameters[i].ctrl.minimum;
-            max = pglobal->in[plugin_number].in_parameters[i].ctrl.maximum;
-
-            if((value >= min) && (value <= max)) {
-                control_s.id = control_id;
-                control_s.value = value;
-                if((err = xioctl(vd->fd, VIDIOC_S_CTRL, &control_s)) < 0) {
-                    DBG("VIDIOC_S_CTRL failed\n");
-                    return -1;
-                } else {
-                    DBG("V4L2 ctrl %d new value: %d\n", control_id, value);
-                    pglobal->in[plugin_number].in_parameters[i].value = value;
-                }
-            } else {
-                DBG("Value (%d) out of range (%d .. %d)\n", value, min, max);
-            }
-            return 0;
-        } else { // not user class controls
-            DBG("Control type: EXTENDED\n");
-            struct v4l2_ext_controls ext_ctrls = {0};
-            struct v4l2_ext_control ext_ctrl = {0};
-            ext_ctrl.id = pglobal->in[plugin_number].in_parameters[i].ctrl.id;
-            //ext_ctrl.size = pglobal->in[plugin_number].in_parameters[i].ctrl.ma;
-
-            switch(pglobal->in[plugin_number].in_parameters[i].ctrl.type) {
 #ifdef V4L2_CTRL_TYPE_STRING
-                case V4L2_CTRL_TYPE_STRING:
-                    //string gets set on VIDIOC_G_EXT_CTRLS
-                    //add the maximum size to value
-                    ext_ctrl.size = value;
-                    DBG("STRING extended controls are currently broken\n");
-                    //ext_ctrl.string = control->string; // FIXME
-                    break;
+    if(ctrl->ctrl.type == V4L2_CTRL_TYPE_STRING) {
+        DBG("STRING extended controls are currently broken\n");
+        return -1;
+    }
 #endif
-                case V4L2_CTRL_TYPE_INTEGER64:
-                    ext_ctrl.value64 = value;
-                    break;
-                default:
-                    ext_ctrl.value = value;
-                    break;
-            }
 
-            ext_ctrls.ctrl_class = V4L2_CTRL_CLASS_USER;
-            ext_ctrls.count = 1;
-            ext_ctrls.controls = &ext_ctrl;
-            ret = xioctl(vd->fd, VIDIOC_S_EXT_CTRLS, &ext_ctrls);
-            if(ret) {
-                DBG("control id: 0x%08x failed to set value (error %i)\n", ext_ctrl.id, ret);
-                return -1;
-            } else {
-                DBG("control id: %d new value: %d\n", ext_ctrl.id, ext_ctrl.value);
-            }
-            return 0;
-        }
-    } else {
-        DBG("Invalid V4L2_set_control request for the id: %d. Control cannot be found in the list\n", control_id);
+    if(ctrl->ctrl.type != V4L2_CTRL_TYPE_BUTTON &&
+       (value < ctrl->ctrl.minimum || value > ctrl->ctrl.maximum)) {
+        DBG("Value (%d) out of range (%d .. %d)\n", value, ctrl->ctrl.minimum, ctrl->ctrl.maximum);
         return -1;
     }
-}
-
-int v4l2UpControl(struct vdIn *vd, int control) {
-  struct v4l2_control control_s;
-  struct v4l2_queryctrl queryctrl;
-  int min, max, current, step, val_def;
-  int err;
 
-  if (isv4l2Control(vd, control, &queryctrl) < 0)
-    return -1;
-
-  min = queryctrl.minimum;
-  max = queryctrl.maximum;
-  step = queryctrl.step;
-  val_def = queryctrl.default_value;
-
-  if ( (current = v4l2GetControl(vd, control)) == -1 )
-    return -1;
-
-  current += step;
+    /* nothing changes, unless the control is an action or the device changes it itself */
+    if(value == ctrl->value && ctrl->ctrl.type != V4L2_CTRL_TYPE_BUTTON &&
+       !(ctrl->ctrl.flags & (V4L2_CTRL_FLAG_VOLATILE | V4L2_CTRL_FLAG_WRITE_ONLY)))
+        return 0;
 
-  //fprintf(stderr, "max %d, min %d, step %d, default %d ,current %d \n",max,min,step,val_def,current);
-  if (current <= max) {
-    control_s.id = control;
-    control_s.value = current;
-    if ((err = ioctl(vd->fd, VIDIOC_S_CTRL, &control_s)) < 0) {
-      return -1;
-    }
-    //fprintf(stderr, "Control name:%s set to value:%d\n", queryctrl.name, control_s.value);
-  } else {
-    //fprintf(stderr, "Control name:%s already has max value:%d \n", queryctrl.name, max);
-    return -1;
-  }
+    if(vd->controls != NULL)
+        return control_submit(vd->controls, ctrl, value);
 
-  return 0;
+    return apply_control_now(vd, ctrl, value);
 }
 
-int v4l2DownControl(struct vdIn *vd, int control) {
-  struct v4l2_control control_s;
-  struct v4l2_queryctrl queryctrl;
-  int min, max, current, step, val_def;
-  int err;
-
-  if (isv4l2Control(vd, control, &queryctrl) < 0)
-    return -1;
+/******************************************************************************
+Description.: changes an integer control by one step
+Input Value.: * vd.....: the device
+              * control: the control id
+              * steps..: 1 or -1
+Return Value: 0 if ok, -1 if the limit is reached or in case of error
+******************************************************************************/
+static int v4l2StepControl(struct vdIn *vd, int control_id, int steps)
+{
+    control *ctrl;
+    int current;
 
-  min = queryctrl.minimum;
-  max = queryctrl.maximum;
-  step = queryctrl.step;
-  val_def = queryctrl.default_value;
-  if ( (current = v4l2GetControl(vd, control)) == -1 )
-    return -1;
+    if((ctrl = find_control(vd, control_id)) == NULL || ctrl->ctrl.type == V4L2_CTRL_TYPE_BUTTON)
+        return -1;
 
-  current -= step;
-  //fprintf(stderr, "max %d, min %d, step %d, default %d ,current %d \n",max,min,step,val_def,current);
+    if((current = v4l2GetControl(vd, control_id)) == -1)
+        return -1;
 
-  if (current >= min) {
-    control_s.id = control;
-    control_s.value = current;
-    if ((err = ioctl(vd->fd, VIDIOC_S_CTRL, &control_s)) < 0) {
-      return -1;
-    }
-    //fprintf(stderr, "Control name:%s set to value:%d\n", queryctrl.name, control_s.value);
-  }
-  else {
-    return -1;
-    //fprintf(stderr, "Control name:%s already has min value:%d \n", queryctrl.name, min);
-  }
+    current += steps * ctrl->ctrl.step;
+    if(current > ctrl->ctrl.maximum || current < ctrl->ctrl.minimum)
+        return -1;
 
-  return 0;
+    return v4l2SetControl(vd, control_id, current, 0, NULL);
 }
 
-int v4l2ToggleControl(struct vdIn *vd, int control) {
-  struct v4l2_control control_s;
-  struct v4l2_queryctrl queryctrl;
-  int current;
-  int err;
+int v4l2UpControl(struct vdIn *vd, int control)
+{
+    return v4l2StepControl(vd, control, 1);
+}
 
-  if (isv4l2Control(vd, control, &queryctrl) != 1)
-    return -1;
+int v4l2DownControl(struct vdIn *vd, int control)
+{
+    return v4l2StepControl(vd, control, -1);
+}
 
-  if ( (current = v4l2GetControl(vd, control)) == -1 )
-    return -1;
+int v4l2ToggleControl(struct vdIn *vd, int control_id)
+{
+    control *ctrl;
+    int current;
 
-  control_s.id = control;
-  control_s.value = !current;
+    if((ctrl = find_control(vd, control_id)) == NULL || ctrl->ctrl.type != V4L2_CTRL_TYPE_BOOLEAN)
+        return -1;
 
-  if ((err = ioctl(vd->fd, VIDIOC_S_CTRL, &control_s)) < 0) {
-    return -1;
-  }
+    if((current = v4l2GetControl(vd, control_id)) == -1)
+        return -1;
 
-  return 0;
+    return v4l2SetControl(vd, control_id, !current, 0, NULL);
 }
 
-int v4l2ResetControl(struct vdIn *vd, int control)
+int v4l2ResetControl(struct vdIn *vd, int control_id)
 {
-    struct v4l2_control control_s;
-    struct v4l2_queryctrl queryctrl;
-    int val_def;
-    int err;
+    control *ctrl;
 
-    if(isv4l2Control(vd, control, &queryctrl) < 0)
+    if((ctrl = find_control(vd, control_id)) == NULL)
         return -1;
 
-    val_def = queryctrl.default_value;
-    control_s.id = control;
-    control_s.value = val_def;
-
-    if((err = xioctl(vd->fd, VIDIOC_S_CTRL, &control_s)) < 0) {
-        return -1;
-    }
-
-    return 0;
+    return v4l2SetControl(vd, control_id, ctrl->ctrl.default_value, 0, NULL);
 }
 
 void control_readed(struct vdIn *vd, struct v4l2_queryctrl *ctrl, globals *pglobal, int id)
@@ -928,46 +1277,476 @@ void control_readed(struct vdIn *vd, struct v4l2_queryctrl *ctrl, globals *pglob
     pglobal->in[id].parametercount++;
 }
 
-/*  It should set the capture resolution
-    Cheated from the openCV cap_libv4l.cpp the method is the following:
-    Turn off the stream (video_disable)
-    Unmap buffers
-    Close the filedescriptor
-    Initialize the camera again with the new resolution
-*/
-int setResolution(struct vdIn *vd, int width, int height)
+/******************************************************************************
+Description.: Unmaps the buffers, closes the device and opens it again with the
+              given resolution. The stream must be off and the caller must hold
+              state_mutex.
+Input Value.: * vd............: the device
+              * width, height.: the new resolution
+Return Value: 0 if ok, -1 in case of error, then the stream stays off
+******************************************************************************/
+static int reopen_stream(struct vdIn *vd, int width, int height)
 {
-    int ret;
+    DBG("Unmap buffers\n");
+    release_published(vd);
+    unmap_buffers(vd);
+
+    /* a failed open leaves nothing behind that a later restart or lose_device() could free again */
+    if(vd->fd >= 0 && CLOSE_VIDEO(vd->fd) == 0) {
+        DBG("Device closed successfully\n");
+    }
+    vd->fd = -1;
+
+    vd->width = width;
+    vd->height = height;
+    if(init_v4l2(vd) < 0) {
+        fprintf(stderr, " Init v4L2 failed !! exit fatal \n");
+        vd->streamingState = STREAMING_OFF;
+        return -1;
+    }
+
+    /* the driver may have chosen another size than asked for */
+    if(alloc_framebuffers(vd) < 0) {
+        fprintf(stderr, "could not allocate the frame buffers\n");
+        vd->streamingState = STREAMING_OFF;
+        return -1;
+    }
+
+    DBG("reinit done\n");
+    return video_enable(vd);
+}
+
+/******************************************************************************
+Description.: Changes the capture resolution at a frame boundary:
+              The capture thread is woken up and paused before it grabs the
+              next frame, the stream is turned off, the buffers get unmapped,
+              the device is opened again with the new resolution and the frame
+              buffers are allocated for it. The frame buffer of the input only
+              grows, so frames of the old size still being compressed fit.
+              Consumers notice the change by the size published with the
+              frames, see input_set_format().
+              The switch gives up if the capture thread does not pause within
+              RESOLUTION_TIMEOUT milliseconds. If the device can not be set
+              up for the new resolution, it is reopened with the old one.
+Input Value.: * vd............: the device
+              * in............: the input publishing the frames of the device
+              * width, height.: the new resolution
+Return Value: 0 if ok, -1 in case of error
+******************************************************************************/
+int setResolution(struct vdIn *vd, input *in, int width, int height)
+{
+    int ret, old_width = vd->width, old_height = vd->height;
+    struct timespec start, now, deadline;
+    unsigned char *buf;
+
     DBG("setResolution(%d, %d)\n", width, height);
+    if(width == vd->width && height == vd->height)
+        return 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += RESOLUTION_TIMEOUT / 1000;
+    deadline.tv_nsec += (RESOLUTION_TIMEOUT % 1000) * 1000000;
+    if(deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    /* the capture thread must leave uvcGrab() before the buffers go away */
+    __atomic_add_fetch(&vd->pausing, 1, __ATOMIC_SEQ_CST);
+    wake_capture(vd);
+    ret = pthread_mutex_timedlock(&vd->state_mutex, &deadline);
+    __atomic_sub_fetch(&vd->pausing, 1, __ATOMIC_SEQ_CST);
+    if(ret != 0) {
+        fprintf(stderr, "the capture did not pause for the resolution change\n");
+        return -1;
+    }
 
-    vd->streamingState = STREAMING_PAUSED;
     if(video_disable(vd, STREAMING_PAUSED) == 0) {  // do streamoff
-        DBG("Unmap buffers\n");
-        int i;
-        for(i = 0; i < NB_BUFFER; i++)
-            munmap(vd->mem[i], vd->buf.length);
+        ret = reopen_stream(vd, width, height);
+
+        /* make room in the frame buffer of the input, it does not shrink */
+        if(ret == 0 && vd->framesizeIn > vd->framesizeMax) {
+            pthread_mutex_lock(&in->db);
+            if((buf = realloc(in->buf, vd->framesizeIn)) != NULL) {
+                in->buf = buf;
+                vd->framesizeMax = vd->framesizeIn;
+            }
+            pthread_mutex_unlock(&in->db);
 
-        if(CLOSE_VIDEO(vd->fd) == 0) {
-            DBG("Device closed successfully\n");
+            if(buf == NULL) {
+                fprintf(stderr, "could not allocate memory for %dx%d\n", vd->width, vd->height);
+                ret = -1;
+            }
         }
 
-        vd->width = width;
-        vd->height = height;
-        if(init_v4l2(vd) < 0) {
-            fprintf(stderr, " Init v4L2 failed !! exit fatal \n");
-            return -1;
-        } else {
-            DBG("reinit done\n");
-            video_enable(vd);
-            return 0;
+        /* go back to the old resolution, the frame buffer still fits it */
+        if(ret != 0) {
+            video_disable(vd, STREAMING_PAUSED);
+            if(reopen_stream(vd, old_width, old_height) < 0)
+                fprintf(stderr, "could not go back to %dx%d either\n", old_width, old_height);
+            ret = -1;
         }
     } else {
         DBG("Unable to disable streaming\n");
-        return -1;
+        ret = -1;
     }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    vd->stats.switch_time = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+    DBG("resolution change took %lu ms\n", vd->stats.switch_time);
+
+    pthread_cond_broadcast(&vd->state_cond);
+    pthread_mutex_unlock(&vd->state_mutex);
     return ret;
 }
 
+/******************************************************************************
+Description.: Sets the rate the frame rate governor lets through, may be
+              called from any thread, the capture thread picks it up with the
+              next frame
+Input Value.: * vd..: the device
+              * mfps: frames per 1000 seconds, 0 to publish all frames
+Return Value: 0 if ok, -1 if the format does not allow dropping frames
+******************************************************************************/
+int set_frame_limit(struct vdIn *vd, unsigned int mfps)
+{
+    /* H.264 frames refer to the previous ones, none may be dropped */
+    if(vd->formatIn == V4L2_PIX_FMT_H264 && mfps > 0) {
+        IPRINT("Frame rate limit..: not possible with H.264\n");
+        return -1;
+    }
+    if(mfps > MAX_FRAME_LIMIT)
+        mfps = MAX_FRAME_LIMIT;
+    __atomic_store_n(&vd->frame_limit, mfps, __ATOMIC_RELAXED);
+    if(mfps > 0)
+        IPRINT("Frame rate limit..: %u.%03u fps\n", mfps / 1000, mfps % 1000);
+    else
+        IPRINT("Frame rate limit..: none\n");
+    return 0;
+}
+
+/******************************************************************************
+Description.: Frame rate governor. Frames are due every 1/limit seconds on a
+              fixed grid in CLOCK_MONOTONIC nanoseconds, so the rate does not
+              drift and fractional rates like 7.5 fps or one frame per five
+              seconds work. A frame is taken if it is at most half a camera
+              frame interval early, this picks the frame nearest to the due
+              time instead of beating against the camera rate. A frame more
+              than a quarter interval late, e.g. after a stall or with a camera
+              slower than the limit, restarts the grid at its timestamp.
+Input Value.: the device with a dequeued frame
+Return Value: 1 if the frame should be published, 0 if it should be dropped
+******************************************************************************/
+int pace_frame(struct vdIn *vd)
+{
+    unsigned int limit = __atomic_load_n(&vd->frame_limit, __ATOMIC_RELAXED);
+    long long now = vd->captured, period;
+
+    if(limit == 0)
+        return 1;
+
+    if(vd->pace_last > 0 && now > vd->pace_last) {
+        if(vd->pace_interval == 0)
+            vd->pace_interval = now - vd->pace_last;
+        else
+            vd->pace_interval += (now - vd->pace_last - vd->pace_interval) / 8;
+    }
+    vd->pace_last = now;
+
+    period = 1000000000000LL / limit;
+    if(limit != vd->pace_limit) {
+        vd->pace_limit = limit;
+        vd->pace_due = now;
+    }
+
+    if(now < vd->pace_due - vd->pace_interval / 2)
+        return 0;
+
+    /*
+     * a late frame moves the grid, catching up would leave uneven gaps. The
+     * next frame is then at least 3/4 of an interval early and not taken.
+     */
+    if(now - vd->pace_due > vd->pace_interval / 4)
+        vd->pace_due = now;
+    vd->pace_due += period;
+    return 1;
+}
+
+/******************************************************************************
+Description.: Restarts a stalled or failed stream with the current resolution,
+              called by the capture thread while it holds state_mutex
+Input Value.: the device
+Return Value: 0 if ok, -1 in case of error
+******************************************************************************/
+int restart_stream(struct vdIn *vd)
+{
+    DBG("restarting the stream\n");
+    /* a failed device may refuse even this, reopening resets it anyway */
+    video_disable(vd, STREAMING_PAUSED);
+    return reopen_stream(vd, vd->width, vd->height);
+}
+
+/******************************************************************************
+Description.: Lets the capture thread wait until resolution changes are done
+              and the stream runs, must be called with state_mutex held
+Input Value.: the device
+Return Value: -
+******************************************************************************/
+void wait_capture(struct vdIn *vd)
+{
+    while(vd->streamingState == STREAMING_PAUSED || __atomic_load_n(&vd->pausing, __ATOMIC_SEQ_CST) > 0)
+        pthread_cond_wait(&vd->state_cond, &vd->state_mutex);
+}
+
+/******************************************************************************
+Description.: Demand-driven capture, called by the capture thread with
+              state_mutex held before it grabs a frame. After the last
+              consumer of the input left and "idle_timeout" milliseconds
+              passed, the capture idles: it turns the stream off, or with an
+              "idle_limit" keeps it running at that rate. While the stream is
+              off the thread sleeps until input_attach() signals "demand",
+              then turns the stream on again. state_mutex is released while
+              sleeping, so resolution changes are not blocked.
+Input Value.: * vd: the device
+              * in: the input publishing the frames of the device
+Return Value: 1 if a frame should be grabbed, 0 if the caller should check
+              its state and call again
+******************************************************************************/
+int wait_demand(struct vdIn *vd, input *in)
+{
+    struct timespec now, deadline;
+    long long ms;
+    int consumers, state;
+
+    consumers = __atomic_load_n(&in->consumers, __ATOMIC_SEQ_CST);
+    if(consumers > 0) {
+        vd->idle_since = 0;
+        if(!vd->idle)
+            return 1;
+
+        IPRINT("resuming the capture for %d consumer(s)\n", consumers);
+        vd->idle = 0;
+        if(vd->idle_limit > 0)
+            set_frame_limit(vd, vd->busy_limit);
+        if(vd->streamingState != STREAMING_ON) {
+            if(queue_buffers(vd) < 0 || video_enable(vd) < 0)
+                return (restart_stream(vd) == 0);
+        }
+        return 1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ms = now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+    if(!vd->idle) {
+        if(vd->idle_since == 0)
+            vd->idle_since = ms;
+        if(ms - vd->idle_since < vd->idle_timeout)
+            return 1;
+
+        vd->idle = 1;
+        if(vd->idle_limit > 0) {
+            IPRINT("no consumers, slowing down the capture\n");
+            vd->busy_limit = vd->frame_limit;
+            set_frame_limit(vd, vd->idle_limit);
+        } else {
+            IPRINT("no consumers, stopping the capture\n");
+        }
+    }
+
+    if(vd->idle_limit > 0)
+        return 1;
+
+    /* a resolution change or a reconnect may have turned it on again */
+    if(vd->streamingState == STREAMING_ON) {
+        release_published(vd);
+        video_disable(vd, STREAMING_OFF);
+    }
+
+    /* db may not be locked while state_mutex is taken, both are released */
+    pthread_mutex_unlock(&vd->state_mutex);
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += 1;
+    pthread_mutex_lock(&in->db);
+    if(__atomic_load_n(&in->consumers, __ATOMIC_SEQ_CST) == 0)
+        pthread_cond_timedwait(&in->demand, &in->db, &deadline);
+    pthread_mutex_unlock(&in->db);
+    pthread_setcancelstate(state, NULL);
+    pthread_mutex_lock(&vd->state_mutex);
+    return 0;
+}
+
+/******************************************************************************
+Description.: Interrupts a capture thread that waits in uvcGrab() for a frame,
+              uvcGrab() then returns GRAB_WAKEUP
+Input Value.: the device
+Return Value: -
+******************************************************************************/
+void wake_capture(struct vdIn *vd)
+{
+    uint64_t one = 1;
+
+    if(write(vd->event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        perror("Unable to write eventfd");
+}
+
+/******************************************************************************
+Description.: Takes state_mutex from another thread without waiting for the
+              next frame: the capture thread is woken up and stays in
+              wait_capture() until unlock_capture() is called
+Input Value.: the device
+Return Value: -
+******************************************************************************/
+void lock_capture(struct vdIn *vd)
+{
+    __atomic_add_fetch(&vd->pausing, 1, __ATOMIC_SEQ_CST);
+    wake_capture(vd);
+    pthread_mutex_lock(&vd->state_mutex);
+    __atomic_sub_fetch(&vd->pausing, 1, __ATOMIC_SEQ_CST);
+}
+
+/******************************************************************************
+Description.: Releases state_mutex taken by lock_capture(), the capture thread
+              continues
+Input Value.: the device
+Return Value: -
+******************************************************************************/
+void unlock_capture(struct vdIn *vd)
+{
+    pthread_cond_broadcast(&vd->state_cond);
+    pthread_mutex_unlock(&vd->state_mutex);
+}
+
+/******************************************************************************
+Description.: Tells if the device was unplugged, a reset USB camera gets
+              removed and shows up again as a new device
+Input Value.: the device
+Return Value: 1 if the device is gone, 0 otherwise
+******************************************************************************/
+static int device_gone(struct vdIn *vd)
+{
+    struct v4l2_capability cap;
+
+    if(xioctl(vd->fd, VIDIOC_QUERYCAP, &cap) < 0 &&
+       (errno == ENODEV || errno == ENXIO || errno == EIO))
+        return 1;
+
+    return access(vd->videodevice, F_OK) != 0;
+}
+
+/******************************************************************************
+Description.: Closes a device that got lost and starts to watch for its node to
+              come back. The published frame stays available as copy.
+Input Value.: the device
+Return Value: -
+******************************************************************************/
+void lose_device(struct vdIn *vd)
+{
+    char *path;
+
+    release_published(vd);
+    unmap_buffers(vd);
+    if(vd->fd >= 0)
+        CLOSE_VIDEO(vd->fd);
+    vd->fd = -1;
+    vd->streamingState = STREAMING_OFF;
+
+    if(vd->lost)
+        return;
+    vd->lost = 1;
+    clock_gettime(CLOCK_MONOTONIC, &vd->lost_since);
+
+    /* without inotify wait_device() still retries after its timeout */
+    if((vd->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) {
+        perror("Unable to watch for the device");
+        return;
+    }
+    if((path = strdup(vd->videodevice)) != NULL) {
+        if(inotify_add_watch(vd->inotify_fd, dirname(path), IN_CREATE | IN_ATTRIB | IN_MOVED_TO) < 0)
+            perror("Unable to watch for the device");
+        free(path);
+    }
+}
+
+/******************************************************************************
+Description.: Tries to open a lost device again with the previous format and
+              restores the controls that differ from their defaults
+Input Value.: * vd......: the device
+              * pglobal.: the globals holding the control values
+              * id......: the input number
+Return Value: 0 if the device is back, -1 otherwise
+******************************************************************************/
+int reconnect_device(struct vdIn *vd, globals *pglobal, int id)
+{
+    control_request restore[MAX_PENDING_CONTROLS];
+    struct timespec now;
+    control *ctrl;
+    int i, count;
+
+    if(init_v4l2(vd) < 0 || video_enable(vd) < 0) {
+        lose_device(vd);
+        return -1;
+    }
+
+    /* the device starts with its defaults, restore the other values at once */
+    count = 0;
+    for(i = 0; __atomic_load_n(&vd->enumerated, __ATOMIC_ACQUIRE) && i < pglobal->in[id].parametercount && count < MAX_PENDING_CONTROLS; i++) {
+        ctrl = &pglobal->in[id].in_parameters[i];
+        if(ctrl->group != IN_CMD_V4L2 || ctrl->value == ctrl->ctrl.default_value ||
+           (ctrl->ctrl.flags & (V4L2_CTRL_FLAG_DISABLED | V4L2_CTRL_FLAG_READ_ONLY)))
+            continue;
+        restore[count].id = ctrl->ctrl.id;
+        restore[count].type = ctrl->ctrl.type;
+        restore[count].value = ctrl->value;
+        count++;
+    }
+    if(count > 0 && apply_controls(vd->fd, restore, count) > 0)
+        IPRINT("not all controls of %s could be restored\n", vd->videodevice);
+
+    if(vd->inotify_fd >= 0)
+        close(vd->inotify_fd);
+    vd->inotify_fd = -1;
+    vd->lost = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    vd->stats.reconnects++;
+    vd->stats.recovery_time = (now.tv_sec - vd->lost_since.tv_sec) * 1000 +
+                              (now.tv_nsec - vd->lost_since.tv_nsec) / 1000000;
+    return 0;
+}
+
+/******************************************************************************
+Description.: Waits until something changes in the directory of a lost device,
+              wake_capture() or the timeout
+Input Value.: * vd.....: the device
+              * timeout: milliseconds
+Return Value: -
+******************************************************************************/
+void wait_device(struct vdIn *vd, int timeout)
+{
+    char events[1024];
+    uint64_t count;
+    struct pollfd pfd[2];
+
+    pfd[0].fd = vd->inotify_fd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = vd->event_fd;
+    pfd[1].events = POLLIN;
+    if(poll(pfd, 2, timeout) <= 0)
+        return;
+
+    if(pfd[0].revents & POLLIN) {
+        while(read(vd->inotify_fd, events, sizeof(events)) > 0);
+        /* give udev the chance to set the permissions */
+        usleep(100 * 1000);
+    }
+    if(pfd[1].revents & POLLIN) {
+        if(read(vd->event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+            perror("Unable to read eventfd");
+    }
+}
+
 /*
  *
  * Enumarates all V4L2 controls using various methods.
@@ -1055,4 +1834,24 @@ void enumerateControls(struct vdIn *vd, globals *pglobal, int id)
         DBG("Modifying the setting of the JPEG compression is not supported\n");
         pglobal->in[id].jpegcomp.quality = -1;
     }
+
+    /* the frame rate governor, see pace_frame() */
+    control *params = realloc(pglobal->in[id].in_parameters, (pglobal->in[id].parametercount + 1) * sizeof(control));
+    if(params == NULL) {
+        DBG("Calloc/realloc failed\n");
+        return;
+    }
+    pglobal->in[id].in_parameters = params;
+    control *rate = &pglobal->in[id].in_parameters[pglobal->in[id].parametercount];
+    memset(rate, 0, sizeof(control));
+    rate->ctrl.id = 2;
+    sprintf((char*)&rate->ctrl.name, "Frame rate limit (1/1000 fps)");
+    rate->ctrl.minimum = 0;
+    rate->ctrl.maximum = MAX_FRAME_LIMIT;
+    rate->ctrl.step = 1;
+    rate->ctrl.default_value = 0;
+    rate->ctrl.type = V4L2_CTRL_TYPE_INTEGER;
+    rate->group = IN_CMD_FRAMERATE;
+    rate->value = vd->frame_limit;
+    pglobal->in[id].parametercount++;
 }
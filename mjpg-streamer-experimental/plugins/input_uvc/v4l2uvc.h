@@ -35,12 +35,19 @@
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/select.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
 
 #include <linux/types.h>          /* for videodev2.h */
 #include <linux/videodev2.h>
 
 #include "../../mjpg_streamer.h"
+#include "mjpeg.h"
+#include "h264.h"
 #define NB_BUFFER 4
+#define MAX_BUFFERS 32
 
 
 #define IOCTL_RETRY 4
@@ -72,6 +79,19 @@ enum _streaming_state {
     STREAMING_PAUSED = 2,
 };
 
+/* results of uvcGrab() besides -1 for errors */
+enum _grab_result {
+    GRAB_FRAME = 0,             /* vd->buf holds a new frame */
+    GRAB_WAKEUP = 1,            /* woken up by wake_capture() */
+    GRAB_STALLED = 2,           /* no frame within the stall timeout */
+    GRAB_LOST = 3,              /* the device is gone, see lose_device() */
+};
+
+#define DEFAULT_STALL_TIMEOUT 5000
+#define RECONNECT_INTERVAL 1000  /* ms between attempts to open a lost device */
+#define RESOLUTION_TIMEOUT 2000  /* ms a resolution change waits for the capture to pause */
+#define MAX_FRAME_LIMIT 1000000  /* 1000 fps, in 1/1000 fps */
+
 struct vdIn {
     int fd;
     char *videodevice;
@@ -81,7 +101,9 @@ struct vdIn {
     struct v4l2_format fmt;
     struct v4l2_buffer buf;
     struct v4l2_requestbuffers rb;
-    void *mem[NB_BUFFER];
+    void **mem;                 /* the mapped buffers */
+    int buffers;                /* buffers to request, NB_BUFFER if 0 */
+    int nbuffers;               /* buffers the driver provided */
     unsigned char *tmpbuffer;
     unsigned char *framebuffer;
     streaming_state streamingState;
@@ -92,6 +114,7 @@ struct vdIn {
     int formatIn;
     int formatOut;
     int framesizeIn;
+    int framesizeMax;           /* largest framesizeIn so far, the size of the frame buffer of the input */
     int signalquit;
     int toggleAvi;
     int getPict;
@@ -109,8 +132,49 @@ struct vdIn {
     int recordstart;
     int recordtime;
     v4l2_std_id vstd;
-    unsigned long frame_period_time; // in ms
-    unsigned char soft_framedrop;
+    /* frame rate governor, rates in 1/1000 frames per second */
+    unsigned int fps_requested;     /* 0 if not limited */
+    unsigned int frame_limit;       /* rate the governor lets through, 0 for all frames */
+    unsigned int pace_limit;        /* frame_limit pace_due was computed for */
+    long long pace_due;             /* nanoseconds, the next frame to publish is due */
+    long long pace_last;            /* timestamp of the previous frame */
+    long long pace_interval;        /* average time between frames of the camera */
+    /* demand-driven capture, see wait_demand() */
+    int idle_timeout;               /* ms without consumers until the capture idles, 0 never */
+    unsigned int idle_limit;        /* frame rate while idle, 0 turns the stream off */
+    unsigned int busy_limit;        /* frame_limit before the capture went idle */
+    int idle;
+    long long idle_since;           /* ms the last consumer left, 0 while there are consumers */
+    /* zero-copy: the dequeued buffer itself is published as frame */
+    int zerocopy;
+    int held;                   /* index of the published buffer, -1 if none */
+    input *published;           /* input that publishes the buffer */
+    /* control values are cached in the in_parameters of "in" */
+    input *in;
+    int enumerated;                     /* the controls are in in_parameters, see input_enumerate() */
+    struct _control_worker *controls;   /* applies control values, NULL sets them at once */
+    struct _motion *motion;             /* pan/tilt motors, NULL if the device has none */
+    /* skip queued frames and grab only the newest one */
+    int latest;
+    /* capture statistics */
+    input_stats stats;
+    mjpeg_layout layout;        /* of the current MJPEG frame */
+    mjpeg_cache mjpeg_cache;    /* header layout learned from the previous frames */
+    h264_layout h264_layout;    /* of the current H.264 frame */
+    h264_params h264_params;    /* SPS and PPS of the H.264 stream */
+    long long captured;         /* CLOCK_MONOTONIC nanoseconds the frame in buf was captured */
+    unsigned int sequence;      /* sequence number of the last dequeued buffer */
+    int sequence_valid;
+    /* the capture thread holds state_mutex while grabbing, others pause it */
+    int event_fd;               /* eventfd that interrupts uvcGrab() */
+    int stall_timeout;          /* milliseconds without frame until restart, 0 waits forever */
+    int pausing;                /* threads that wait to pause the capture */
+    pthread_mutex_t state_mutex;
+    pthread_cond_t state_cond;  /* signalled when the stream is resumed */
+    /* hot-unplug recovery */
+    int lost;                   /* the device is closed until it comes back */
+    int inotify_fd;             /* watches the directory of the device node */
+    struct timespec lost_since;
 };
 
 /* context of each camera thread */
@@ -120,6 +184,9 @@ typedef struct {
     pthread_t threadID;
     pthread_mutex_t controls_mutex;
     struct vdIn *videoIn;
+    struct _encoder_pool *encoders;     /* NULL if frames are compressed by the camera thread */
+    struct _jpeg_encoder *jpeg;         /* compressor of the camera thread */
+    int dynctrls;                       /* map the UVC extension controls */
 } context;
 
 context cams[MAX_INPUT_PLUGINS];
@@ -127,12 +194,29 @@ context cams[MAX_INPUT_PLUGINS];
 int init_videoIn(struct vdIn *vd, char *device, int width, int height, int fps, int format, int grabmethod, globals *pglobal, int id, v4l2_std_id vstd);
 void enumerateControls(struct vdIn *vd, globals *pglobal, int id);
 void control_readed(struct vdIn *vd, struct v4l2_queryctrl *ctrl, globals *pglobal, int id);
-int setResolution(struct vdIn *vd, int width, int height);
-
-int memcpy_picture(unsigned char *out, unsigned char *buf, int size);
+int setResolution(struct vdIn *vd, input *in, int width, int height);
+int set_frame_limit(struct vdIn *vd, unsigned int mfps);
+int pace_frame(struct vdIn *vd);
+int restart_stream(struct vdIn *vd);
+void wait_capture(struct vdIn *vd);
+int wait_demand(struct vdIn *vd, input *in);
+void wake_capture(struct vdIn *vd);
+void lock_capture(struct vdIn *vd);
+void unlock_capture(struct vdIn *vd);
+void lose_device(struct vdIn *vd);
+int reconnect_device(struct vdIn *vd, globals *pglobal, int id);
+void wait_device(struct vdIn *vd, int timeout);
+
+int memcpy_picture(unsigned char *out, unsigned char *buf, int size, const mjpeg_layout *layout);
+int publish_picture(struct vdIn *vd, input *in);
+int publish_h264(struct vdIn *vd, input *in);
+void account_publish(input_stats *stats, long long captured);
+unsigned long long thread_cpu_time(void);
+int requeue_buffer(struct vdIn *vd, int index);
 int uvcGrab(struct vdIn *vd);
 int close_v4l2(struct vdIn *vd);
 
+int v4l2HasControl(struct vdIn *vd, int control);
 int v4l2GetControl(struct vdIn *vd, int control);
 int v4l2SetControl(struct vdIn *vd, int control, int value, int plugin_number, globals *pglobal);
 int v4l2UpControl(struct vdIn *vd, int control);
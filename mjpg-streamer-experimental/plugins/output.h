@@ -22,7 +22,7 @@
 
 #include "../mjpg_streamer.h"
 #define OUTPUT_PLUGIN_PREFIX " o: "
-#define OPRINT(...) { char _bf[1024] = {0}; snprintf(_bf, sizeof(_bf)-1, __VA_ARGS__); fprintf(stderr, "%s", OUTPUT_PLUGIN_PREFIX); fprintf(stderr, "%s", _bf); syslog(LOG_INFO, "%s", _bf); }
+#define OPRINT(...) log_message(LOG_INFO, OUTPUT_PLUGIN_PREFIX, __VA_ARGS__)
 
 /* parameters for output plugin */
 typedef struct _output_parameter output_parameter;
@@ -83,6 +83,7 @@ void worker_cleanup(void *arg)
 
     first_run = 0;
     OPRINT("cleaning up ressources allocated by worker thread\n");
+    input_detach(&pglobal->in[input_number]);
 
     free(frame);
     close(fd);
@@ -110,14 +111,24 @@ void *worker_thread(void *arg)
     /* set cleanup handler to cleanup allocated ressources */
     pthread_cleanup_push(worker_cleanup, NULL);
 
+    /* frames are wanted all the time */
+    input_attach(&pglobal->in[input_number]);
+
     while(!pglobal->stop) {
         DBG("waiting for fresh frame\n");
         pthread_mutex_lock(&pglobal->in[input_number].db);
         pthread_cond_wait(&pglobal->in[input_number].db_update, &pglobal->in[input_number].db);
 
+        /* the sharpness is computed from JPEG data, the format is known with the frames */
+        if(input_is_h264(&pglobal->in[input_number])) {
+            pthread_mutex_unlock(&pglobal->in[input_number].db);
+            OPRINT("ERROR: input %d delivers H.264, autofocus needs JPEG frames\n", input_number);
+            break;
+        }
+
         /* read buffer */
         frame_size = pglobal->in[input_number].size;
-        memcpy(frame, pglobal->in[input_number].buf, frame_size);
+        input_copy_frame(&pglobal->in[input_number], frame);
 
         pthread_mutex_unlock(&pglobal->in[input_number].db);
 
@@ -36,6 +36,7 @@
 #include <time.h>
 #include <syslog.h>
 #include <dirent.h>
+#include <sys/time.h>
 
 #include <linux/types.h>          /* for videodev2.h */
 #include <linux/videodev2.h>
@@ -55,6 +56,8 @@ static unsigned char *frame = NULL;
 static char *command = NULL;
 static int input_number = 0;
 static char *mjpgFileName = NULL;
+static int index_fd = -1;
+static uint64_t mjpg_offset = 0;
 
 /******************************************************************************
 Description.: print a help message
@@ -68,7 +71,8 @@ void help(void)
             " ---------------------------------------------------------------\n" \
             " The following parameters can be passed to this plugin:\n\n" \
             " [-f | --folder ]........: folder to save pictures\n" \
-            " [-m | --mjpeg ].........: save the frames to an mjpg file \n" \
+            " [-m | --mjpeg ].........: save the frames to an mjpg file, a frame\n" \
+            "                           index is written to <file>"MJPG_INDEX_SUFFIX"\n" \
             " [-d | --delay ].........: delay after saving pictures in ms\n" \
             " [-i | --input ].........: read frames from the specified input plugin\n" \
             " The following arguments are takes effect only if the current mode is not MJPG\n" \
@@ -89,6 +93,10 @@ void worker_cleanup(void *arg)
 
     if (mjpgFileName != NULL) {
         close(fd);
+        if(index_fd >= 0) {
+            close(index_fd);
+            index_fd = -1;
+        }
     }
 
     if(!first_run) {
@@ -98,6 +106,7 @@ void worker_cleanup(void *arg)
 
     first_run = 0;
     OPRINT("cleaning up ressources allocated by worker thread\n");
+    input_detach(&pglobal->in[input_number]);
 
     if(frame != NULL) {
         free(frame);
@@ -210,16 +219,28 @@ void *worker_thread(void *arg)
     time_t t;
     struct tm *now;
     unsigned char *tmp_framebuffer = NULL;
+    struct timeval timestamp;
+    mjpg_index_entry entry;
 
     /* set cleanup handler to cleanup allocated ressources */
     pthread_cleanup_push(worker_cleanup, NULL);
 
+    /* frames are wanted all the time */
+    input_attach(&pglobal->in[input_number]);
+
     while(ok >= 0 && !pglobal->stop) {
         DBG("waiting for fresh frame\n");
 
         pthread_mutex_lock(&pglobal->in[input_number].db);
         pthread_cond_wait(&pglobal->in[input_number].db_update, &pglobal->in[input_number].db);
 
+        /* the pictures and the recording are JPEG, the format is known with the frames */
+        if(input_is_h264(&pglobal->in[input_number])) {
+            pthread_mutex_unlock(&pglobal->in[input_number].db);
+            OPRINT("ERROR: input %d delivers H.264, this plugin only writes JPEG frames\n", input_number);
+            break;
+        }
+
         /* read buffer */
         frame_size = pglobal->in[input_number].size;
 
@@ -238,7 +259,8 @@ void *worker_thread(void *arg)
         }
 
         /* copy frame to our local buffer now */
-        memcpy(frame, pglobal->in[input_number].buf, frame_size);
+        input_copy_frame(&pglobal->in[input_number], frame);
+        timestamp = pglobal->in[input_number].timestamp;
 
         /* allow others to access the global buffer again */
         pthread_mutex_unlock(&pglobal->in[input_number].db);
@@ -325,6 +347,23 @@ void *worker_thread(void *arg)
                 close(fd);
                 return NULL;
             }
+
+            /* not every input plugin provides a timestamp, use the time of recording then */
+            if(timestamp.tv_sec == 0 && timestamp.tv_usec == 0)
+                gettimeofday(&timestamp, NULL);
+
+            /* append the frame to the index */
+            memset(&entry, 0, sizeof(entry));
+            entry.offset = mjpg_offset;
+            entry.size = frame_size;
+            entry.timestamp = (int64_t)timestamp.tv_sec * 1000000 + timestamp.tv_usec;
+            mjpg_offset += frame_size;
+
+            if(index_fd >= 0 && write(index_fd, &entry, sizeof(entry)) != sizeof(entry)) {
+                OPRINT("could not write to the frame index, disabling it\n");
+                close(index_fd);
+                index_fd = -1;
+            }
         }
 
         /* if specified, wait now */
@@ -474,6 +513,16 @@ int output_init(output_parameter *param, int id)
             return 1;
         }
         free(fnBuffer);
+
+        /* the frame index is optional, recording works without it */
+        fnBuffer = malloc(strlen(mjpgFileName) + strlen(folder) + strlen(MJPG_INDEX_SUFFIX) + 3);
+        sprintf(fnBuffer, "%s/%s" MJPG_INDEX_SUFFIX, folder, mjpgFileName);
+
+        OPRINT("frame index.......: %s\n", fnBuffer);
+        if((index_fd = open(fnBuffer, O_CREAT | O_RDWR | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) < 0) {
+            OPRINT("could not open the file %s\n", fnBuffer);
+        }
+        free(fnBuffer);
     }
 
     param->global->out[id].parametercount = 2;
@@ -560,6 +609,11 @@ int output_cmd(int plugin_id, unsigned int control_id, unsigned int group, int v
                                         DBG("Unable to lock mutex\n");
                                         return -1;
                                     }
+                                    if(input_is_h264(&pglobal->in[input_number])) {
+                                        pthread_mutex_unlock(&pglobal->in[input_number].db);
+                                        OPRINT("ERROR: input %d delivers H.264, no JPEG file can be taken\n", input_number);
+                                        return -1;
+                                    }
                                     /* read buffer */
                                     frame_size = pglobal->in[input_number].size;
 
@@ -578,7 +632,7 @@ int output_cmd(int plugin_id, unsigned int control_id, unsigned int group, int v
                                     }
 
                                     /* copy frame to our local buffer now */
-                                    memcpy(frame, pglobal->in[input_number].buf, frame_size);
+                                    input_copy_frame(&pglobal->in[input_number], frame);
 
                                     /* allow others to access the global buffer again */
                                     pthread_mutex_unlock(&pglobal->in[input_number].db);
@@ -4,4 +4,20 @@
 #define OUT_FILE_CMD_TAKE           1
 #define OUT_FILE_CMD_FILENAME       2
 
+#include <stdint.h>
+
+/*
+ * an mjpg recording "name" gets a frame index "name.idx" next to it,
+ * a sequence of the following records, one per frame in recording order.
+ * output_http uses it to seek in the recording without reading it.
+ */
+#define MJPG_INDEX_SUFFIX ".idx"
+
+typedef struct {
+    uint64_t offset;        /* position of the frame in the mjpg file */
+    uint32_t size;          /* size of the frame in bytes */
+    uint32_t reserved;
+    int64_t timestamp;      /* capture time of the frame in microseconds */
+} mjpg_index_entry;
+
 #endif
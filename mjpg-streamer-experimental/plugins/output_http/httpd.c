@@ -21,6 +21,7 @@
 #                                                                              #
 *******************************************************************************/
 #include <string.h>
+#include <time.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -37,6 +38,7 @@
 #include <netdb.h>
 #include <errno.h>
 #include <limits.h>
+#include <sys/sendfile.h>
 
 #include <linux/version.h>
 #include <linux/types.h>          /* for videodev2.h */
@@ -115,7 +117,8 @@ void init_request(request *req)
     req->type        = A_UNKNOWN;
     req->parameter   = NULL;
     req->client      = NULL;
-    req->credentials = NULL;
+    req->user        = NULL;
+    req->range       = NULL;
 }
 
 /******************************************************************************
@@ -128,8 +131,8 @@ void free_request(request *req)
 {
     if(req->parameter != NULL) free(req->parameter);
     if(req->client != NULL) free(req->client);
-    if(req->credentials != NULL) free(req->credentials);
     if(req->query_string != NULL) free(req->query_string);
+    if(req->range != NULL) free(req->range);
 }
 
 /******************************************************************************
@@ -234,48 +237,148 @@ int _readline(int fd, iobuffer *iobuf, void *buffer, size_t len, int timeout)
 }
 
 /******************************************************************************
-Description.: Decodes the data and stores the result to the same buffer.
-              The buffer will be large enough, because base64 requires more
-              space then plain text.
-Hints.......: taken from busybox, but it is GPL code
-Input Value.: base64 encoded data
-Return Value: plain decoded data
+Description.: Encodes data with base64, as used for HTTP basic authentication
+Input Value.: zero terminated plain data
+Return Value: newly allocated, zero terminated encoded data or NULL
 ******************************************************************************/
-void decodeBase64(char *data)
+char *encodeBase64(const char *data)
 {
+    static const char table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
     const unsigned char *in = (const unsigned char *)data;
-    /* The decoded size will be at most 3/4 the size of the encoded */
-    unsigned ch = 0;
-    int i = 0;
-
-    while(*in) {
-        int t = *in++;
-
-        if(t >= '0' && t <= '9')
-            t = t - '0' + 52;
-        else if(t >= 'A' && t <= 'Z')
-            t = t - 'A';
-        else if(t >= 'a' && t <= 'z')
-            t = t - 'a' + 26;
-        else if(t == '+')
-            t = 62;
-        else if(t == '/')
-            t = 63;
-        else if(t == '=')
-            t = 0;
-        else
-            continue;
+    size_t len = strlen(data), i;
+    char *result, *out;
+
+    if((result = malloc(4 * ((len + 2) / 3) + 1)) == NULL)
+        return NULL;
 
-        ch = (ch << 6) | t;
-        i++;
-        if(i == 4) {
-            *data++ = (char)(ch >> 16);
-            *data++ = (char)(ch >> 8);
-            *data++ = (char) ch;
-            i = 0;
+    out = result;
+    for(i = 0; i + 2 < len; i += 3) {
+        *out++ = table[in[i] >> 2];
+        *out++ = table[((in[i] & 0x03) << 4) | (in[i + 1] >> 4)];
+        *out++ = table[((in[i + 1] & 0x0f) << 2) | (in[i + 2] >> 6)];
+        *out++ = table[in[i + 2] & 0x3f];
+    }
+
+    if(i < len) {
+        *out++ = table[in[i] >> 2];
+        if(i + 1 < len) {
+            *out++ = table[((in[i] & 0x03) << 4) | (in[i + 1] >> 4)];
+            *out++ = table[(in[i + 1] & 0x0f) << 2];
+        } else {
+            *out++ = table[(in[i] & 0x03) << 4];
+            *out++ = '=';
         }
+        *out++ = '=';
+    }
+    *out = '\0';
+
+    return result;
+}
+
+/******************************************************************************
+Description.: FNV-1a hash, selects the bucket of the hash tables
+Input Value.: * data: the key
+              * len.: length of the key
+Return Value: the hash
+******************************************************************************/
+static unsigned int fnv_hash(const char *data, size_t len)
+{
+    unsigned int hash = 2166136261u;
+    size_t i;
+
+    for(i = 0; i < len; i++) {
+        hash ^= (unsigned char)data[i];
+        hash *= 16777619u;
     }
-    *data = '\0';
+
+    return hash;
+}
+
+/******************************************************************************
+Description.: selects the bucket of a credential token
+Input Value.: * token: base64 encoded credential
+              * len..: length of the token
+Return Value: index of the bucket
+******************************************************************************/
+static unsigned int credential_bucket(const char *token, size_t len)
+{
+    return fnv_hash(token, len) % CREDENTIAL_BUCKETS;
+}
+
+/******************************************************************************
+Description.: compares two tokens in a time that does not depend on their
+              content, so the password can not be guessed byte by byte
+Input Value.: the two tokens and their lengths
+Return Value: 1 if equal, 0 otherwise
+******************************************************************************/
+static int token_equal(const char *a, size_t a_len, const char *b, size_t b_len)
+{
+    unsigned char diff = 0;
+    size_t i;
+
+    if(a_len != b_len)
+        return 0;
+
+    for(i = 0; i < a_len; i++)
+        diff |= (unsigned char)a[i] ^ (unsigned char)b[i];
+
+    return diff == 0;
+}
+
+/******************************************************************************
+Description.: Adds an accepted "username:password" pair to the configuration.
+              It is encoded once here, requests are compared to the encoding.
+Input Value.: * conf.: configuration of the server
+              * plain: "username:password"
+Return Value: 0 if ok, -1 in case of error
+******************************************************************************/
+int add_credential(config *conf, const char *plain)
+{
+    credential *entry;
+    unsigned int bucket;
+    char *colon;
+
+    if((entry = calloc(1, sizeof(credential))) == NULL)
+        return -1;
+
+    if((entry->token = encodeBase64(plain)) == NULL ||
+       (entry->username = strdup(plain)) == NULL) {
+        free(entry->token);
+        free(entry);
+        return -1;
+    }
+    entry->token_len = strlen(entry->token);
+
+    if((colon = strchr(entry->username, ':')) != NULL)
+        *colon = '\0';
+
+    bucket = credential_bucket(entry->token, entry->token_len);
+    entry->next = conf->credentials[bucket];
+    conf->credentials[bucket] = entry;
+    conf->credential_count++;
+
+    return 0;
+}
+
+/******************************************************************************
+Description.: Looks up the credential a client sent with the
+              "Authorization: Basic" header
+Input Value.: * conf.: configuration of the server
+              * token: base64 encoded credential as sent, not zero terminated
+              * len..: length of the token
+Return Value: matching credential or NULL
+******************************************************************************/
+credential *find_credential(config *conf, const char *token, size_t len)
+{
+    credential *entry, *match = NULL;
+
+    /* walk the whole bucket to not reveal the position of a match */
+    for(entry = conf->credentials[credential_bucket(token, len)]; entry != NULL; entry = entry->next) {
+        if(token_equal(entry->token, entry->token_len, token, len))
+            match = entry;
+    }
+
+    return match;
 }
 
 /******************************************************************************
@@ -431,6 +534,350 @@ void update_client_timestamp(client_info *client)
 }
 #endif
 
+/******************************************************************************
+Description.: refill a token bucket according to the time passed since the
+              last refill, the level is limited to the burst size
+Input Value.: * b....: token bucket to refill
+              * now..: current time read from CLOCK_MONOTONIC
+Return Value: -
+******************************************************************************/
+static void refill_bucket(token_bucket *b, struct timespec *now)
+{
+    double elapsed = (now->tv_sec - b->last.tv_sec) + (now->tv_nsec - b->last.tv_nsec) / 1e9;
+
+    b->tokens = MIN(b->tokens + elapsed * b->rate, b->burst);
+    b->last = *now;
+}
+
+/******************************************************************************
+Description.: prepare a full token bucket, a burst of one second is allowed
+Input Value.: * b....: token bucket to initialize
+              * rate.: tokens per second, 0 disables the bucket
+              * now..: current time read from CLOCK_MONOTONIC
+Return Value: -
+******************************************************************************/
+static void init_bucket(token_bucket *b, double rate, struct timespec *now)
+{
+    b->rate = rate;
+    b->burst = MAX(rate, 1);
+    b->tokens = b->burst;
+    b->last = *now;
+}
+
+/******************************************************************************
+Description.: Forgets the throttling state nobody used for THROTTLE_IDLE
+              seconds, its buckets are full again and a new entry starts the
+              same way. Called with throttle_mutex held, at most once every
+              THROTTLE_IDLE seconds, so a scan of the table is rare.
+Input Value.: * pc.: server context
+              * now: current CLOCK_MONOTONIC seconds
+Return Value: -
+******************************************************************************/
+static void evict_throttles(context *pc, time_t now)
+{
+    throttle_info **link, *t;
+    int i;
+
+    if(now - pc->throttle_sweep < THROTTLE_IDLE)
+        return;
+    pc->throttle_sweep = now;
+
+    for(i = 0; i < THROTTLE_BUCKETS; i++) {
+        link = &pc->throttles[i];
+        while((t = *link) != NULL) {
+            if(t->users == 0 && now - t->released >= THROTTLE_IDLE) {
+                *link = t->next;
+                free(t->key);
+                free(t);
+            } else {
+                link = &t->next;
+            }
+        }
+    }
+}
+
+/******************************************************************************
+Description.: Looks up the throttling state of a client address or credential
+              and creates it if this key was not seen recently. The caller
+              has to give it back with put_throttle().
+Input Value.: * pc.....: server context, each server has its own limits
+              * prefix.: key namespace, "ip" or "user"
+              * name...: the address or username
+Return Value: pointer to the throttle state or NULL if throttling is disabled
+******************************************************************************/
+throttle_info *get_throttle(context *pc, const char *prefix, const char *name)
+{
+    throttle_info *t;
+    struct timespec now;
+    char key[NI_MAXHOST + 8];
+    unsigned int bucket;
+
+    if(pc->conf.max_requests <= 0 && pc->conf.max_bandwidth <= 0)
+        return NULL;
+
+    snprintf(key, sizeof(key), "%s:%s", prefix, name);
+    bucket = fnv_hash(key, strlen(key)) % THROTTLE_BUCKETS;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    pthread_mutex_lock(&pc->throttle_mutex);
+    evict_throttles(pc, now.tv_sec);
+
+    for(t = pc->throttles[bucket]; t != NULL; t = t->next) {
+        if(strcmp(t->key, key) == 0) {
+            t->users++;
+            pthread_mutex_unlock(&pc->throttle_mutex);
+            return t;
+        }
+    }
+
+    if((t = calloc(1, sizeof(throttle_info))) == NULL || (t->key = strdup(key)) == NULL) {
+        fprintf(stderr, "could not allocate memory\n");
+        free(t);
+        pthread_mutex_unlock(&pc->throttle_mutex);
+        return NULL;
+    }
+
+    init_bucket(&t->requests, pc->conf.max_requests, &now);
+    init_bucket(&t->bytes, pc->conf.max_bandwidth, &now);
+    t->users = 1;
+
+    t->next = pc->throttles[bucket];
+    pc->throttles[bucket] = t;
+
+    pthread_mutex_unlock(&pc->throttle_mutex);
+    return t;
+}
+
+/******************************************************************************
+Description.: Gives back the throttling state taken with get_throttle()
+Input Value.: * pc: server context
+              * t.: the throttle state, may be NULL
+Return Value: -
+******************************************************************************/
+void put_throttle(context *pc, throttle_info *t)
+{
+    struct timespec now;
+
+    if(t == NULL)
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    pthread_mutex_lock(&pc->throttle_mutex);
+    t->users--;
+    t->released = now.tv_sec;
+    pthread_mutex_unlock(&pc->throttle_mutex);
+}
+
+/******************************************************************************
+Description.: Takes one request token from the address and the credential
+              bucket of this client. Either both buckets pay or none.
+Input Value.: context_fd: the connected client
+Return Value: 0 if the request may be served, otherwise the number of
+              seconds after which the client may retry
+******************************************************************************/
+int throttle_request(cfd *context_fd)
+{
+    throttle_info *t[2] = { context_fd->throttle_ip, context_fd->throttle_user };
+    struct timespec now;
+    int i, retry = 0;
+
+    if(context_fd->pc->conf.max_requests <= 0)
+        return 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    pthread_mutex_lock(&context_fd->pc->throttle_mutex);
+
+    for(i = 0; i < 2; i++) {
+        if(t[i] == NULL)
+            continue;
+        refill_bucket(&t[i]->requests, &now);
+        if(t[i]->requests.tokens < 1) {
+            t[i]->requests_throttled++;
+            retry = MAX(retry, (int)((1 - t[i]->requests.tokens) / t[i]->requests.rate) + 1);
+        }
+    }
+
+    for(i = 0; i < 2 && retry == 0; i++) {
+        if(t[i] == NULL)
+            continue;
+        t[i]->requests.tokens -= 1;
+        t[i]->requests_total++;
+    }
+
+    pthread_mutex_unlock(&context_fd->pc->throttle_mutex);
+    return retry;
+}
+
+/******************************************************************************
+Description.: Decides if a frame of a stream may be sent to the client.
+              A frame is sent as long as the bandwidth buckets are not in
+              debt, otherwise it gets skipped. This way a client that
+              exceeds its bandwidth receives a lower framerate but no other
+              client or the input has to wait for it.
+Input Value.: * context_fd: the connected client
+              * size......: size of the frame in bytes
+Return Value: 1 if the frame should be sent, 0 if it should be dropped
+******************************************************************************/
+int throttle_frame(cfd *context_fd, int size)
+{
+    throttle_info *t[2] = { context_fd->throttle_ip, context_fd->throttle_user };
+    struct timespec now;
+    int i, allowed = 1;
+
+    if(context_fd->pc->conf.max_bandwidth <= 0)
+        return 1;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    pthread_mutex_lock(&context_fd->pc->throttle_mutex);
+
+    for(i = 0; i < 2; i++) {
+        if(t[i] == NULL)
+            continue;
+        refill_bucket(&t[i]->bytes, &now);
+        if(t[i]->bytes.tokens <= 0)
+            allowed = 0;
+    }
+
+    for(i = 0; i < 2; i++) {
+        if(t[i] == NULL)
+            continue;
+        if(allowed) {
+            t[i]->bytes.tokens -= size;
+            t[i]->bytes_sent += size;
+        } else {
+            t[i]->frames_dropped++;
+        }
+    }
+
+    pthread_mutex_unlock(&context_fd->pc->throttle_mutex);
+    return allowed;
+}
+
+/******************************************************************************
+Description.: Charges the bandwidth buckets for data that can not be dropped,
+              like snapshots or files. If the client is in debt afterwards
+              this client thread sleeps until the debt is paid back.
+Input Value.: * context_fd: the connected client
+              * size......: number of bytes about to be sent
+Return Value: -
+******************************************************************************/
+void throttle_send(cfd *context_fd, int size)
+{
+    throttle_info *t[2] = { context_fd->throttle_ip, context_fd->throttle_user };
+    struct timespec now;
+    double wait = 0;
+    int i;
+
+    if(context_fd->pc->conf.max_bandwidth <= 0)
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    pthread_mutex_lock(&context_fd->pc->throttle_mutex);
+
+    for(i = 0; i < 2; i++) {
+        if(t[i] == NULL)
+            continue;
+        refill_bucket(&t[i]->bytes, &now);
+        t[i]->bytes.tokens -= size;
+        t[i]->bytes_sent += size;
+        if(t[i]->bytes.tokens < 0)
+            wait = MAX(wait, -t[i]->bytes.tokens / t[i]->bytes.rate);
+    }
+
+    pthread_mutex_unlock(&context_fd->pc->throttle_mutex);
+
+    if(wait > 0)
+        usleep((useconds_t)(wait * 1000 * 1000));
+}
+
+/******************************************************************************
+Description.: Counts a new connection, called by the server thread before a
+              client thread gets started
+Input Value.: pc: server context
+Return Value: 1 if the client is admitted, 0 if too many are connected
+******************************************************************************/
+int admit_client(context *pc)
+{
+    int admitted = 1;
+
+    pthread_mutex_lock(&pc->admission_mutex);
+    if(pc->conf.max_clients > 0 && pc->clients >= pc->conf.max_clients) {
+        pc->clients_rejected++;
+        admitted = 0;
+    } else {
+        pc->clients++;
+    }
+    pthread_mutex_unlock(&pc->admission_mutex);
+
+    return admitted;
+}
+
+/******************************************************************************
+Description.: Releases a connection counted by admit_client()
+Input Value.: pc: server context
+Return Value: -
+******************************************************************************/
+void release_client(context *pc)
+{
+    pthread_mutex_lock(&pc->admission_mutex);
+    pc->clients--;
+    pthread_mutex_unlock(&pc->admission_mutex);
+}
+
+/******************************************************************************
+Description.: Takes a slot of an endpoint. If all slots are in use the request
+              waits for one at most "queue_timeout" milliseconds.
+Input Value.: * pc......: server context
+              * endpoint: group of the request
+Return Value: 0 if a slot was taken, -1 if the request has to be rejected
+******************************************************************************/
+int acquire_endpoint(context *pc, endpoint_t endpoint)
+{
+    struct timespec deadline;
+    int limit = pc->conf.max_active[endpoint], rc = 0;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += pc->conf.queue_timeout / 1000;
+    deadline.tv_nsec += (pc->conf.queue_timeout % 1000) * 1000000L;
+    if(deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&pc->admission_mutex);
+    pc->waiting[endpoint]++;
+    while(limit > 0 && pc->active[endpoint] >= limit && rc == 0) {
+        if(pthread_cond_timedwait(&pc->admission_cond, &pc->admission_mutex, &deadline) == ETIMEDOUT &&
+           pc->active[endpoint] >= limit)
+            rc = -1;
+    }
+    pc->waiting[endpoint]--;
+
+    if(rc == 0) {
+        pc->active[endpoint]++;
+        pc->served[endpoint]++;
+    } else {
+        pc->rejected[endpoint]++;
+    }
+    pthread_mutex_unlock(&pc->admission_mutex);
+
+    return rc;
+}
+
+/******************************************************************************
+Description.: Releases a slot taken by acquire_endpoint()
+Input Value.: * pc......: server context
+              * endpoint: group of the request
+Return Value: -
+******************************************************************************/
+void release_endpoint(context *pc, endpoint_t endpoint)
+{
+    pthread_mutex_lock(&pc->admission_mutex);
+    pc->active[endpoint]--;
+    pthread_cond_broadcast(&pc->admission_cond);
+    pthread_mutex_unlock(&pc->admission_mutex);
+}
+
 /******************************************************************************
 Description.: Send a complete HTTP response and a single JPG-frame.
 Input Value.: fildescriptor fd to send the answer to
@@ -442,13 +889,19 @@ void send_snapshot(cfd *context_fd, int input_number)
     int frame_size = 0;
     char buffer[BUFFER_SIZE] = {0};
     struct timeval timestamp;
+    int stale, width, height;
+    char format[32] = "";
 
-    /* wait for a fresh frame */
+    /* wait for a fresh frame, unless the input lost its device */
     pthread_mutex_lock(&pglobal->in[input_number].db);
-    pthread_cond_wait(&pglobal->in[input_number].db_update, &pglobal->in[input_number].db);
+    if(!pglobal->in[input_number].stale)
+        pthread_cond_wait(&pglobal->in[input_number].db_update, &pglobal->in[input_number].db);
 
     /* read buffer */
     frame_size = pglobal->in[input_number].size;
+    stale = pglobal->in[input_number].stale;
+    width = pglobal->in[input_number].width;
+    height = pglobal->in[input_number].height;
 
     /* allocate a buffer for this single frame */
     if((frame = malloc(frame_size + 1)) == NULL) {
@@ -460,7 +913,7 @@ void send_snapshot(cfd *context_fd, int input_number)
     /* copy v4l2_buffer timeval to user space */
     timestamp = pglobal->in[input_number].timestamp;
 
-    memcpy(frame, pglobal->in[input_number].buf, frame_size);
+    input_copy_frame(&pglobal->in[input_number], frame);
     DBG("got frame (size: %d kB)\n", frame_size / 1024);
 
     pthread_mutex_unlock(&pglobal->in[input_number].db);
@@ -470,11 +923,18 @@ void send_snapshot(cfd *context_fd, int input_number)
     #endif
 
     /* write the response */
+    if(width > 0)
+        snprintf(format, sizeof(format), "X-Resolution: %dx%d\r\n", width, height);
     sprintf(buffer, "HTTP/1.0 200 OK\r\n" \
             STD_HEADER \
             "Content-type: image/jpeg\r\n" \
             "X-Timestamp: %d.%06d\r\n" \
-            "\r\n", (int) timestamp.tv_sec, (int) timestamp.tv_usec);
+            "%s%s" \
+            "\r\n", (int) timestamp.tv_sec, (int) timestamp.tv_usec,
+            stale ? "X-Stale: 1\r\n" : "", format);
+
+    /* pay for the bandwidth, this may delay a client that exceeds its limit */
+    throttle_send(context_fd, frame_size);
 
     /* send header and image now */
     if (write(context_fd->fd, buffer, strlen(buffer)) < 0 ||
@@ -486,8 +946,92 @@ void send_snapshot(cfd *context_fd, int input_number)
     free(frame);
 }
 
+/******************************************************************************
+Description.: Send a complete HTTP response and the raw H.264 stream of an
+              input that captures H.264. Frames refer to the previous ones,
+              so the stream starts with a keyframe. If this client misses a
+              frame, because it is too slow, exceeds its bandwidth or the
+              input dropped or lost one, it waits for the next keyframe again.
+Input Value.: fildescriptor fd to send the answer to
+Return Value: -
+******************************************************************************/
+void send_stream_h264(cfd *context_fd, int input_number)
+{
+    unsigned char *frame = NULL, *tmp = NULL;
+    int frame_size = 0, max_frame_size = 0, synced = 0;
+    unsigned long published = 0, lost = 0;
+    unsigned int format_seq = 0;
+    char buffer[BUFFER_SIZE] = {0};
+    input *in = &pglobal->in[input_number];
+
+    sprintf(buffer, "HTTP/1.0 200 OK\r\n" \
+            STD_HEADER \
+            "Content-Type: video/h264\r\n" \
+            "\r\n");
+
+    if(write(context_fd->fd, buffer, strlen(buffer)) < 0)
+        return;
+
+    while(!pglobal->stop) {
+
+        /* wait for fresh frames */
+        pthread_mutex_lock(&in->db);
+        pthread_cond_wait(&in->db_update, &in->db);
+
+        if(synced && (in->stats.published != published + 1 || in->stats.drops + in->stats.corrupt != lost ||
+                      in->format_seq != format_seq)) {
+            DBG("frames missed, waiting for a keyframe\n");
+            synced = 0;
+        }
+        published = in->stats.published;
+        lost = in->stats.drops + in->stats.corrupt;
+        format_seq = in->format_seq;
+
+        frame_size = in->size;
+        if((!synced && !in->keyframe) || in->stale) {
+            pthread_mutex_unlock(&in->db);
+            continue;
+        }
+
+        /* skipping a frame breaks the following ones as well */
+        if(!throttle_frame(context_fd, frame_size)) {
+            synced = 0;
+            pthread_mutex_unlock(&in->db);
+            continue;
+        }
+        synced = 1;
+
+        /* check if framebuffer is large enough, increase it if necessary */
+        if(frame_size > max_frame_size) {
+            DBG("increasing buffer size to %d\n", frame_size);
+
+            max_frame_size = frame_size + TEN_K;
+            if((tmp = realloc(frame, max_frame_size)) == NULL) {
+                free(frame);
+                pthread_mutex_unlock(&in->db);
+                send_error(context_fd->fd, 500, "not enough memory");
+                return;
+            }
+
+            frame = tmp;
+        }
+
+        input_copy_frame(in, frame);
+        pthread_mutex_unlock(&in->db);
+
+        #ifdef MANAGMENT
+        update_client_timestamp(context_fd->client);
+        #endif
+
+        if(write(context_fd->fd, frame, frame_size) < 0) break;
+    }
+
+    free(frame);
+}
+
 /******************************************************************************
 Description.: Send a complete HTTP response and a stream of JPG-frames.
+              Inputs that capture H.264 get their raw stream sent instead.
 Input Value.: fildescriptor fd to send the answer to
 Return Value: -
 ******************************************************************************/
@@ -495,8 +1039,15 @@ void send_stream(cfd *context_fd, int input_number)
 {
     unsigned char *frame = NULL, *tmp = NULL;
     int frame_size = 0, max_frame_size = 0;
-    char buffer[BUFFER_SIZE] = {0};
+    char buffer[BUFFER_SIZE] = {0}, format[64];
     struct timeval timestamp;
+    unsigned int format_seq = 0;
+    int width, height, changed;
+
+    if(input_is_h264(&pglobal->in[input_number])) {
+        send_stream_h264(context_fd, input_number);
+        return;
+    }
 
     DBG("preparing header\n");
     sprintf(buffer, "HTTP/1.0 200 OK\r\n" \
@@ -521,6 +1072,12 @@ void send_stream(cfd *context_fd, int input_number)
         /* read buffer */
         frame_size = pglobal->in[input_number].size;
 
+        /* skip this frame if the client exceeds its bandwidth */
+        if(!throttle_frame(context_fd, frame_size)) {
+            pthread_mutex_unlock(&pglobal->in[input_number].db);
+            continue;
+        }
+
         /* check if framebuffer is large enough, increase it if necessary */
         if(frame_size > max_frame_size) {
             DBG("increasing buffer size to %d\n", frame_size);
@@ -539,7 +1096,13 @@ void send_stream(cfd *context_fd, int input_number)
         /* copy v4l2_buffer timeval to user space */
         timestamp = pglobal->in[input_number].timestamp;
 
-        memcpy(frame, pglobal->in[input_number].buf, frame_size);
+        /* tell the client when the size of the frames changes */
+        width = pglobal->in[input_number].width;
+        height = pglobal->in[input_number].height;
+        changed = (format_seq != 0 && format_seq != pglobal->in[input_number].format_seq);
+        format_seq = pglobal->in[input_number].format_seq;
+
+        input_copy_frame(&pglobal->in[input_number], frame);
         DBG("got frame (size: %d kB)\n", frame_size / 1024);
 
         pthread_mutex_unlock(&pglobal->in[input_number].db);
@@ -553,10 +1116,14 @@ void send_stream(cfd *context_fd, int input_number)
          * sending the content-length fixes random stream disruption observed
          * with firefox
          */
+        format[0] = '\0';
+        if(width > 0)
+            snprintf(format, sizeof(format), "X-Resolution: %dx%d\r\n%s", width, height, changed ? "X-Format-Change: 1\r\n" : "");
         sprintf(buffer, "Content-Type: image/jpeg\r\n" \
                 "Content-Length: %d\r\n" \
                 "X-Timestamp: %d.%06d\r\n" \
-                "\r\n", frame_size, (int)timestamp.tv_sec, (int)timestamp.tv_usec);
+                "%s" \
+                "\r\n", frame_size, (int)timestamp.tv_sec, (int)timestamp.tv_usec, format);
         DBG("sending intemdiate header\n");
         if(write(context_fd->fd, buffer, strlen(buffer)) < 0) break;
 
@@ -624,6 +1191,12 @@ void send_stream_wxp(cfd *context_fd, int input_number)
         /* read buffer */
         frame_size = pglobal->in[input_number].size;
 
+        /* skip this frame if the client exceeds its bandwidth */
+        if(!throttle_frame(context_fd, frame_size)) {
+            pthread_mutex_unlock(&pglobal->in[input_number].db);
+            continue;
+        }
+
         /* check if framebuffer is large enough, increase it if necessary */
         if(frame_size > max_frame_size) {
             DBG("increasing buffer size to %d\n", frame_size);
@@ -646,7 +1219,7 @@ void send_stream_wxp(cfd *context_fd, int input_number)
         update_client_timestamp(context_fd->client);
         #endif
 
-        memcpy(frame, pglobal->in[input_number].buf, frame_size);
+        input_copy_frame(&pglobal->in[input_number], frame);
         DBG("got frame (size: %d kB)\n", frame_size / 1024);
 
         pthread_mutex_unlock(&pglobal->in[input_number].db);
@@ -672,6 +1245,20 @@ Input Value.: * fd.....: is the filedescriptor to send the message to
 Return Value: -
 ******************************************************************************/
 void send_error(int fd, int which, char *message)
+{
+    send_error_retry(fd, which, 1, message);
+}
+
+/******************************************************************************
+Description.: Send error messages and headers, 429 and 503 responses tell the
+              client when to retry.
+Input Value.: * fd.....: is the filedescriptor to send the message to
+              * which..: HTTP error code
+              * retry..: seconds for the Retry-After header
+              * message: append this string to the displayed response
+Return Value: -
+******************************************************************************/
+void send_error_retry(int fd, int which, int retry, char *message)
 {
     char buffer[BUFFER_SIZE] = {0};
 
@@ -704,6 +1291,29 @@ void send_error(int fd, int which, char *message)
                 "\r\n" \
                 "400: Not Found!\r\n" \
                 "%s", message);
+    } else if (which == 429) {
+        sprintf(buffer, "HTTP/1.0 429 Too Many Requests\r\n" \
+                "Content-type: text/plain\r\n" \
+                STD_HEADER \
+                "Retry-After: %d\r\n" \
+                "\r\n" \
+                "429: Too Many Requests!\r\n" \
+                "%s", retry, message);
+    } else if (which == 503) {
+        sprintf(buffer, "HTTP/1.0 503 Service Unavailable\r\n" \
+                "Content-type: text/plain\r\n" \
+                STD_HEADER \
+                "Retry-After: %d\r\n" \
+                "\r\n" \
+                "503: Service Unavailable!\r\n" \
+                "%s", retry, message);
+    } else if (which == 415) {
+        sprintf(buffer, "HTTP/1.0 415 Unsupported Media Type\r\n" \
+                "Content-type: text/plain\r\n" \
+                STD_HEADER \
+                "\r\n" \
+                "415: Unsupported Media Type!\r\n" \
+                "%s", message);
     } else if (which == 403) {
         sprintf(buffer, "HTTP/1.0 403 Forbidden\r\n" \
                 "Content-type: text/plain\r\n" \
@@ -730,17 +1340,21 @@ Description.: Send HTTP header and copy the content of a file. To keep things
               simple, just a single folder gets searched for the file. Just
               files with known extension and supported mimetype get served.
               If no parameter was given, the file "index.html" will be copied.
-Input Value.: * fd.......: filedescriptor to send data to
-              * id.......: specifies which server-context is the right one
-              * parameter: string that consists of the filename
+              A single byte range can be requested, e.g. to seek in recordings.
+Input Value.: * context_fd: the connected client to send data to
+              * parameter.: string that consists of the filename
+              * range.....: value of the "Range" header or NULL
 Return Value: -
 ******************************************************************************/
-void send_file(int id, int fd, char *parameter)
+void send_file(cfd *context_fd, char *parameter, char *range)
 {
     char buffer[BUFFER_SIZE] = {0};
     char *extension, *mimetype = NULL;
-    int i, lfd;
-    config conf = servers[id].conf;
+    int i, lfd, fd = context_fd->fd;
+    config conf = context_fd->pc->conf;
+    struct stat st;
+    off_t start, end, offset;
+    ssize_t sent;
 
     /* in case no parameter was given */
     if(parameter == NULL || strlen(parameter) == 0)
@@ -792,25 +1406,273 @@ void send_file(int id, int fd, char *parameter)
     }
     DBG("opened file: %s\n", buffer);
 
-    /* prepare HTTP header */
-    sprintf(buffer, "HTTP/1.0 200 OK\r\n" \
-            "Content-type: %s\r\n" \
-            STD_HEADER \
-            "\r\n", mimetype);
-    i = strlen(buffer);
+    if(fstat(lfd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        close(lfd);
+        send_error(fd, 404, "Could not open file");
+        return;
+    }
 
-    /* first transmit HTTP-header, afterwards transmit content of file */
-    do {
-        if(write(fd, buffer, i) < 0) {
-            close(lfd);
-            return;
+    /* prepare HTTP header, either for the requested range or the whole file */
+    start = 0;
+    end = st.st_size - 1;
+    i = parse_range(range, st.st_size, &start, &end);
+    if(i < 0) {
+        sprintf(buffer, "HTTP/1.0 416 Range Not Satisfiable\r\n" \
+                "Content-type: text/plain\r\n" \
+                STD_HEADER \
+                "Content-Range: bytes */%lld\r\n" \
+                "\r\n" \
+                "416: Range Not Satisfiable!\r\n", (long long)st.st_size);
+        if(write(fd, buffer, strlen(buffer)) < 0) {
+            DBG("write failed, done anyway\n");
         }
-    } while((i = read(lfd, buffer, sizeof(buffer))) > 0);
+        close(lfd);
+        return;
+    } else if(i > 0) {
+        sprintf(buffer, "HTTP/1.0 206 Partial Content\r\n" \
+                "Content-type: %s\r\n" \
+                STD_HEADER \
+                "Accept-Ranges: bytes\r\n" \
+                "Content-Range: bytes %lld-%lld/%lld\r\n" \
+                "Content-Length: %lld\r\n" \
+                "\r\n", mimetype, (long long)start, (long long)end, (long long)st.st_size, (long long)(end - start + 1));
+    } else {
+        sprintf(buffer, "HTTP/1.0 200 OK\r\n" \
+                "Content-type: %s\r\n" \
+                STD_HEADER \
+                "Accept-Ranges: bytes\r\n" \
+                "Content-Length: %lld\r\n" \
+                "\r\n", mimetype, (long long)st.st_size);
+    }
+    i = strlen(buffer);
+
+    /* first transmit HTTP-header, afterwards let the kernel copy the content of file */
+    throttle_send(context_fd, i);
+    if(write(fd, buffer, i) < 0) {
+        close(lfd);
+        return;
+    }
+
+    /* pay for what was sent, it may be less than the chunk, the next one waits for the debt */
+    offset = start;
+    while(offset <= end) {
+        i = MIN(end - offset + 1, SENDFILE_CHUNK);
+
+        sent = sendfile(fd, lfd, &offset, i);
+        if(sent < 0 && errno == EINTR)
+            continue;
+        if(sent <= 0)
+            break;
+        throttle_send(context_fd, sent);
+    }
 
     /* close file, job done */
     close(lfd);
 }
 
+/******************************************************************************
+Description.: Parses the value of a "Range" header, only a single range in
+              bytes is supported: "bytes=first-last", "bytes=first-" and
+              "bytes=-suffix_length"
+Input Value.: * range: header value or NULL
+              * size.: size of the file
+              * start: returns the first byte to send
+              * end..: returns the last byte to send
+Return Value: 1 if a range has to be sent, 0 to send the whole file,
+              -1 if the range can not be satisfied
+******************************************************************************/
+int parse_range(const char *range, off_t size, off_t *start, off_t *end)
+{
+    long long first = -1, last = -1;
+    char *next;
+
+    if(range == NULL || strncmp(range, "bytes=", strlen("bytes=")) != 0)
+        return 0;
+    range += strlen("bytes=");
+
+    /* several ranges would need a multipart answer, send everything instead */
+    if(strchr(range, ',') != NULL)
+        return 0;
+
+    if(isdigit(*range)) {
+        first = strtoll(range, &next, 10);
+        range = next;
+    }
+    if(*range++ != '-')
+        return 0;
+    if(isdigit(*range))
+        last = strtoll(range, NULL, 10);
+
+    if(first < 0) {
+        /* suffix range, the last bytes of the file */
+        if(last <= 0)
+            return (last == 0) ? -1 : 0;
+        first = MAX(size - last, 0);
+        last = size - 1;
+    } else {
+        if(first >= size)
+            return -1;
+        if(last < 0 || last >= size)
+            last = size - 1;
+        if(last < first)
+            return 0;
+    }
+
+    *start = first;
+    *end = last;
+    return 1;
+}
+
+/******************************************************************************
+Description.: Replays a recording of the output_file plugin as stream with the
+              original timing. The frame index written next to the recording
+              is searched for the start position, so the recording itself is
+              never scanned.
+Input Value.: * context_fd: the connected client to send data to
+              * parameter.: "&file=<recording>&t=<seconds from the start>"
+Return Value: -
+******************************************************************************/
+void send_playback(cfd *context_fd, char *parameter)
+{
+    char buffer[BUFFER_SIZE] = {0}, name[100] = {0}, *value;
+    unsigned char *frame = NULL, *tmp = NULL;
+    int mfd, ifd, fd = context_fd->fd, max_frame_size = 0;
+    size_t len;
+    double seconds = 0;
+    struct stat st;
+    off_t count, low, high, mid;
+    mjpg_index_entry entry;
+    struct timespec begin, now;
+    int64_t target, base, due, elapsed;
+    config conf = context_fd->pc->conf;
+
+    /* only plain filenames from the www-folder are allowed */
+    if(parameter == NULL || (value = strstr(parameter, "file=")) == NULL) {
+        send_error(fd, 400, "no recording given, use file=<name>");
+        return;
+    }
+    value += strlen("file=");
+    len = strspn(value, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ._-1234567890");
+    if(len == 0 || len >= sizeof(name) || value[0] == '.') {
+        send_error(fd, 400, "invalid recording name");
+        return;
+    }
+    strncpy(name, value, len);
+
+    if((value = strstr(parameter, "&t=")) != NULL)
+        seconds = MAX(strtod(value + strlen("&t="), NULL), 0);
+
+    snprintf(buffer, sizeof(buffer), "%s%s", conf.www_folder, name);
+    if((mfd = open(buffer, O_RDONLY)) < 0) {
+        send_error(fd, 404, "Could not open recording");
+        return;
+    }
+
+    snprintf(buffer, sizeof(buffer), "%s%s" MJPG_INDEX_SUFFIX, conf.www_folder, name);
+    if((ifd = open(buffer, O_RDONLY)) < 0) {
+        close(mfd);
+        send_error(fd, 404, "Could not open the frame index of the recording");
+        return;
+    }
+
+    /* find the first frame at or after the requested time with a binary search */
+    if(fstat(ifd, &st) < 0 || (count = st.st_size / sizeof(entry)) == 0 ||
+       pread(ifd, &entry, sizeof(entry), 0) != sizeof(entry)) {
+        close(mfd);
+        close(ifd);
+        send_error(fd, 404, "The recording is empty");
+        return;
+    }
+
+    target = entry.timestamp + (int64_t)(seconds * 1000000);
+    low = 0;
+    high = count;
+    while(low < high) {
+        mid = low + (high - low) / 2;
+        if(pread(ifd, &entry, sizeof(entry), mid * sizeof(entry)) != sizeof(entry))
+            break;
+        if(entry.timestamp < target)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    if(low >= count) {
+        close(mfd);
+        close(ifd);
+        send_error(fd, 404, "The recording is shorter than requested");
+        return;
+    }
+    DBG("playback of %s starts at frame %lld of %lld\n", name, (long long)low, (long long)count);
+
+    sprintf(buffer, "HTTP/1.0 200 OK\r\n" \
+            STD_HEADER \
+            "Content-Type: multipart/x-mixed-replace;boundary=" BOUNDARY "\r\n" \
+            "\r\n" \
+            "--" BOUNDARY "\r\n");
+
+    if(write(fd, buffer, strlen(buffer)) < 0) {
+        close(mfd);
+        close(ifd);
+        return;
+    }
+
+    base = -1;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+
+    for(; !pglobal->stop; low++) {
+        /* a recording in progress grows, look for new frames at the end */
+        if(low >= count) {
+            if(fstat(ifd, &st) < 0 || (count = st.st_size / sizeof(entry)) <= low)
+                break;
+        }
+
+        if(pread(ifd, &entry, sizeof(entry), low * sizeof(entry)) != sizeof(entry))
+            break;
+
+        /* wait until the frame is due, long pauses of the recording are skipped */
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        elapsed = (int64_t)(now.tv_sec - begin.tv_sec) * 1000000 + (now.tv_nsec - begin.tv_nsec) / 1000;
+        if(base < 0)
+            base = entry.timestamp;
+        due = entry.timestamp - base;
+        if(due - elapsed > PLAYBACK_MAX_GAP || due < 0) {
+            base += due - elapsed;
+            due = elapsed;
+        }
+        if(due > elapsed)
+            usleep(due - elapsed);
+
+        /* skip this frame if the client exceeds its bandwidth */
+        if(!throttle_frame(context_fd, entry.size))
+            continue;
+
+        if(entry.size > max_frame_size) {
+            max_frame_size = entry.size + TEN_K;
+            if((tmp = realloc(frame, max_frame_size)) == NULL)
+                break;
+            frame = tmp;
+        }
+
+        if(pread(mfd, frame, entry.size, entry.offset) != entry.size)
+            break;
+
+        sprintf(buffer, "Content-Type: image/jpeg\r\n" \
+                "Content-Length: %d\r\n" \
+                "X-Timestamp: %lld.%06d\r\n" \
+                "\r\n", (int)entry.size, (long long)(entry.timestamp / 1000000), (int)(entry.timestamp % 1000000));
+        if(write(fd, buffer, strlen(buffer)) < 0) break;
+        if(write(fd, frame, entry.size) < 0) break;
+
+        sprintf(buffer, "\r\n--" BOUNDARY "\r\n");
+        if(write(fd, buffer, strlen(buffer)) < 0) break;
+    }
+
+    free(frame);
+    close(mfd);
+    close(ifd);
+}
+
 /******************************************************************************
 Description.: Executes the specified CGI file if exists
 Input Value.: * fd...........: filedescriptor to send data to
@@ -1019,7 +1881,9 @@ void command_ng(int id, int fd, char *parameter)
 
     switch(dest) {
     case Dest_Input:
-        if(plugin_no < pglobal->incnt) {
+        if(plugin_no < pglobal->incnt && !input_ready(&pglobal->in[plugin_no])) {
+            DBG("Input plugin %d is still starting\n", plugin_no);
+        } else if(plugin_no < pglobal->incnt) {
             res = pglobal->in[plugin_no].cmd(plugin_no, command_id, group, ivalue, value);
         } else {
             DBG("Invalid plugin number: %d because only %d input plugins loaded", plugin_no,  pglobal->incnt-1);
@@ -1033,6 +1897,16 @@ void command_ng(int id, int fd, char *parameter)
         }
         break;
     case Dest_Program:
+        switch(command_id) {
+        case PROG_CMD_LOGLEVEL:
+            /* without a value the current level is just reported */
+            if(strstr(parameter, "value=") != NULL)
+                log_set_level(ivalue);
+            res = log_get_level();
+            break;
+        default:
+            DBG("Invalid program command: %d\n", command_id);
+        }
         break;
     default:
         fprintf(stderr, "Illegal command destination: %d\n", dest);
@@ -1127,7 +2001,7 @@ void command(int id, int fd, char *parameter) {
   for ( i=0; i < LENGTH_OF(in_cmd_mapping); i++ ) {
     if ( strcmp(in_cmd_mapping[i].string, command) == 0 ) {
 
-      if ( pglobal->in[0].cmd_old == NULL )
+      if ( pglobal->in[0].cmd_old == NULL || !input_ready(&pglobal->in[0]) )
         continue;
 
       res = pglobal->in[0].cmd_old(in_cmd_mapping[i].cmd, iid, ivalue);
@@ -1179,7 +2053,24 @@ Return Value: always NULL
 /* thread for clients that connected to this server */
 void *client_thread(void *arg)
 {
-    int cnt;
+    context *pc = ((cfd *)arg)->pc;
+
+    serve_client(arg);
+
+    /* the connection was counted by the server thread */
+    release_client(pc);
+    return NULL;
+}
+
+/******************************************************************************
+Description.: Reads and answers the request of a connected client
+Input Value.: arg is the allocated cfd passed to the client thread
+Return Value: always NULL
+******************************************************************************/
+void *serve_client(void *arg)
+{
+    endpoint_t endpoint;
+    int cnt, retry;
     char query_suffixed = 0;
     int input_number = 0;
     char buffer[BUFFER_SIZE] = {0}, *pb = buffer;
@@ -1194,6 +2085,16 @@ void *client_thread(void *arg)
     } else
         return NULL;
 
+    if(getnameinfo((struct sockaddr *)&lcfd.addr, lcfd.addr_len, lcfd.address, sizeof(lcfd.address), NULL, 0, NI_NUMERICHOST) == 0) {
+        log_message(LOG_INFO, "", "serving client: %s\n", lcfd.address);
+    } else {
+        snprintf(lcfd.address, sizeof(lcfd.address), "unknown");
+    }
+
+    #if defined(MANAGMENT)
+    lcfd.client = add_client(lcfd.address);
+    #endif
+
     /* initializes the structures */
     init_iobuffer(&iobuf);
     init_request(&req);
@@ -1287,6 +2188,18 @@ void *client_thread(void *arg)
             close(lcfd.fd);
             return NULL;
         }
+    } else if(strstr(buffer, "GET /?action=playback") != NULL) {
+        int len;
+        req.type = A_PLAYBACK;
+
+        pb = strstr(buffer, "GET /?action=playback") + strlen("GET /?action=playback");
+
+        /* only accept certain characters */
+        len = MIN(MAX(strspn(pb, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ_-=&1234567890%."), 0), 200);
+        req.parameter = strndup(pb, len);
+        if(req.parameter == NULL) {
+            exit(EXIT_FAILURE);
+        }
     } else if((strstr(buffer, "GET /input") != NULL) && (strstr(buffer, ".json") != NULL)) {
         req.type = A_INPUT_JSON;
         query_suffixed = 255;
@@ -1295,6 +2208,8 @@ void *client_thread(void *arg)
         query_suffixed = 255;
     } else if(strstr(buffer, "GET /program.json") != NULL) {
         req.type = A_PROGRAM_JSON;
+    } else if(strstr(buffer, "GET /limits.json") != NULL) {
+        req.type = A_LIMITS_JSON;
     #ifdef MANAGMENT
     } else if(strstr(buffer, "GET /clients.json") != NULL) {
         req.type = A_CLIENTS_JSON;
@@ -1442,17 +2357,19 @@ void *client_thread(void *arg)
 
         if(strstr(buffer, "User-Agent: ") != NULL) {
             req.client = strdup(buffer + strlen("User-Agent: "));
-        } else if(strstr(buffer, "Authorization: Basic ") != NULL) {
-            req.credentials = strdup(buffer + strlen("Authorization: Basic "));
-            decodeBase64(req.credentials);
-            DBG("username:password: %s\n", req.credentials);
+        } else if(strncasecmp(buffer, "Range: ", strlen("Range: ")) == 0 && req.range == NULL) {
+            req.range = strndup(buffer + strlen("Range: "), strcspn(buffer + strlen("Range: "), "\r\n"));
+        } else if(lcfd.pc->conf.credential_count > 0 && (pb = strstr(buffer, "Authorization: Basic ")) != NULL) {
+            pb += strlen("Authorization: Basic ");
+            req.user = find_credential(&lcfd.pc->conf, pb, strcspn(pb, " \r\n"));
+            DBG("credential %s\n", (req.user == NULL) ? "unknown" : req.user->username);
         }
 
     } while(cnt > 2 && !(buffer[0] == '\r' && buffer[1] == '\n'));
 
     /* check for username and password if parameter -c was given */
-    if(lcfd.pc->conf.credentials != NULL) {
-        if(req.credentials == NULL || strcmp(lcfd.pc->conf.credentials, req.credentials) != 0) {
+    if(lcfd.pc->conf.credential_count > 0) {
+        if(req.user == NULL) {
             DBG("access denied\n");
             send_error(lcfd.fd, 401, "username and password do not match to configuration");
             close(lcfd.fd);
@@ -1462,6 +2379,54 @@ void *client_thread(void *arg)
         DBG("access granted\n");
     }
 
+    /* throttle the request rate per client address and per username */
+    lcfd.throttle_ip = get_throttle(lcfd.pc, "ip", lcfd.address);
+    lcfd.throttle_user = NULL;
+    if(req.user != NULL)
+        lcfd.throttle_user = get_throttle(lcfd.pc, "user", req.user->username);
+
+    if((retry = throttle_request(&lcfd)) != 0) {
+        DBG("request of %s throttled for %d s\n", lcfd.address, retry);
+        send_error_retry(lcfd.fd, 429, retry, "request rate limit exceeded");
+        put_throttle(lcfd.pc, lcfd.throttle_ip);
+        put_throttle(lcfd.pc, lcfd.throttle_user);
+        close(lcfd.fd);
+        free_request(&req);
+        return NULL;
+    }
+
+    /* limit how many requests of each kind are served at the same time */
+    switch(req.type) {
+    case A_STREAM:
+    case A_STREAM_WXP:
+    case A_PLAYBACK:
+        endpoint = EP_STREAM;
+        break;
+    case A_SNAPSHOT:
+    case A_SNAPSHOT_WXP:
+    case A_TAKE:
+        endpoint = EP_SNAPSHOT;
+        break;
+    case A_CGI:
+        endpoint = EP_CGI;
+        break;
+    case A_FILE:
+        endpoint = EP_FILE;
+        break;
+    default:
+        endpoint = EP_OTHER;
+    }
+
+    if(acquire_endpoint(lcfd.pc, endpoint) != 0) {
+        DBG("no free %s slot for %s\n", endpoint_names[endpoint], lcfd.address);
+        send_error(lcfd.fd, 503, "too many requests of this kind are served");
+        put_throttle(lcfd.pc, lcfd.throttle_ip);
+        put_throttle(lcfd.pc, lcfd.throttle_user);
+        close(lcfd.fd);
+        free_request(&req);
+        return NULL;
+    }
+
     /* now it's time to answer */
     if (query_suffixed) {
         if (req.type == A_OUTPUT_JSON) {
@@ -1479,20 +2444,33 @@ void *client_thread(void *arg)
         }
     }
 
+    /* only streams work with inputs that capture H.264, the rest needs JPEG pictures */
+    if((req.type == A_SNAPSHOT || req.type == A_SNAPSHOT_WXP || req.type == A_STREAM_WXP || req.type == A_TAKE) &&
+       input_is_h264(&pglobal->in[input_number])) {
+        send_error(lcfd.fd, 415, "this input delivers H.264, use ?action=stream");
+        req.type = A_UNKNOWN;
+    }
+
     switch(req.type) {
     case A_SNAPSHOT_WXP:
     case A_SNAPSHOT:
         DBG("Request for snapshot from input: %d\n", input_number);
+        input_attach(&pglobal->in[input_number]);
         send_snapshot(&lcfd, input_number);
+        input_detach(&pglobal->in[input_number]);
         break;
     case A_STREAM:
         DBG("Request for stream from input: %d\n", input_number);
+        input_attach(&pglobal->in[input_number]);
         send_stream(&lcfd, input_number);
+        input_detach(&pglobal->in[input_number]);
         break;
     #ifdef WXP_COMPAT
     case A_STREAM_WXP:
         DBG("Request for WXP compat stream from input: %d\n", input_number);
+        input_attach(&pglobal->in[input_number]);
         send_stream_wxp(&lcfd, input_number);
+        input_detach(&pglobal->in[input_number]);
         break;
     #endif
     case A_COMMAND_NG:
@@ -1521,17 +2499,27 @@ void *client_thread(void *arg)
         DBG("Request for the program descriptor JSON file\n");
         send_program_JSON(lcfd.fd);
         break;
+    case A_LIMITS_JSON:
+        DBG("Request for the limits JSON file\n");
+        send_limits_JSON(lcfd.pc->id, lcfd.fd);
+        break;
     #ifdef MANAGMENT
     case A_CLIENTS_JSON:
         DBG("Request for the clients JSON file\n");
-        send_clients_JSON(lcfd.fd);
+        send_clients_JSON(lcfd.pc->id, lcfd.fd);
         break;
     #endif
     case A_FILE:
         if(lcfd.pc->conf.www_folder == NULL)
             send_error(lcfd.fd, 501, "no www-folder configured");
         else
-            send_file(lcfd.pc->id, lcfd.fd, req.parameter);
+            send_file(&lcfd, req.parameter, req.range);
+        break;
+    case A_PLAYBACK:
+        if(lcfd.pc->conf.www_folder == NULL)
+            send_error(lcfd.fd, 501, "no www-folder configured");
+        else
+            send_playback(&lcfd, req.parameter);
         break;
     /*
         With the take argument we try to save the current image to file before we transmit it to the user.
@@ -1575,7 +2563,9 @@ void *client_thread(void *arg)
             send_error(lcfd.fd, 404, "FILE output plugin not loaded, taking snapshot not possible");
         } else {
             if (ret == 0) {
+                input_attach(&pglobal->in[input_number]);
                 send_snapshot(&lcfd, input_number);
+                input_detach(&pglobal->in[input_number]);
             } else {
                 send_error(lcfd.fd, 404, "Taking snapshot failed!");
             }
@@ -1589,6 +2579,10 @@ void *client_thread(void *arg)
         DBG("unknown request\n");
     }
 
+    release_endpoint(lcfd.pc, endpoint);
+    put_throttle(lcfd.pc, lcfd.throttle_ip);
+    put_throttle(lcfd.pc, lcfd.throttle_user);
+
     close(lcfd.fd);
     free_request(&req);
 
@@ -1622,10 +2616,9 @@ void *server_thread(void *arg)
 {
     int on;
     pthread_t client;
+    pthread_attr_t attr;
     struct addrinfo *aip, *aip2;
     struct addrinfo hints;
-    struct sockaddr_storage client_addr;
-    socklen_t addr_len = sizeof(struct sockaddr_storage);
     fd_set selectfds;
     int max_fds = 0;
     char name[NI_MAXHOST];
@@ -1714,16 +2707,13 @@ void *server_thread(void *arg)
         exit(EXIT_FAILURE);
     }
 
+    /* client threads need little stack, keep the memory of many clients low */
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setstacksize(&attr, CLIENT_THREAD_STACK);
+
     /* create a child for every client that connects */
     while(!pglobal->stop) {
-        //int *pfd = (int *)malloc(sizeof(int));
-        cfd *pcfd = malloc(sizeof(cfd));
-
-        if(pcfd == NULL) {
-            fprintf(stderr, "failed to allocate (a very small amount of) memory\n");
-            exit(EXIT_FAILURE);
-        }
-
         DBG("waiting for clients to connect\n");
 
         do {
@@ -1748,33 +2738,48 @@ void *server_thread(void *arg)
 
         for(i = 0; i < max_fds + 1; i++) {
             if(pcontext->sd[i] != -1 && FD_ISSET(pcontext->sd[i], &selectfds)) {
-                pcfd->fd = accept(pcontext->sd[i], (struct sockaddr *)&client_addr, &addr_len);
+                cfd *pcfd = malloc(sizeof(cfd));
+
+                if(pcfd == NULL) {
+                    fprintf(stderr, "failed to allocate (a very small amount of) memory\n");
+                    exit(EXIT_FAILURE);
+                }
+
+                /* keep the accept path short, name lookup and logging are done by the client thread */
+                pcfd->addr_len = sizeof(pcfd->addr);
+                pcfd->fd = accept(pcontext->sd[i], (struct sockaddr *)&pcfd->addr, &pcfd->addr_len);
                 pcfd->pc = pcontext;
 
-                /* start new thread that will handle this TCP connected client */
-                DBG("create thread to handle client that just established a connection\n");
+                if(pcfd->fd < 0) {
+                    free(pcfd);
+                    continue;
+                }
 
-                if(getnameinfo((struct sockaddr *)&client_addr, addr_len, name, sizeof(name), NULL, 0, NI_NUMERICHOST) == 0) {
-                    syslog(LOG_INFO, "serving client: %s\n", name);
-                    DBG("serving client: %s\n", name);
+                /* answer right away instead of starting yet another thread */
+                if(!admit_client(pcontext)) {
+                    DBG("too many clients connected\n");
+                    send_error(pcfd->fd, 503, "too many clients connected");
+                    close(pcfd->fd);
+                    free(pcfd);
+                    continue;
                 }
 
-                #if defined(MANAGMENT)
-                pcfd->client = add_client(name);
-                #endif
+                /* start new thread that will handle this TCP connected client */
+                DBG("create thread to handle client that just established a connection\n");
 
-                if(pthread_create(&client, NULL, &client_thread, pcfd) != 0) {
+                if(pthread_create(&client, &attr, &client_thread, pcfd) != 0) {
                     DBG("could not launch another client thread\n");
+                    release_client(pcontext);
                     close(pcfd->fd);
                     free(pcfd);
                     continue;
                 }
-                pthread_detach(client);
             }
         }
     }
 
     DBG("leaving server thread, calling cleanup function now\n");
+    pthread_attr_destroy(&attr);
     pthread_cleanup_pop(1);
 
     return NULL;
@@ -1789,7 +2794,9 @@ Return Value: -
 void send_input_JSON(int fd, int input_number)
 {
     char buffer[BUFFER_SIZE*16] = {0}; // FIXME do reallocation if the buffer size is small
-    int i, headerLength;
+    int i, headerLength, stale, width, height, consumers, ready, h264;
+    unsigned int format_seq;
+    input_stats stats;
     sprintf(buffer, "HTTP/1.0 200 OK\r\n" \
             "Content-type: %s\r\n" \
             STD_HEADER \
@@ -1797,11 +2804,16 @@ void send_input_JSON(int fd, int input_number)
 
     DBG("Serving the input plugin %d descriptor JSON file\n", input_number);
 
+    /* controls and formats are only known once the input started */
+    ready = input_ready(&pglobal->in[input_number]);
+    if(ready && pglobal->in[input_number].enumerate != NULL)
+        pglobal->in[input_number].enumerate(input_number);
+
     headerLength = strlen(buffer);
     sprintf(buffer + headerLength,
             "{\n"
             "\"controls\": [\n");
-    if(pglobal->in[input_number].in_parameters != NULL) {
+    if(ready && pglobal->in[input_number].in_parameters != NULL) {
         for(i = 0; i < pglobal->in[input_number].parametercount; i++) {
 
             char *menuString = NULL;
@@ -1888,7 +2900,7 @@ void send_input_JSON(int fd, int input_number)
     sprintf(buffer + strlen(buffer),
             //"{\n"
             "\"formats\": [\n");
-    if(pglobal->in[input_number].in_formats != NULL) {
+    if(ready && pglobal->in[input_number].in_formats != NULL) {
         for(i = 0; i < pglobal->in[input_number].formatCount; i++) {
             char *resolutionsString = NULL;
             int resolutionsStringLength = 0;
@@ -1979,9 +2991,52 @@ void send_input_JSON(int fd, int input_number)
             free(resolutionsString);
         }
     }
+
+    pthread_mutex_lock(&pglobal->in[input_number].db);
+    stats = pglobal->in[input_number].stats;
+    stale = pglobal->in[input_number].stale;
+    width = pglobal->in[input_number].width;
+    height = pglobal->in[input_number].height;
+    format_seq = pglobal->in[input_number].format_seq;
+    h264 = input_is_h264(&pglobal->in[input_number]);
+    consumers = __atomic_load_n(&pglobal->in[input_number].consumers, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&pglobal->in[input_number].db);
+
     sprintf(buffer + strlen(buffer),
-            "\n]\n"
-            "}\n");
+            "\n],\n"
+            "\"stats\": {\n"
+            "\"frames\": %lu,\n"
+            "\"drops\": %lu,\n"
+            "\"buffers\": %d,\n"
+            "\"queueDepth\": %d,\n"
+            "\"waitAverage\": %llu,\n"
+            "\"waitMax\": %lu,\n"
+            "\"stale\": %s,\n"
+            "\"reconnects\": %lu,\n"
+            "\"recoveryTime\": %lu,\n"
+            "\"width\": %d,\n"
+            "\"height\": %d,\n"
+            "\"formatChanges\": %u,\n"
+            "\"switchTime\": %lu,\n"
+            "\"corrupt\": %lu,\n"
+            "\"consumers\": %d,\n"
+            "\"published\": %lu,\n"
+            "\"latencyAverage\": %llu,\n"
+            "\"latencyMax\": %lu,\n"
+            "\"cpuPerFrame\": %llu,\n"
+            "\"format\": \"%s\",\n"
+            "\"keyframes\": %lu,\n"
+            "\"ready\": %s\n"
+            "}\n"
+            "}\n",
+            stats.frames, stats.drops, stats.buffers, stats.queue_depth,
+            (stats.frames > 0) ? stats.wait_total / stats.frames : 0, stats.wait_max,
+            stale ? "true" : "false", stats.reconnects, stats.recovery_time,
+            width, height, (format_seq > 0) ? format_seq - 1 : 0, stats.switch_time, stats.corrupt, consumers,
+            stats.published, (stats.published > 0) ? stats.latency_total / stats.published : 0, stats.latency_max,
+            (stats.published > 0) ? stats.cpu_time / stats.published : 0,
+            h264 ? "H264" : "MJPEG", stats.keyframes,
+            ready ? "true" : "false");
     i = strlen(buffer);
     check_JSON_string(buffer, headerLength, i);
 
@@ -2178,10 +3233,21 @@ void send_output_JSON(int fd, int input_number)
 }
 
 #ifdef MANAGMENT
-void send_clients_JSON(int fd)
+/******************************************************************************
+Description.: Send a JSON file which contains the known clients and the
+              throttling counters of every client address and credential.
+              It names addresses and usernames, so it is only served with
+              MANAGMENT, /limits.json has the totals.
+Input Value.: * id: specifies which server-context is the right one
+              * fd: fildescriptor to send the answer to
+Return Value: -
+******************************************************************************/
+void send_clients_JSON(int id, int fd)
 {
     char buffer[BUFFER_SIZE*16] = {0}; // FIXME do reallocation if the buffer size is small
     unsigned long i = 0, headerLength;
+    throttle_info *t;
+    int first;
     sprintf(buffer, "HTTP/1.0 200 OK\r\n" \
             "Content-type: %s\r\n" \
             STD_HEADER \
@@ -2209,19 +3275,158 @@ void send_clients_JSON(int fd)
     }
 
     sprintf(buffer + strlen(buffer),
-            "]");
+            "],\n"
+            "\"throttle\": [\n");
+
+    pthread_mutex_lock(&servers[id].throttle_mutex);
+    for(i = 0, first = 1; i < THROTTLE_BUCKETS; i++)
+    for(t = servers[id].throttles[i]; t != NULL; t = t->next) {
+        /* leave some space for the closing brackets */
+        if(strlen(buffer) + 512 > sizeof(buffer))
+            break;
+
+        sprintf(buffer + strlen(buffer),
+            "%s{\n"
+            "\"key\": \"%s\",\n"
+            "\"requests\": %lu,\n"
+            "\"requests_throttled\": %lu,\n"
+            "\"bytes_sent\": %llu,\n"
+            "\"frames_dropped\": %lu\n"
+            "}",
+            first ? "" : ",\n",
+            t->key,
+            t->requests_total,
+            t->requests_throttled,
+            t->bytes_sent,
+            t->frames_dropped);
+        first = 0;
+    }
+    pthread_mutex_unlock(&servers[id].throttle_mutex);
 
     sprintf(buffer + strlen(buffer),
-            "\n}\n");
+            "\n]\n}\n");
     i = strlen(buffer);
+    check_JSON_string(buffer, headerLength, i);
 
     /* first transmit HTTP-header, afterwards transmit content of file */
     if(write(fd, buffer, i) < 0) {
-        DBG("unable to serve the control JSON file\n");
+        DBG("unable to serve the clients JSON file\n");
     }
 }
 #endif
 
+/******************************************************************************
+Description.: Send a JSON file with the totals of the request throttling, one
+              for the client addresses and one for the credentials, and the
+              counters of the client and endpoint limits. No address or
+              username is part of it.
+Input Value.: * id: specifies which server-context is the right one
+              * fd: fildescriptor to send the answer to
+Return Value: -
+******************************************************************************/
+void send_limits_JSON(int id, int fd)
+{
+    char buffer[BUFFER_SIZE*4] = {0};
+    unsigned long i = 0, headerLength;
+    throttle_info *t;
+    struct {
+        unsigned long tracked;
+        unsigned long requests;
+        unsigned long requests_throttled;
+        unsigned long frames_dropped;
+        unsigned long long bytes_sent;
+    } totals[2], *total;
+
+    sprintf(buffer, "HTTP/1.0 200 OK\r\n" \
+            "Content-type: %s\r\n" \
+            STD_HEADER \
+            "\r\n", "application/x-javascript");
+
+    DBG("Serving the limits JSON file\n");
+
+    memset(totals, 0, sizeof(totals));
+
+    /* the keys are "ip:<address>" and "user:<username>" */
+    pthread_mutex_lock(&servers[id].throttle_mutex);
+    for(i = 0; i < THROTTLE_BUCKETS; i++)
+    for(t = servers[id].throttles[i]; t != NULL; t = t->next) {
+        total = (strncmp(t->key, "ip:", 3) == 0) ? &totals[0] : &totals[1];
+        total->tracked++;
+        total->requests += t->requests_total;
+        total->requests_throttled += t->requests_throttled;
+        total->frames_dropped += t->frames_dropped;
+        total->bytes_sent += t->bytes_sent;
+    }
+    pthread_mutex_unlock(&servers[id].throttle_mutex);
+
+    headerLength = strlen(buffer);
+    sprintf(buffer + headerLength,
+            "{\n"
+            "\"throttle\": [\n");
+
+    for(i = 0; i < 2; i++) {
+        sprintf(buffer + strlen(buffer),
+            "{\n"
+            "\"kind\": \"%s\",\n"
+            "\"tracked\": %lu,\n"
+            "\"requests\": %lu,\n"
+            "\"requests_throttled\": %lu,\n"
+            "\"bytes_sent\": %llu,\n"
+            "\"frames_dropped\": %lu\n"
+            "}%s\n",
+            (i == 0) ? "address" : "credential",
+            totals[i].tracked,
+            totals[i].requests,
+            totals[i].requests_throttled,
+            totals[i].bytes_sent,
+            totals[i].frames_dropped,
+            (i == 0) ? "," : "");
+    }
+
+    sprintf(buffer + strlen(buffer),
+            "],\n");
+
+    pthread_mutex_lock(&servers[id].admission_mutex);
+    sprintf(buffer + strlen(buffer),
+            "\"connections\": %d,\n"
+            "\"connections_limit\": %d,\n"
+            "\"connections_rejected\": %lu,\n"
+            "\"endpoints\": [\n",
+            servers[id].clients,
+            servers[id].conf.max_clients,
+            servers[id].clients_rejected);
+
+    for(i = 0; i < EP_COUNT; i++) {
+        sprintf(buffer + strlen(buffer),
+            "{\n"
+            "\"name\": \"%s\",\n"
+            "\"active\": %d,\n"
+            "\"waiting\": %d,\n"
+            "\"limit\": %d,\n"
+            "\"served\": %lu,\n"
+            "\"rejected\": %lu\n"
+            "}%s\n",
+            endpoint_names[i],
+            servers[id].active[i],
+            servers[id].waiting[i],
+            servers[id].conf.max_active[i],
+            servers[id].served[i],
+            servers[id].rejected[i],
+            (i != EP_COUNT - 1) ? "," : "");
+    }
+    pthread_mutex_unlock(&servers[id].admission_mutex);
+
+    sprintf(buffer + strlen(buffer),
+            "]\n}\n");
+    i = strlen(buffer);
+    check_JSON_string(buffer, headerLength, i);
+
+    /* first transmit HTTP-header, afterwards transmit content of file */
+    if(write(fd, buffer, i) < 0) {
+        DBG("unable to serve the limits JSON file\n");
+    }
+}
+
 
 /******************************************************************************
 Description.:   checks the source string for non printable characters and replaces them with space
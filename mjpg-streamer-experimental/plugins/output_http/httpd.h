@@ -77,9 +77,17 @@ static const struct {
     { ".swf",  "application/x-shockwave-flash" },
     { ".cab",  "application/x-shockwave-flash" },
     { ".jar",  "application/java-archive" },
-    { ".json", "application/json" }
+    { ".json", "application/json" },
+    { ".mjpg", "video/x-motion-jpeg" },
+    { ".mjpeg", "video/x-motion-jpeg" }
 };
 
+/* files are transmitted with sendfile() in pieces of this size, for throttling */
+#define SENDFILE_CHUNK (64 * 1024)
+
+/* playback skips pauses of a recording longer than this many microseconds */
+#define PLAYBACK_MAX_GAP 2000000
+
 /* the webserver determines between these values for an answer */
 typedef enum {
     A_UNKNOWN,
@@ -90,16 +98,32 @@ typedef enum {
     A_COMMAND_NG,
     A_COMMAND,
     A_FILE,
+    A_PLAYBACK,
     A_CGI,
     A_TAKE,
     A_INPUT_JSON,
     A_OUTPUT_JSON,
     A_PROGRAM_JSON,
+    A_LIMITS_JSON,
     #ifdef MANAGMENT
     A_CLIENTS_JSON
     #endif
 } answer_t;
 
+/*
+ * accepted "username:password" pair, kept in the form the client sends it,
+ * the base64 encoding, to compare the header without decoding it
+ */
+#define CREDENTIAL_BUCKETS 64
+
+typedef struct _credential credential;
+struct _credential {
+    credential *next;
+    char *token;            /* base64 encoded "username:password" */
+    size_t token_len;
+    char *username;
+};
+
 /*
  * the client sends information with each request
  * this structure is used to store the important parts
@@ -108,7 +132,8 @@ typedef struct {
     answer_t type;
     char *parameter;
     char *client;
-    char *credentials;
+    credential *user;       /* matching credential, NULL if none was sent or it did not match */
+    char *range;            /* value of the "Range" header */
     char *query_string;
 } request;
 
@@ -118,14 +143,72 @@ typedef struct {
     char buffer[IO_BUFFER]; /* the data */
 } iobuffer;
 
+/*
+ * requests are grouped into endpoints, each with its own concurrency limit
+ */
+typedef enum {
+    EP_STREAM,      /* streams and playback of recordings */
+    EP_SNAPSHOT,    /* single frames */
+    EP_CGI,
+    EP_FILE,
+    EP_OTHER,       /* commands and JSON files */
+    EP_COUNT
+} endpoint_t;
+
+static const char * const endpoint_names[EP_COUNT] = { "stream", "snapshot", "cgi", "file", "other" };
+
+/* default limits, each client has its own thread with a small stack */
+#define DEFAULT_MAX_CLIENTS 256
+#define DEFAULT_QUEUE_TIMEOUT 2000
+#define CLIENT_THREAD_STACK (256 * 1024)
+
 /* store configuration for each server instance */
 typedef struct {
     int port;
-    char *credentials;
+    credential *credentials[CREDENTIAL_BUCKETS]; /* hash table indexed by the token */
+    int credential_count;
     char *www_folder;
     char nocommands;
+    double max_requests;    /* requests per second per client, 0 means unlimited */
+    double max_bandwidth;   /* bytes per second per client, 0 means unlimited */
+    int max_clients;        /* connected clients, 0 means unlimited */
+    int max_active[EP_COUNT]; /* requests served at the same time, 0 means unlimited */
+    int queue_timeout;      /* milliseconds a request waits for a free slot */
 } config;
 
+/*
+ * token bucket used for throttling, it gets refilled with "rate" tokens
+ * per second and holds at most "burst" tokens. The level may become
+ * negative if more was spent than available, this debt is paid back first.
+ */
+typedef struct {
+    double tokens;
+    double rate;
+    double burst;
+    struct timespec last;
+} token_bucket;
+
+/*
+ * throttling state of a single client address or credential,
+ * the key is "ip:<address>" or "user:<username>". Entries nobody used for
+ * THROTTLE_IDLE seconds have full buckets again and are forgotten.
+ */
+#define THROTTLE_BUCKETS 256
+#define THROTTLE_IDLE 60
+
+typedef struct _throttle_info {
+    struct _throttle_info *next;
+    char *key;
+    int users;                  /* client threads holding it, see put_throttle() */
+    time_t released;            /* CLOCK_MONOTONIC seconds the last user let go */
+    token_bucket requests;
+    token_bucket bytes;
+    unsigned long requests_total;
+    unsigned long requests_throttled;
+    unsigned long frames_dropped;
+    unsigned long long bytes_sent;
+} throttle_info;
+
 /* context of each server thread */
 typedef struct {
     int sd[MAX_SD_LEN];
@@ -135,6 +218,21 @@ typedef struct {
     pthread_t threadID;
 
     config conf;
+
+    /* throttling state of the recent clients, hash table indexed by the key */
+    throttle_info *throttles[THROTTLE_BUCKETS];
+    time_t throttle_sweep;              /* when idle entries were evicted last */
+    pthread_mutex_t throttle_mutex;
+
+    /* admission control, all counters are guarded by admission_mutex */
+    pthread_mutex_t admission_mutex;
+    pthread_cond_t admission_cond;
+    int clients;                        /* connected clients */
+    unsigned long clients_rejected;
+    int active[EP_COUNT];               /* requests being served */
+    int waiting[EP_COUNT];              /* requests waiting for a free slot */
+    unsigned long served[EP_COUNT];
+    unsigned long rejected[EP_COUNT];
 } context;
 
 
@@ -163,6 +261,11 @@ struct {
 typedef struct {
     context *pc;
     int fd;
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    char address[NI_MAXHOST];
+    throttle_info *throttle_ip;
+    throttle_info *throttle_user;
     #ifdef MANAGMENT
     client_info *client;
     #endif
@@ -172,17 +275,36 @@ typedef struct {
 
 /* prototypes */
 void *server_thread(void *arg);
+void *serve_client(void *arg);
 void send_error(int fd, int which, char *message);
+void send_error_retry(int fd, int which, int retry, char *message);
 void send_output_JSON(int fd, int plugin_number);
 void send_input_JSON(int fd, int plugin_number);
 void send_program_JSON(int fd);
 void check_JSON_string(char *string, unsigned int offset, unsigned int size);
+void send_limits_JSON(int id, int fd);
+int parse_range(const char *range, off_t size, off_t *start, off_t *end);
+void send_playback(cfd *context_fd, char *parameter);
+
+int admit_client(context *pc);
+void release_client(context *pc);
+int acquire_endpoint(context *pc, endpoint_t endpoint);
+void release_endpoint(context *pc, endpoint_t endpoint);
+
+int add_credential(config *conf, const char *plain);
+credential *find_credential(config *conf, const char *token, size_t len);
+
+throttle_info *get_throttle(context *pc, const char *prefix, const char *name);
+void put_throttle(context *pc, throttle_info *t);
+int throttle_request(cfd *context_fd);
+int throttle_frame(cfd *context_fd, int size);
+void throttle_send(cfd *context_fd, int size);
 
 #ifdef MANAGMENT
 client_info *add_client(char *address);
 int check_client_status(client_info *client);
 void update_client_timestamp(client_info *client);
-void send_clients_JSON(int fd);
+void send_clients_JSON(int id, int fd);
 #endif
 
 
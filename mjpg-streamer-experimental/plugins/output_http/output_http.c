@@ -33,6 +33,8 @@
 #include <getopt.h>
 #include <pthread.h>
 #include <syslog.h>
+#include <netdb.h>
+#include <time.h>
 
 #include <linux/types.h>          /* for videodev2.h */
 #include <linux/videodev2.h>
@@ -61,9 +63,22 @@ void help(void)
             " [-w | --www ]...........: folder that contains webpages in \n" \
             "                           flat hierarchy (no subfolders)\n" \
             " [-p | --port ]..........: TCP port for this HTTP server\n" \
-            " [-c | --credentials ]...: ask for \"username:password\" on connect\n" \
+            " [-c | --credentials ]...: ask for \"username:password\" on connect,\n" \
+            "                           repeat to accept several users\n" \
             " [-n | --nocommands ]....: disable execution of commands\n"
-            " ---------------------------------------------------------------\n");
+            " [-r | --requests ]......: limit each client address and each\n" \
+            "                           credential to this many requests/s\n" \
+            " [-b | --bandwidth ].....: limit each client address and each\n" \
+            "                           credential to this many bytes/s,\n" \
+            "                           streams get a lower framerate instead\n"
+            " [-l | --limit ].........: maximum number of connected clients,\n" \
+            "                           default %d, 0 means unlimited\n" \
+            " [-e | --endpoints ].....: maximum number of requests served at the\n" \
+            "                           same time per endpoint, for example\n" \
+            "                           \"stream=8,snapshot=20,cgi=2,file=10\"\n" \
+            " [-q | --queue ].........: milliseconds a request waits for a free\n" \
+            "                           slot of its endpoint, default %d\n"
+            " ---------------------------------------------------------------\n", DEFAULT_MAX_CLIENTS, DEFAULT_QUEUE_TIMEOUT);
 }
 
 /*** plugin interface functions ***/
@@ -80,15 +95,21 @@ int output_init(output_parameter *param, int id)
 {
     int i;
     int  port;
-    char *credentials, *www_folder;
+    char *www_folder;
     char nocommands;
+    double max_requests, max_bandwidth;
+    int max_clients, queue_timeout, max_active[EP_COUNT] = {0};
+    char *spec, *value;
 
     DBG("output #%02d\n", param->id);
 
     port = htons(8080);
-    credentials = NULL;
     www_folder = NULL;
     nocommands = 0;
+    max_requests = 0;
+    max_bandwidth = 0;
+    max_clients = DEFAULT_MAX_CLIENTS;
+    queue_timeout = DEFAULT_QUEUE_TIMEOUT;
 
     param->argv[0] = OUTPUT_PLUGIN_NAME;
     param->global->out[id].name = malloc((strlen(OUTPUT_PLUGIN_NAME) + 1) * sizeof(char));
@@ -114,6 +135,16 @@ int output_init(output_parameter *param, int id)
             {"www", required_argument, 0, 0},
             {"n", no_argument, 0, 0},
             {"nocommands", no_argument, 0, 0},
+            {"r", required_argument, 0, 0},
+            {"requests", required_argument, 0, 0},
+            {"b", required_argument, 0, 0},
+            {"bandwidth", required_argument, 0, 0},
+            {"l", required_argument, 0, 0},
+            {"limit", required_argument, 0, 0},
+            {"e", required_argument, 0, 0},
+            {"endpoints", required_argument, 0, 0},
+            {"q", required_argument, 0, 0},
+            {"queue", required_argument, 0, 0},
             {0, 0, 0, 0}
         };
 
@@ -148,7 +179,10 @@ int output_init(output_parameter *param, int id)
         case 4:
         case 5:
             DBG("case 4,5\n");
-            credentials = strdup(optarg);
+            if(add_credential(&servers[param->id].conf, optarg) != 0) {
+                OPRINT("could not allocate memory\n");
+                return 1;
+            }
             break;
 
             /* w, www */
@@ -167,20 +201,115 @@ int output_init(output_parameter *param, int id)
             DBG("case 8,9\n");
             nocommands = 1;
             break;
+
+            /* r, requests */
+        case 10:
+        case 11:
+            DBG("case 10,11\n");
+            max_requests = MAX(strtod(optarg, NULL), 0);
+            break;
+
+            /* b, bandwidth */
+        case 12:
+        case 13:
+            DBG("case 12,13\n");
+            max_bandwidth = MAX(strtod(optarg, NULL), 0);
+            break;
+
+            /* l, limit */
+        case 14:
+        case 15:
+            DBG("case 14,15\n");
+            max_clients = MAX(atoi(optarg), 0);
+            break;
+
+            /* e, endpoints */
+        case 16:
+        case 17:
+            DBG("case 16,17\n");
+            for(spec = strtok(optarg, ","); spec != NULL; spec = strtok(NULL, ",")) {
+                if((value = strchr(spec, '=')) == NULL) {
+                    help();
+                    return 1;
+                }
+                *value++ = '\0';
+                for(i = 0; i < EP_COUNT; i++) {
+                    if(strcmp(spec, endpoint_names[i]) == 0)
+                        break;
+                }
+                if(i == EP_COUNT) {
+                    OPRINT("unknown endpoint %s\n", spec);
+                    return 1;
+                }
+                max_active[i] = MAX(atoi(value), 0);
+            }
+            break;
+
+            /* q, queue */
+        case 18:
+        case 19:
+            DBG("case 18,19\n");
+            queue_timeout = MAX(atoi(optarg), 0);
+            break;
         }
     }
 
     servers[param->id].id = param->id;
     servers[param->id].pglobal = param->global;
     servers[param->id].conf.port = port;
-    servers[param->id].conf.credentials = credentials;
     servers[param->id].conf.www_folder = www_folder;
     servers[param->id].conf.nocommands = nocommands;
+    servers[param->id].conf.max_requests = max_requests;
+    servers[param->id].conf.max_bandwidth = max_bandwidth;
+    memset(servers[param->id].throttles, 0, sizeof(servers[param->id].throttles));
+    servers[param->id].throttle_sweep = 0;
+    if(pthread_mutex_init(&servers[param->id].throttle_mutex, NULL) != 0) {
+        OPRINT("could not initialize mutex variable\n");
+        return 1;
+    }
+
+    servers[param->id].conf.max_clients = max_clients;
+    servers[param->id].conf.queue_timeout = queue_timeout;
+    memcpy(servers[param->id].conf.max_active, max_active, sizeof(max_active));
+    if(pthread_mutex_init(&servers[param->id].admission_mutex, NULL) != 0) {
+        OPRINT("could not initialize mutex variable\n");
+        return 1;
+    }
+    if(pthread_cond_init(&servers[param->id].admission_cond, NULL) != 0) {
+        OPRINT("could not initialize condition variable\n");
+        return 1;
+    }
 
     OPRINT("www-folder-path...: %s\n", (www_folder == NULL) ? "disabled" : www_folder);
     OPRINT("HTTP TCP port.....: %d\n", ntohs(port));
-    OPRINT("username:password.: %s\n", (credentials == NULL) ? "disabled" : credentials);
+    if(servers[param->id].conf.credential_count > 0) {
+        OPRINT("username:password.: %d accepted\n", servers[param->id].conf.credential_count);
+    } else {
+        OPRINT("username:password.: %s\n", "disabled");
+    }
     OPRINT("commands..........: %s\n", (nocommands) ? "disabled" : "enabled");
+    if(max_requests > 0) {
+        OPRINT("requests/client...: %.2f/s\n", max_requests);
+    } else {
+        OPRINT("requests/client...: %s\n", "unlimited");
+    }
+    if(max_bandwidth > 0) {
+        OPRINT("bandwidth/client..: %.0f bytes/s\n", max_bandwidth);
+    } else {
+        OPRINT("bandwidth/client..: %s\n", "unlimited");
+    }
+    if(max_clients > 0) {
+        OPRINT("clients...........: %d\n", max_clients);
+    } else {
+        OPRINT("clients...........: %s\n", "unlimited");
+    }
+    for(i = 0; i < EP_COUNT; i++) {
+        if(max_active[i] > 0) {
+            char label[] = "..................";
+            memcpy(label, endpoint_names[i], MIN(strlen(endpoint_names[i]), sizeof(label) - 1));
+            OPRINT("%s: %d at once, queue %d ms\n", label, max_active[i], queue_timeout);
+        }
+    }
 
     return 0;
 }
@@ -159,9 +159,18 @@ void *worker_thread(void *arg)
 
 
         DBG("waiting for fresh frame\n");
-        pthread_mutex_lock(&pglobal->in[plugin_number].db);
+        input_attach(&pglobal->in[input_number]);
+        pthread_mutex_lock(&pglobal->in[input_number].db);
         pthread_cond_wait(&pglobal->in[input_number].db_update, &pglobal->in[input_number].db);
 
+        /* the frames are sent as JPEG, the format is known with the frames */
+        if(input_is_h264(&pglobal->in[input_number])) {
+            pthread_mutex_unlock(&pglobal->in[input_number].db);
+            input_detach(&pglobal->in[input_number]);
+            OPRINT("ERROR: input %d delivers H.264, this plugin only sends JPEG frames\n", input_number);
+            break;
+        }
+
         /* read buffer */
         frame_size = pglobal->in[input_number].size;
 
@@ -172,6 +181,7 @@ void *worker_thread(void *arg)
             max_frame_size = frame_size + (1 << 16);
             if((tmp_framebuffer = realloc(frame, max_frame_size)) == NULL) {
                 pthread_mutex_unlock(&pglobal->in[input_number].db);
+                input_detach(&pglobal->in[input_number]);
                 LOG("not enough memory\n");
                 return NULL;
             }
@@ -180,10 +190,11 @@ void *worker_thread(void *arg)
         }
 
         /* copy frame to our local buffer now */
-        memcpy(frame, pglobal->in[input_number].buf, frame_size);
+        input_copy_frame(&pglobal->in[input_number], frame);
 
         /* allow others to access the global buffer again */
         pthread_mutex_unlock(&pglobal->in[input_number].db);
+        input_detach(&pglobal->in[input_number]);
 
         /* only save a file if a name came in with the UDP message */
         if(strlen(udpbuffer) > 0) {
@@ -29,6 +29,9 @@
 
 #include <SDL/SDL.h>
 #include <jpeglib.h>
+#ifdef USE_TURBOJPEG
+#include <turbojpeg.h>
+#endif
 
 
 #include "../../utils.h"
@@ -36,9 +39,25 @@
 
 #define OUTPUT_PLUGIN_NAME "VIEWER output plugin"
 
+/* larger frames are skipped */
+#define MAX_FRAME_SIZE (4096 * 1024)
+
 static pthread_t worker;
 static globals *pglobal;
 static unsigned char *frame = NULL;
+static int input_number = 0;
+
+/* libraries the frames can be decompressed with */
+enum {
+    CODEC_LIBJPEG = 0,
+    CODEC_TURBOJPEG = 1
+};
+#ifdef USE_TURBOJPEG
+static int codec = CODEC_TURBOJPEG;
+static tjhandle tj = NULL;
+#else
+static int codec = CODEC_LIBJPEG;
+#endif
 
 /******************************************************************************
 Description.: print a help message
@@ -49,6 +68,12 @@ void help(void)
 {
     fprintf(stderr, " ---------------------------------------------------------------\n" \
             " Help for output plugin..: "OUTPUT_PLUGIN_NAME"\n" \
+            " ---------------------------------------------------------------\n" \
+            " The following parameters can be passed to this plugin:\n\n" \
+            " [-c | --codec ].........: library that decompresses the frames,\n" \
+            "                           \"libjpeg\" or \"turbojpeg\" if built\n" \
+            "                           with USE_TURBOJPEG\n" \
+            " [-i | --input ].........: show the frames of this input plugin\n" \
             " ---------------------------------------------------------------\n");
 }
 
@@ -69,7 +94,13 @@ void worker_cleanup(void *arg)
     first_run = 0;
     OPRINT("cleaning up ressources allocated by worker thread\n");
 
+    input_detach(&pglobal->in[input_number]);
     free(frame);
+#ifdef USE_TURBOJPEG
+    if(tj != NULL)
+        tjDestroy(tj);
+    tj = NULL;
+#endif
     SDL_Quit();
 }
 
@@ -149,11 +180,68 @@ typedef struct {
     int buffersize;
 } decompressed_image;
 
+#ifdef USE_TURBOJPEG
+/******************************************************************************
+Description.: decompresses a JPEG to RGB with a single TurboJPEG call
+Input Value.: * jpeg, jpegsize: the compressed picture
+              * image.........: receives the decompressed picture, the buffer
+                                gets allocated if it is NULL
+Return Value: 0 if ok, 1 if the picture could not be decompressed
+******************************************************************************/
+static int decompress_jpeg_turbo(unsigned char *jpeg, int jpegsize, decompressed_image *image)
+{
+    int width, height, subsamp, colorspace;
+
+    if(tj == NULL && (tj = tjInitDecompress()) == NULL) {
+        DBG("could not create the TurboJPEG decompressor\n");
+        return 1;
+    }
+
+    if(tjDecompressHeader3(tj, jpeg, jpegsize, &width, &height, &subsamp, &colorspace) < 0) {
+        DBG("could not read the header: %s\n", tjGetErrorStr2(tj));
+        return 1;
+    }
+
+    /* just like below only colored JPEGs are expected */
+    if(colorspace != TJCS_YCbCr && colorspace != TJCS_RGB) {
+        DBG("unsupported colorspace\n");
+        return 1;
+    }
+
+    image->width = width;
+    image->height = height;
+
+    if(image->buffer == NULL) {
+        image->buffersize = width * height * 3;
+        /* the calling function has to ensure that this buffer will become freed after use! */
+        image->buffer = malloc(image->buffersize);
+        if(image->buffer == NULL) {
+            DBG("allocating memory failed\n");
+            return 1;
+        }
+    }
+
+    /* same speed over accuracy trade off as JDCT_FASTEST without fancy upsampling */
+    if(tjDecompress2(tj, jpeg, jpegsize, image->buffer, width, 0, height, TJPF_RGB, TJFLAG_FASTDCT | TJFLAG_FASTUPSAMPLE) < 0) {
+        DBG("could not decompress: %s\n", tjGetErrorStr2(tj));
+        return 1;
+    }
+
+    return 0;
+}
+#endif
+
 int decompress_jpeg(unsigned char *jpeg, int jpegsize, decompressed_image *image)
 {
     struct jpeg_decompress_struct cinfo;
-    JSAMPROW rowptr[1];
+    JSAMPROW rowptr[16];
     struct jpeg_error_mgr jerr;
+    int i, rows;
+
+#ifdef USE_TURBOJPEG
+    if(codec == CODEC_TURBOJPEG)
+        return decompress_jpeg_turbo(jpeg, jpegsize, image);
+#endif
 
     /* create an error handler that does not terminate MJPEG-streamer */
     cinfo.err = jpeg_std_error(&jerr);
@@ -220,10 +308,13 @@ int decompress_jpeg(unsigned char *jpeg, int jpegsize, decompressed_image *image
         return 1;
     }
 
+    /* read up to a whole MCU row per call instead of single scanlines */
     while(cinfo.output_scanline < cinfo.output_height) {
-        rowptr[0] = (JSAMPROW)(Uint8 *)image->buffer + cinfo.output_scanline * image->width * cinfo.num_components;
+        rows = MIN(cinfo.output_height - cinfo.output_scanline, 16);
+        for(i = 0; i < rows; i++)
+            rowptr[i] = (JSAMPROW)(Uint8 *)image->buffer + (cinfo.output_scanline + i) * image->width * cinfo.num_components;
 
-        if(jpeg_read_scanlines(&cinfo, rowptr, (JDIMENSION) 1) < 0) {
+        if(jpeg_read_scanlines(&cinfo, rowptr, (JDIMENSION) rows) < 0) {
             jpeg_destroy_decompress(&cinfo);
             DBG("could not decompress this line\n");
             return 1;
@@ -267,7 +358,7 @@ void *worker_thread(void *arg)
     }
 
     /* just allocate a large buffer for the JPEGs */
-    if((frame = malloc(4096 * 1024)) == NULL) {
+    if((frame = malloc(MAX_FRAME_SIZE)) == NULL) {
         OPRINT("not enough memory for worker thread\n");
         exit(EXIT_FAILURE);
     }
@@ -275,16 +366,31 @@ void *worker_thread(void *arg)
     /* set cleanup handler to cleanup allocated ressources */
     pthread_cleanup_push(worker_cleanup, NULL);
 
+    /* frames are wanted all the time */
+    input_attach(&pglobal->in[input_number]);
+
     while(!pglobal->stop) {
         DBG("waiting for fresh frame\n");
-        pthread_mutex_lock(&pglobal->db);
-        pthread_cond_wait(&pglobal->db_update, &pglobal->db);
+        pthread_mutex_lock(&pglobal->in[input_number].db);
+        pthread_cond_wait(&pglobal->in[input_number].db_update, &pglobal->in[input_number].db);
+
+        /* only JPEG can be decompressed, the format is known with the frames */
+        if(input_is_h264(&pglobal->in[input_number])) {
+            pthread_mutex_unlock(&pglobal->in[input_number].db);
+            OPRINT("ERROR: input %d delivers H.264, the viewer only shows JPEG frames\n", input_number);
+            break;
+        }
 
         /* read buffer */
-        frame_size = pglobal->size;
-        memcpy(frame, pglobal->buf, frame_size);
+        frame_size = pglobal->in[input_number].size;
+        if(frame_size > MAX_FRAME_SIZE) {
+            pthread_mutex_unlock(&pglobal->in[input_number].db);
+            DBG("frame of %d bytes is too large\n", frame_size);
+            continue;
+        }
+        input_copy_frame(&pglobal->in[input_number], frame);
 
-        pthread_mutex_unlock(&pglobal->db);
+        pthread_mutex_unlock(&pglobal->in[input_number].db);
 
         /* decompress the JPEG and store results in memory */
         if(decompress_jpeg(frame, frame_size, &rgbimage)) {
@@ -353,10 +459,14 @@ int output_init(output_parameter *param)
     reset_getopt();
     while(1) {
         int option_index = 0, c = 0;
-        static struct option long_options[] = \ {
+        static struct option long_options[] = {
             {"h", no_argument, 0, 0
             },
             {"help", no_argument, 0, 0},
+            {"c", required_argument, 0, 0},
+            {"codec", required_argument, 0, 0},
+            {"i", required_argument, 0, 0},
+            {"input", required_argument, 0, 0},
             {0, 0, 0, 0}
         };
 
@@ -379,10 +489,39 @@ int output_init(output_parameter *param)
             help();
             return 1;
             break;
+
+            /* c, codec */
+        case 2:
+        case 3:
+            DBG("case 2,3\n");
+            if(strcasecmp(optarg, "libjpeg") == 0) {
+                codec = CODEC_LIBJPEG;
+#ifdef USE_TURBOJPEG
+            } else if(strcasecmp(optarg, "turbojpeg") == 0) {
+                codec = CODEC_TURBOJPEG;
+#endif
+            } else {
+                OPRINT("codec %s is not available\n", optarg);
+                return 1;
+            }
+            break;
+
+            /* i, input */
+        case 4:
+        case 5:
+            DBG("case 4,5\n");
+            input_number = atoi(optarg);
+            break;
         }
     }
 
     pglobal = param->global;
+    if(!(input_number < pglobal->incnt)) {
+        OPRINT("ERROR: the %d input_plugin number is too much only %d plugins loaded\n", input_number, pglobal->incnt);
+        return 1;
+    }
+
+    OPRINT("JPEG codec........: %s\n", (codec == CODEC_TURBOJPEG) ? "turbojpeg" : "libjpeg");
 
     return 0;
 }
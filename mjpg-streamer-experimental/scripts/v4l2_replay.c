@@ -0,0 +1,561 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+/*
+ * An MJPEG camera for benchmarks without one. Preloaded into mjpg_streamer,
+ * it answers open(), ioctl() and mmap() for a device node that does not
+ * exist and replays the JPEG files of a directory as the frames of a
+ * V4L2_MEMORY_MMAP capture stream, looping over them at a fixed rate:
+ *
+ *   cc -shared -fPIC -O2 -o v4l2_replay.so scripts/v4l2_replay.c -ldl -lpthread
+ *   V4L2_REPLAY_FRAMES=frames/ LD_PRELOAD=./v4l2_replay.so \
+ *       ./mjpg_streamer -i "input_uvc.so -d /dev/replay" -o output_http.so
+ *
+ * V4L2_REPLAY_FRAMES.: directory with the *.jpg files, sorted by name
+ * V4L2_REPLAY_DEVICE.: device node to emulate, "/dev/replay" by default
+ * V4L2_REPLAY_FPS....: highest frame rate, 30 by default
+ *
+ * Like a real driver it drops a frame if no buffer is queued and counts it
+ * in the sequence numbers, so the statistics of input_uvc stay meaningful.
+ * Controls are not emulated.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+
+#include <linux/types.h>          /* for videodev2.h */
+#include <linux/videodev2.h>
+
+#define MAX_BUFFERS 16
+#define MAX_FRAMES 600
+
+struct frame {
+    unsigned char *data;
+    size_t size;
+};
+
+struct replay {
+    pthread_mutex_t mutex;
+    int fd;                         /* eventfd, readable for each filled buffer */
+    const char *device;
+    struct frame frames[MAX_FRAMES];
+    int nframes;
+    int next;
+    unsigned int width, height;
+    unsigned int fps, max_fps;
+
+    int nbuffers;
+    size_t length;
+    unsigned char *mem[MAX_BUFFERS];
+    struct v4l2_buffer buf[MAX_BUFFERS];
+    int queued[MAX_BUFFERS], nqueued;
+    int done[MAX_BUFFERS], ndone;
+    unsigned int sequence;
+
+    int streaming;
+    pthread_t producer;
+};
+
+static struct replay replay = { .mutex = PTHREAD_MUTEX_INITIALIZER, .fd = -1 };
+
+static int (*real_open)(const char *, int, ...);
+static int (*real_close)(int);
+static int (*real_ioctl)(int, unsigned long, ...);
+static void *(*real_mmap)(void *, size_t, int, int, int, off_t);
+static int (*real_access)(const char *, int);
+
+__attribute__((constructor)) static void replay_init(void)
+{
+    real_open = dlsym(RTLD_NEXT, "open");
+    real_close = dlsym(RTLD_NEXT, "close");
+    real_ioctl = dlsym(RTLD_NEXT, "ioctl");
+    real_mmap = dlsym(RTLD_NEXT, "mmap");
+    real_access = dlsym(RTLD_NEXT, "access");
+
+    replay.device = getenv("V4L2_REPLAY_DEVICE");
+    if(replay.device == NULL)
+        replay.device = "/dev/replay";
+    replay.max_fps = (getenv("V4L2_REPLAY_FPS") != NULL) ? atoi(getenv("V4L2_REPLAY_FPS")) : 30;
+    if(replay.max_fps == 0)
+        replay.max_fps = 30;
+}
+
+/******************************************************************************
+Description.: Reads the size of a JPEG frame from its SOF marker
+Input Value.: * f: the frame
+              * width, height: set to the size of the frame
+Return Value: 0 if ok, -1 if the frame has no SOF marker
+******************************************************************************/
+static int jpeg_size(const struct frame *f, unsigned int *width, unsigned int *height)
+{
+    size_t pos = 2;
+
+    while(pos + 9 < f->size) {
+        if(f->data[pos] != 0xFF) {
+            pos++;
+            continue;
+        }
+        if(f->data[pos + 1] >= 0xC0 && f->data[pos + 1] <= 0xC3) {
+            *height = (f->data[pos + 5] << 8) | f->data[pos + 6];
+            *width = (f->data[pos + 7] << 8) | f->data[pos + 8];
+            return 0;
+        }
+        pos += 2 + ((f->data[pos + 2] << 8) | f->data[pos + 3]);
+    }
+
+    return -1;
+}
+
+static int by_name(const void *a, const void *b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/******************************************************************************
+Description.: Loads the JPEG files of V4L2_REPLAY_FRAMES, the largest one sets
+              the size of the buffers, the first one the resolution
+Input Value.: -
+Return Value: 0 if ok, -1 if there are no usable frames
+******************************************************************************/
+static int load_frames(void)
+{
+    const char *folder = getenv("V4L2_REPLAY_FRAMES");
+    char *names[MAX_FRAMES], path[4096];
+    struct dirent *entry;
+    DIR *dir;
+    FILE *file;
+    long size;
+    int i, count = 0;
+
+    if(replay.nframes > 0)
+        return 0;
+
+    if(folder == NULL || (dir = opendir(folder)) == NULL) {
+        fprintf(stderr, "v4l2_replay: V4L2_REPLAY_FRAMES must name a folder with JPEG files\n");
+        return -1;
+    }
+    while(count < MAX_FRAMES && (entry = readdir(dir)) != NULL) {
+        const char *dot = strrchr(entry->d_name, '.');
+        if(dot != NULL && (strcasecmp(dot, ".jpg") == 0 || strcasecmp(dot, ".jpeg") == 0))
+            names[count++] = strdup(entry->d_name);
+    }
+    closedir(dir);
+    qsort(names, count, sizeof(char *), by_name);
+
+    replay.length = 0;
+    for(i = 0; i < count; i++) {
+        struct frame *f = &replay.frames[replay.nframes];
+
+        snprintf(path, sizeof(path), "%s/%s", folder, names[i]);
+        free(names[i]);
+        if((file = fopen(path, "rb")) == NULL)
+            continue;
+        fseek(file, 0, SEEK_END);
+        size = ftell(file);
+        rewind(file);
+        f->data = (size > 0) ? malloc(size) : NULL;
+        if(f->data == NULL || fread(f->data, 1, size, file) != (size_t)size) {
+            free(f->data);
+            fclose(file);
+            continue;
+        }
+        fclose(file);
+        f->size = size;
+
+        if(replay.nframes == 0 && jpeg_size(f, &replay.width, &replay.height) < 0) {
+            fprintf(stderr, "v4l2_replay: %s is not a JPEG file\n", path);
+            free(f->data);
+            continue;
+        }
+        if(f->size > replay.length)
+            replay.length = f->size;
+        replay.nframes++;
+    }
+
+    if(replay.nframes == 0) {
+        fprintf(stderr, "v4l2_replay: no JPEG files in %s\n", folder);
+        return -1;
+    }
+
+    /* the buffers get mapped one after another */
+    replay.length = (replay.length + getpagesize() - 1) & ~((size_t)getpagesize() - 1);
+    replay.fps = replay.max_fps;
+    return 0;
+}
+
+/******************************************************************************
+Description.: Fills the oldest queued buffer with the next frame at the frame
+              rate, while the stream is on
+Input Value.: -
+Return Value: NULL
+******************************************************************************/
+static void *producer_thread(void *arg)
+{
+    struct timespec next;
+    uint64_t one = 1;
+
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    while(1) {
+        pthread_mutex_lock(&replay.mutex);
+        if(!replay.streaming) {
+            pthread_mutex_unlock(&replay.mutex);
+            break;
+        }
+
+        if(replay.nqueued > 0) {
+            int index = replay.queued[0];
+            struct frame *f = &replay.frames[replay.next];
+            struct v4l2_buffer *buf = &replay.buf[index];
+            struct timespec now;
+
+            memmove(replay.queued, replay.queued + 1, --replay.nqueued * sizeof(int));
+            memcpy(replay.mem[index], f->data, f->size);
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            buf->bytesused = f->size;
+            buf->sequence = replay.sequence;
+            buf->timestamp.tv_sec = now.tv_sec;
+            buf->timestamp.tv_usec = now.tv_nsec / 1000;
+            buf->flags = V4L2_BUF_FLAG_DONE | V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC | V4L2_BUF_FLAG_KEYFRAME;
+            replay.done[replay.ndone++] = index;
+            if(write(replay.fd, &one, sizeof(one)) < 0)
+                perror("v4l2_replay: unable to write eventfd");
+        }
+        /* without a queued buffer the frame is dropped, like a driver does */
+        replay.sequence++;
+        replay.next = (replay.next + 1) % replay.nframes;
+
+        next.tv_nsec += 1000000000L / replay.fps;
+        if(next.tv_nsec >= 1000000000L) {
+            next.tv_sec++;
+            next.tv_nsec -= 1000000000L;
+        }
+        pthread_mutex_unlock(&replay.mutex);
+
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+    }
+
+    return NULL;
+}
+
+/******************************************************************************
+Description.: Stops the stream, all buffers are dequeued afterwards
+Input Value.: -
+Return Value: -
+******************************************************************************/
+static void stream_off(void)
+{
+    uint64_t count;
+
+    pthread_mutex_lock(&replay.mutex);
+    if(!replay.streaming) {
+        pthread_mutex_unlock(&replay.mutex);
+        return;
+    }
+    replay.streaming = 0;
+    pthread_mutex_unlock(&replay.mutex);
+    pthread_join(replay.producer, NULL);
+
+    replay.nqueued = 0;
+    replay.ndone = 0;
+    while(read(replay.fd, &count, sizeof(count)) > 0);
+}
+
+static void set_format(struct v4l2_format *fmt)
+{
+    fmt->fmt.pix.width = replay.width;
+    fmt->fmt.pix.height = replay.height;
+    fmt->fmt.pix.pixelformat = V4L2_PIX_FMT_MJPEG;
+    fmt->fmt.pix.field = V4L2_FIELD_NONE;
+    fmt->fmt.pix.bytesperline = 0;
+    fmt->fmt.pix.sizeimage = replay.length;
+    fmt->fmt.pix.colorspace = V4L2_COLORSPACE_JPEG;
+}
+
+/******************************************************************************
+Description.: Answers the ioctls input_uvc needs for MMAP streaming
+Input Value.: * request: the ioctl
+              * arg....: its argument
+Return Value: 0 if ok, -1 with errno set in case of error
+******************************************************************************/
+static int replay_ioctl(unsigned int request, void *arg)
+{
+    switch(request) {
+    case VIDIOC_QUERYCAP: {
+        struct v4l2_capability *cap = arg;
+        memset(cap, 0, sizeof(*cap));
+        snprintf((char *)cap->driver, sizeof(cap->driver), "v4l2_replay");
+        snprintf((char *)cap->card, sizeof(cap->card), "replayed MJPEG camera");
+        snprintf((char *)cap->bus_info, sizeof(cap->bus_info), "replay:%s", replay.device);
+        cap->device_caps = V4L2_CAP_VIDEO_CAPTURE | V4L2_CAP_STREAMING;
+        cap->capabilities = cap->device_caps | V4L2_CAP_DEVICE_CAPS;
+        return 0;
+    }
+    case VIDIOC_ENUMINPUT: {
+        struct v4l2_input *input = arg;
+        if(input->index != 0)
+            break;
+        memset(input, 0, sizeof(*input));
+        snprintf((char *)input->name, sizeof(input->name), "replay");
+        input->type = V4L2_INPUT_TYPE_CAMERA;
+        return 0;
+    }
+    case VIDIOC_ENUM_FMT: {
+        struct v4l2_fmtdesc *desc = arg;
+        if(desc->index != 0 || desc->type != V4L2_BUF_TYPE_VIDEO_CAPTURE)
+            break;
+        desc->flags = V4L2_FMT_FLAG_COMPRESSED;
+        desc->pixelformat = V4L2_PIX_FMT_MJPEG;
+        snprintf((char *)desc->description, sizeof(desc->description), "Motion-JPEG");
+        return 0;
+    }
+    case VIDIOC_ENUM_FRAMESIZES: {
+        struct v4l2_frmsizeenum *size = arg;
+        if(size->index != 0 || size->pixel_format != V4L2_PIX_FMT_MJPEG)
+            break;
+        size->type = V4L2_FRMSIZE_TYPE_DISCRETE;
+        size->discrete.width = replay.width;
+        size->discrete.height = replay.height;
+        return 0;
+    }
+    case VIDIOC_G_FMT:
+    case VIDIOC_S_FMT:
+    case VIDIOC_TRY_FMT: {
+        struct v4l2_format *fmt = arg;
+        if(fmt->type != V4L2_BUF_TYPE_VIDEO_CAPTURE)
+            break;
+        if(request == VIDIOC_S_FMT && replay.nbuffers > 0) {
+            errno = EBUSY;
+            return -1;
+        }
+        set_format(fmt);
+        return 0;
+    }
+    case VIDIOC_G_PARM:
+    case VIDIOC_S_PARM: {
+        struct v4l2_streamparm *parm = arg;
+        struct v4l2_fract *tpf = &parm->parm.capture.timeperframe;
+        if(parm->type != V4L2_BUF_TYPE_VIDEO_CAPTURE)
+            break;
+        pthread_mutex_lock(&replay.mutex);
+        if(request == VIDIOC_S_PARM && tpf->numerator > 0 && tpf->denominator > 0) {
+            replay.fps = tpf->denominator / tpf->numerator;
+            if(replay.fps < 1)
+                replay.fps = 1;
+            if(replay.fps > replay.max_fps)
+                replay.fps = replay.max_fps;
+        }
+        memset(&parm->parm, 0, sizeof(parm->parm));
+        parm->parm.capture.capability = V4L2_CAP_TIMEPERFRAME;
+        tpf->numerator = 1;
+        tpf->denominator = replay.fps;
+        pthread_mutex_unlock(&replay.mutex);
+        return 0;
+    }
+    case VIDIOC_REQBUFS: {
+        struct v4l2_requestbuffers *rb = arg;
+        int i;
+        if(rb->type != V4L2_BUF_TYPE_VIDEO_CAPTURE || rb->memory != V4L2_MEMORY_MMAP)
+            break;
+        if(replay.streaming) {
+            errno = EBUSY;
+            return -1;
+        }
+        if(rb->count > MAX_BUFFERS)
+            rb->count = MAX_BUFFERS;
+        if(rb->count > 0 && rb->count < 2)
+            rb->count = 2;
+        replay.nbuffers = rb->count;
+        for(i = 0; i < replay.nbuffers; i++) {
+            memset(&replay.buf[i], 0, sizeof(struct v4l2_buffer));
+            replay.buf[i].index = i;
+            replay.buf[i].type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+            replay.buf[i].memory = V4L2_MEMORY_MMAP;
+            replay.buf[i].length = replay.length;
+            replay.buf[i].m.offset = i * replay.length;
+            replay.buf[i].field = V4L2_FIELD_NONE;
+            replay.mem[i] = NULL;
+        }
+        return 0;
+    }
+    case VIDIOC_QUERYBUF: {
+        struct v4l2_buffer *buf = arg;
+        if(buf->index >= (unsigned int)replay.nbuffers)
+            break;
+        *buf = replay.buf[buf->index];
+        return 0;
+    }
+    case VIDIOC_QBUF: {
+        struct v4l2_buffer *buf = arg;
+        int i;
+        if(buf->index >= (unsigned int)replay.nbuffers || replay.mem[buf->index] == NULL)
+            break;
+        pthread_mutex_lock(&replay.mutex);
+        for(i = 0; i < replay.nqueued; i++) {
+            if(replay.queued[i] == (int)buf->index) {
+                pthread_mutex_unlock(&replay.mutex);
+                errno = EINVAL;
+                return -1;
+            }
+        }
+        replay.queued[replay.nqueued++] = buf->index;
+        replay.buf[buf->index].flags = V4L2_BUF_FLAG_QUEUED;
+        pthread_mutex_unlock(&replay.mutex);
+        return 0;
+    }
+    case VIDIOC_DQBUF: {
+        struct v4l2_buffer *buf = arg;
+        uint64_t count;
+        int index;
+        if(read(replay.fd, &count, sizeof(count)) < 0)
+            return -1;
+        pthread_mutex_lock(&replay.mutex);
+        index = replay.done[0];
+        memmove(replay.done, replay.done + 1, --replay.ndone * sizeof(int));
+        *buf = replay.buf[index];
+        pthread_mutex_unlock(&replay.mutex);
+        return 0;
+    }
+    case VIDIOC_STREAMON:
+        pthread_mutex_lock(&replay.mutex);
+        if(!replay.streaming) {
+            replay.streaming = 1;
+            if(pthread_create(&replay.producer, NULL, producer_thread, NULL) != 0) {
+                replay.streaming = 0;
+                pthread_mutex_unlock(&replay.mutex);
+                errno = ENOMEM;
+                return -1;
+            }
+        }
+        pthread_mutex_unlock(&replay.mutex);
+        return 0;
+    case VIDIOC_STREAMOFF:
+        stream_off();
+        return 0;
+    default:
+        /* controls, standards and the rest are not emulated */
+        errno = ENOTTY;
+        return -1;
+    }
+
+    errno = EINVAL;
+    return -1;
+}
+
+int open(const char *path, int flags, ...)
+{
+    mode_t mode = 0;
+    va_list ap;
+
+    if(flags & (O_CREAT | O_TMPFILE)) {
+        va_start(ap, flags);
+        mode = va_arg(ap, mode_t);
+        va_end(ap);
+    }
+
+    if(strcmp(path, replay.device) != 0)
+        return real_open(path, flags, mode);
+
+    /* one process, one camera */
+    if(replay.fd >= 0) {
+        errno = EBUSY;
+        return -1;
+    }
+    if(load_frames() < 0) {
+        errno = ENOENT;
+        return -1;
+    }
+    replay.fd = eventfd(0, EFD_SEMAPHORE | EFD_NONBLOCK | EFD_CLOEXEC);
+    replay.nbuffers = 0;
+    return replay.fd;
+}
+
+int open64(const char *path, int flags, ...) __attribute__((alias("open")));
+
+int close(int fd)
+{
+    if(fd >= 0 && fd == replay.fd) {
+        stream_off();
+        replay.nbuffers = 0;
+        replay.fd = -1;
+    }
+    return real_close(fd);
+}
+
+int ioctl(int fd, unsigned long request, ...)
+{
+    va_list ap;
+    void *arg;
+
+    va_start(ap, request);
+    arg = va_arg(ap, void *);
+    va_end(ap);
+
+    if(fd < 0 || fd != replay.fd)
+        return real_ioctl(fd, request, arg);
+    /* like the kernel, only the lower 32 bits count, an int request got sign extended */
+    return replay_ioctl((unsigned int)request, arg);
+}
+
+void *mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset)
+{
+    int index;
+
+    if(fd < 0 || fd != replay.fd)
+        return real_mmap(addr, length, prot, flags, fd, offset);
+
+    index = (replay.length > 0) ? (int)(offset / replay.length) : -1;
+    if(index < 0 || index >= replay.nbuffers || length > replay.length) {
+        errno = EINVAL;
+        return MAP_FAILED;
+    }
+
+    /* munmap() of the application releases it */
+    replay.mem[index] = real_mmap(NULL, length, prot, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(replay.mem[index] == MAP_FAILED) {
+        replay.mem[index] = NULL;
+        return MAP_FAILED;
+    }
+    return replay.mem[index];
+}
+
+#ifdef __LP64__
+void *mmap64(void *addr, size_t length, int prot, int flags, int fd, off_t offset) __attribute__((alias("mmap")));
+#endif
+
+/* input_uvc checks with access() whether a device went away */
+int access(const char *path, int mode)
+{
+    if(strcmp(path, replay.device) == 0)
+        return 0;
+    return real_access(path, mode);
+}
@@ -0,0 +1,214 @@
+#!/bin/sh
+
+#/******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+#******************************************************************************/
+
+## Benchmarks input_uvc without a camera. The kernel's vivid driver (virtual
+## video test driver) is the source, unless another device is given with -d.
+## Every pixel format is streamed for a while, then the statistics input_uvc
+## reports in input_0.json are printed:
+## - frames published per second
+## - capture to publish latency, average and maximum
+## - CPU time per published frame, including the encoder threads
+## - frames the driver or input_uvc dropped
+##
+## usage: scripts/vivid_bench.sh [-d device] [-r WxH] [-f fps] [-t seconds]
+##                               [-p port] [-o "input_uvc options"]
+##                               [-m folder] [formats]
+## formats: MJPEG YUYV RGB565 RGB24, all of them by default
+##
+## Run it from the directory mjpg_streamer was built in. Without -d the vivid
+## module gets loaded, which needs root. Other formats the device does not
+## have are skipped. vivid does not offer MJPEG, so MJPEG is replayed from
+## the JPEG files in the folder given with -m by scripts/v4l2_replay.c, an
+## LD_PRELOAD library that emulates the camera. Without -m the frames are
+## recorded from input_testpicture with output_file first. The exit status
+## is 1 if a format did not deliver any frames or MJPEG could not be
+## replayed.
+
+DEVICE=""
+RESOLUTION="640x480"
+FPS="30"
+SECONDS_PER_FORMAT="10"
+PORT="8089"
+OPTIONS=""
+FRAMES=""
+
+while getopts "d:r:f:t:p:o:m:h" opt; do
+    case $opt in
+        d) DEVICE="$OPTARG" ;;
+        r) RESOLUTION="$OPTARG" ;;
+        f) FPS="$OPTARG" ;;
+        t) SECONDS_PER_FORMAT="$OPTARG" ;;
+        p) PORT="$OPTARG" ;;
+        o) OPTIONS="$OPTARG" ;;
+        m) FRAMES="$OPTARG" ;;
+        *) sed -n 's/^## \{0,1\}//p' "$0"; exit 0 ;;
+    esac
+done
+shift $((OPTIND - 1))
+FORMATS="${*:-MJPEG YUYV RGB565 RGB24}"
+
+if [ ! -x ./mjpg_streamer ] || [ ! -f ./input_uvc.so ] || [ ! -f ./output_http.so ]; then
+    echo "mjpg_streamer, input_uvc.so and output_http.so must be built in $(pwd)" >&2
+    exit 1
+fi
+
+# find the capture node of vivid in sysfs, it is called "vivid-000-vid-cap"
+find_vivid() {
+    for name in /sys/class/video4linux/video*/name; do
+        [ -f "$name" ] || continue
+        case "$(cat "$name")" in
+            vivid-*-vid-cap) echo "/dev/$(basename "$(dirname "$name")")"; return 0 ;;
+        esac
+    done
+    return 1
+}
+
+# vivid never has MJPEG, whether v4l2-ctl is there to tell or not
+VIVID=""
+if [ -z "$DEVICE" ]; then
+    VIVID="yes"
+    DEVICE="$(find_vivid)"
+    if [ -z "$DEVICE" ]; then
+        modprobe vivid n_devs=1 node_types=0x1 || exit 1
+        sleep 1
+        DEVICE="$(find_vivid)"
+    fi
+    if [ -z "$DEVICE" ]; then
+        echo "no vivid capture device found" >&2
+        exit 1
+    fi
+fi
+
+# a value of the stats object of input_0.json
+json_value() {
+    sed -n "s/^\"$1\": \"\{0,1\}\([^\",]*\)\"\{0,1\},\{0,1\}$/\1/p" "$2" | tail -n 1
+}
+
+# tells if the device offers a pixel format, assumes it does without v4l2-ctl
+has_format() {
+    command -v v4l2-ctl > /dev/null || return 0
+    v4l2-ctl -d "$DEVICE" --list-formats 2> /dev/null | grep -q "'$1'"
+}
+
+# builds the replay library and records frames if -m was not given, the
+# reason it failed is printed
+prepare_replay() {
+    if ! ${CC:-cc} -shared -fPIC -O2 -o "$WORK/v4l2_replay.so" \
+            "$(dirname "$0")/v4l2_replay.c" -ldl -lpthread 2> /dev/null; then
+        echo "scripts/v4l2_replay.c does not build"
+        return 1
+    fi
+
+    if [ -z "$FRAMES" ]; then
+        if [ ! -f ./input_testpicture.so ] || [ ! -f ./output_file.so ]; then
+            echo "no frames, give -m or build input_testpicture.so and output_file.so"
+            return 1
+        fi
+        FRAMES="$WORK/frames"
+        mkdir -p "$FRAMES"
+        LD_LIBRARY_PATH="$(pwd)" ./mjpg_streamer \
+            -i "input_testpicture.so -r $RESOLUTION -d 33" \
+            -o "output_file.so -f $FRAMES -d 0" > /dev/null 2>&1 &
+        PID=$!
+        sleep 2
+        kill -INT $PID 2> /dev/null
+        wait $PID 2> /dev/null
+    fi
+
+    if ! ls "$FRAMES" | grep -qi '\.jpe\{0,1\}g$'; then
+        echo "no JPEG files in $FRAMES"
+        return 1
+    fi
+    return 0
+}
+
+WORK="$(mktemp -d)"
+JSON="$WORK/input_0.json"
+STATUS=0
+REPLAYED=""
+
+echo "device $DEVICE, $RESOLUTION at $FPS fps, $SECONDS_PER_FORMAT s per format"
+printf "%-7s %8s %10s %10s %10s %7s %7s\n" "format" "fps" "latency" "max" "cpu/frame" "drops" "corrupt"
+
+for format in $FORMATS; do
+    case $format in
+        MJPEG)  fourcc="MJPG"; option="" ;;
+        YUYV)   fourcc="YUYV"; option="-y" ;;
+        RGB565) fourcc="RGBP"; option="-fourcc RGBP" ;;
+        RGB24)  fourcc="RGB3"; option="-fourcc RGB3" ;;
+        *) echo "unknown format $format" >&2; STATUS=1; continue ;;
+    esac
+
+    device="$DEVICE"
+    preload=""
+    label="$format"
+    if { [ "$format" = "MJPEG" ] && [ -n "$VIVID" ]; } || ! has_format "$fourcc"; then
+        if [ "$format" != "MJPEG" ]; then
+            printf "%-7s %s\n" "$format" "not offered by $DEVICE, skipped"
+            continue
+        fi
+
+        if [ -n "$FRAMES" ]; then
+            REPLAYED="$FRAMES"
+        else
+            REPLAYED="frames of input_testpicture"
+        fi
+        if ! reason="$(prepare_replay)"; then
+            printf "%-7s %s\n" "$format" "cannot be replayed: $reason"
+            STATUS=1
+            continue
+        fi
+        [ -n "$FRAMES" ] || FRAMES="$WORK/frames"
+        device="/dev/replay"
+        preload="$WORK/v4l2_replay.so"
+        label="MJPEG*"
+    fi
+
+    LD_LIBRARY_PATH="$(pwd)" LD_PRELOAD="$preload" \
+    V4L2_REPLAY_DEVICE="$device" V4L2_REPLAY_FRAMES="$FRAMES" V4L2_REPLAY_FPS="$FPS" \
+        ./mjpg_streamer -l 3 \
+        -i "input_uvc.so -d $device -r $RESOLUTION -f $FPS $option $OPTIONS" \
+        -o "output_http.so -p $PORT" > /dev/null 2>&1 &
+    PID=$!
+
+    sleep "$SECONDS_PER_FORMAT"
+    curl -s -o "$JSON" "http://127.0.0.1:$PORT/input_0.json"
+    kill -INT $PID 2> /dev/null
+    wait $PID 2> /dev/null
+
+    published="$(json_value published "$JSON")"
+    if [ -z "$published" ] || [ "$published" -eq 0 ]; then
+        printf "%-7s %s\n" "$label" "no frames"
+        STATUS=1
+        continue
+    fi
+
+    printf "%-7s %8s %8sus %8sus %8sus %7s %7s\n" "$label" \
+        "$(awk "BEGIN { printf \"%.1f\", $published / $SECONDS_PER_FORMAT }")" \
+        "$(json_value latencyAverage "$JSON")" "$(json_value latencyMax "$JSON")" \
+        "$(json_value cpuPerFrame "$JSON")" "$(json_value drops "$JSON")" \
+        "$(json_value corrupt "$JSON")"
+done
+
+[ -z "$REPLAYED" ] || echo "* replayed by scripts/v4l2_replay.c from $REPLAYED, $DEVICE has no MJPEG"
+rm -rf "$WORK"
+exit $STATUS